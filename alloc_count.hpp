@@ -0,0 +1,167 @@
+#pragma once
+/**
+ * @file
+ * @description per-thread allocation counters.
+ *
+ * Define CYBOZU_ALLOC_COUNT (make ALLOC_COUNT=1) to interpose
+ * operator new/delete, posix_memalign() and free().
+ * Each thread counts its own allocations and frees.
+ * Without the macro, the counters are always zero.
+ *
+ * The interposers are defined in this header,
+ * so include it from only one translation unit of a binary.
+ */
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <new>
+
+namespace bench {
+
+struct AllocStat
+{
+    uint64_t nAlloc;
+    uint64_t allocBytes;
+    uint64_t nFree;
+
+    AllocStat() : nAlloc(0), allocBytes(0), nFree(0) {}
+    AllocStat &operator+=(const AllocStat &rhs) {
+        nAlloc += rhs.nAlloc;
+        allocBytes += rhs.allocBytes;
+        nFree += rhs.nFree;
+        return *this;
+    }
+    AllocStat operator-(const AllocStat &rhs) const {
+        AllocStat s;
+        s.nAlloc = nAlloc - rhs.nAlloc;
+        s.allocBytes = allocBytes - rhs.allocBytes;
+        s.nFree = nFree - rhs.nFree;
+        return s;
+    }
+    double allocsPerOp(uint64_t nOps) const {
+        return nOps == 0 ? 0 : nAlloc / (double)nOps;
+    }
+    double bytesPerOp(uint64_t nOps) const {
+        return nOps == 0 ? 0 : allocBytes / (double)nOps;
+    }
+};
+
+#ifdef CYBOZU_ALLOC_COUNT
+constexpr bool isAllocCountEnabled = true;
+#else
+constexpr bool isAllocCountEnabled = false;
+#endif
+
+namespace local {
+
+/* Trivially constructible so that it can be used inside malloc. */
+static thread_local uint64_t nAlloc_;
+static thread_local uint64_t allocBytes_;
+static thread_local uint64_t nFree_;
+
+static inline void countAlloc(size_t size)
+{
+    nAlloc_++;
+    allocBytes_ += size;
+}
+
+static inline void countFree()
+{
+    nFree_++;
+}
+
+} //namespace local
+
+/**
+ * Counters of the calling thread.
+ */
+static inline AllocStat getAllocStat()
+{
+    AllocStat s;
+    s.nAlloc = local::nAlloc_;
+    s.allocBytes = local::allocBytes_;
+    s.nFree = local::nFree_;
+    return s;
+}
+
+} //namespace bench
+
+#ifdef CYBOZU_ALLOC_COUNT
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void __libc_free(void *p);
+}
+
+void *operator new(size_t size)
+{
+    void *p = ::__libc_malloc(size == 0 ? 1 : size);
+    if (!p) throw std::bad_alloc();
+    bench::local::countAlloc(size);
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return ::operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    void *p = ::__libc_malloc(size == 0 ? 1 : size);
+    if (p) bench::local::countAlloc(size);
+    return p;
+}
+
+void *operator new[](size_t size, const std::nothrow_t &nt) noexcept
+{
+    return ::operator new(size, nt);
+}
+
+void operator delete(void *p) noexcept
+{
+    if (!p) return;
+    bench::local::countFree();
+    ::__libc_free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    ::operator delete(p);
+}
+
+/**
+ * free() is also called for memory allocated inside libc (not counted),
+ * so nFree may be a little larger than nAlloc.
+ */
+extern "C" int posix_memalign(void **pp, size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0 || align % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+    void *p = ::__libc_memalign(align, size);
+    if (!p) return ENOMEM;
+    bench::local::countAlloc(size);
+    *pp = p;
+    return 0;
+}
+
+extern "C" void free(void *p)
+{
+    if (!p) return;
+    bench::local::countFree();
+    ::__libc_free(p);
+}
+
+#endif /* CYBOZU_ALLOC_COUNT */
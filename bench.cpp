@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <cstring>
 #include <atomic>
 #include <thread>
 #include <memory>
@@ -17,16 +18,7 @@
 #include "spinlock.hpp"
 #include "bench_util.hpp"
 #include "util.hpp"
-
-/**
- * Recent Intel CPU's cacheline size is 64byte.
- * You should use this with alignas(64).
- */
-struct CacheLine
-{
-    uint64_t i[8]; // 64 byte.
-    CacheLine() { i[0] = 0; }
-};
+#include "counter.hpp"
 
 /**
  * Counter without any synchronization.
@@ -83,8 +75,9 @@ public:
     }
 private:
     void run() override {
+        cybozu::LockProfile &prof = CYBOZU_LOCK_PROFILE(CYBOZU_LOCK_SITE);
         while (!isEnd_.load(std::memory_order_relaxed)) {
-            cybozu::SpinlockT<useHLE, useTTAS> lk(mutex_);
+            cybozu::ProfiledSpinlockT<useHLE, useTTAS> lk(mutex_, prof);
             if (!isCountLater) counter_++;
             if (0 < delayUs) bench::delayUsec(delayUs);
             if (isCountLater) counter_++;
@@ -104,7 +97,7 @@ private:
     uint64_t &counter_; /* number of executed critical sections. not shared. */
     const size_t nAccess_;
     const size_t nLines_;
-    std::vector<CacheLine> counters_;
+    cybozu::CacheLineArray counters_;
 public:
     SpinAccessSizeWorkerT(
         char &mutex, uint64_t &counter,
@@ -119,11 +112,12 @@ private:
      * TODO: fair choise of access area.
      */
     void run() override {
+        cybozu::LockProfile &prof = CYBOZU_LOCK_PROFILE(CYBOZU_LOCK_SITE);
         while (!isEnd_.load(std::memory_order_relaxed)) {
-            cybozu::SpinlockT<useHLE, useTTAS> lk(mutex_);
+            cybozu::ProfiledSpinlockT<useHLE, useTTAS> lk(mutex_, prof);
             for (size_t i = 0; i < nAccess_; i++) {
                 size_t idx = i % (nLines_ - 1);
-                counters_[idx].i[0]++;
+                counters_[idx].value++;
             }
             counter_++;
          }
@@ -145,8 +139,9 @@ public:
     }
 private:
     void run() override {
+        cybozu::LockProfile &prof = CYBOZU_LOCK_PROFILE(CYBOZU_LOCK_SITE);
         while (!isEnd_.load(std::memory_order_relaxed)) {
-            std::lock_guard<std::mutex> lk(mutex_);
+            cybozu::ProfiledMutexLock lk(mutex_, prof);
             counter_++;
         }
     }
@@ -159,17 +154,16 @@ private:
 void testNone(size_t nThreads, size_t execMs)
 {
     cybozu::thread::ThreadRunnerSet thSet;
-    std::vector<CacheLine> counterV(nThreads);
+    cybozu::StripedCounter counterV(nThreads);
     alignas(64) std::atomic<bool> isReady(false);
     alignas(64) std::atomic<bool> isEnd(false);
     for (size_t i = 0; i < nThreads; i++) {
-        thSet.add(std::make_shared<NoneWorker>(counterV[i].i[0], isReady, isEnd));
+        thSet.add(std::make_shared<NoneWorker>(counterV[i], isReady, isEnd));
     }
     cybozu::time::TimeStack<> ts;
     bench::runBench(thSet, isReady, isEnd, ts, execMs);
 
-    uint64_t counter = 0;
-    for (auto c : counterV) counter += c.i[0];
+    uint64_t counter = counterV.sum();
     double throughput = counter / (double)ts.elapsedInUs();
     double latency = ts.elapsedInNs() / (double)counter;
     ::printf("None:       %12" PRIu64 " counts  %lu us  %zu threads  %f counts/us  %f ns/count\n"
@@ -209,22 +203,22 @@ void testSpinlockSh(size_t nThreads, size_t execMs)
 {
     cybozu::thread::ThreadRunnerSet thSet;
     alignas(64) char mutex = 0;
-    std::vector<CacheLine> counterV(nThreads);
+    cybozu::StripedCounter counterV(nThreads);
     alignas(64) std::atomic<bool> isReady(false);
     alignas(64) std::atomic<bool> isEnd(false);
     for (size_t i = 0; i < nThreads; i++) {
         thSet.add(std::make_shared<SpinWorkerT<useHLE, useTTAS, 0, false> >(
-                      mutex, counterV[i].i[0], isReady, isEnd));
+                      mutex, counterV[i], isReady, isEnd));
     }
     cybozu::time::TimeStack<> ts;
     bench::runBench(thSet, isReady, isEnd, ts, execMs);
 
-    uint64_t counter = 0;
-    for (auto c : counterV) counter += c.i[0];
+    uint64_t counter = counterV.sum();
     double throughput = counter / (double)ts.elapsedInUs();
     double latency = ts.elapsedInNs() / (double)counter;
     ::printf("SpinSh_%d_%d: %12" PRIu64 " counts  %lu us  %zu threads  %f counts/us  %f ns/count\n"
              , useHLE, useTTAS, counter, ts.elapsedInUs(), nThreads, throughput, latency);
+    bench::reportLockProfile();
     ::fflush(::stdout);
 }
 
@@ -251,6 +245,7 @@ void testSpinlockEx(size_t nThreads, size_t execMs)
     double latency = ts.elapsedInNs() / (double)counter;
     ::printf("SpinEx_%d_%d: %12" PRIu64 " counts  %lu us  %zu threads  %f counts/us  %f ns/count\n"
              , useHLE, useTTAS, counter, ts.elapsedInUs(), nThreads, throughput, latency);
+    bench::reportLockProfile();
     ::fflush(::stdout);
 }
 
@@ -275,10 +270,15 @@ void testMutexlock(size_t nThreads, size_t execMs)
     double latency = ts.elapsedInNs() / (double)counter;
     ::printf("Mutexlock:  %12" PRIu64 " counts  %lu us  %zu threads  %f counts/us  %f ns/count\n"
              , counter, ts.elapsedInUs(), nThreads, throughput, latency);
+    bench::reportLockProfile();
     ::fflush(::stdout);
 }
 
-int main(UNUSED int argc, UNUSED char *argv[])
+/**
+ * Usage: bench [--smoke]
+ *   --smoke: a short sweep for regression checks with bench_compare.
+ */
+int main(int argc, char *argv[])
 {
     //size_t nThreads = 4;
     //if (1 < argc) nThreads = ::atoi(argv[1]);
@@ -289,7 +289,13 @@ int main(UNUSED int argc, UNUSED char *argv[])
     size_t execMs = 3000;
     size_t nTrials = 2;
 #endif
-    for (size_t nThreads = 1; nThreads <= 12; nThreads++) {
+    size_t maxThreads = 12;
+    if (1 < argc && ::strcmp(argv[1], "--smoke") == 0) {
+        execMs = 100;
+        nTrials = 7;
+        maxThreads = 2;
+    }
+    for (size_t nThreads = 1; nThreads <= maxThreads; nThreads++) {
         for (size_t i = 0; i < nTrials; i++) {
             testNone(nThreads, execMs);
             testAtomic(nThreads, execMs);
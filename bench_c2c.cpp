@@ -0,0 +1,198 @@
+/**
+ * @file
+ * @description core-to-core latency matrix.
+ *
+ * Two threads pinned to a cpu pair pass a cache line
+ * (or a lock) back and forth.
+ * The result of each measurement is printed as an N x N matrix
+ * where the row is the first cpu and the column is the second one.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+
+#include <immintrin.h> /* for _mm_pause() */
+
+#include "thread_util.hpp"
+#include "time.hpp"
+
+#include "spinlock.hpp"
+#include "bench_util.hpp"
+#include "util.hpp"
+
+/**
+ * Ping-pong a cache line.
+ * The ping side waits for even values and the pong side waits for odd values.
+ */
+class PingPongWorker : public bench::Worker
+{
+private:
+    std::atomic<uint64_t> &line_;
+    uint64_t &counter_; /* number of round trips. */
+    const bool isPing_;
+public:
+    PingPongWorker(std::atomic<uint64_t> &line, uint64_t &counter, bool isPing,
+                   const std::atomic<bool> &isReady, const std::atomic<bool> &isEnd)
+        : bench::Worker(isReady, isEnd), line_(line), counter_(counter), isPing_(isPing) {
+    }
+private:
+    void run() override {
+        const uint64_t parity = isPing_ ? 0 : 1;
+        while (!isEnd_.load(std::memory_order_relaxed)) {
+            uint64_t v = line_.load(std::memory_order_acquire);
+            if (v % 2 != parity) {
+                _mm_pause();
+                continue;
+            }
+            line_.store(v + 1, std::memory_order_release);
+            if (isPing_) counter_++;
+        }
+    }
+};
+
+/**
+ * Hand a lock over to the other thread.
+ * The turn variable is protected by the lock.
+ */
+template <typename Mutex, typename Lock>
+class LockHandoffWorker : public bench::Worker
+{
+private:
+    Mutex &mutex_;
+    uint64_t &turn_;
+    uint64_t &counter_; /* number of handoffs. */
+    const uint64_t id_; /* 0 or 1. */
+public:
+    LockHandoffWorker(Mutex &mutex, uint64_t &turn, uint64_t &counter, uint64_t id,
+                      const std::atomic<bool> &isReady, const std::atomic<bool> &isEnd)
+        : bench::Worker(isReady, isEnd), mutex_(mutex), turn_(turn)
+        , counter_(counter), id_(id) {
+    }
+private:
+    void run() override {
+        while (!isEnd_.load(std::memory_order_relaxed)) {
+            Lock lk(mutex_);
+            if (turn_ == id_) {
+                turn_ = 1 - id_;
+                counter_++;
+            }
+        }
+    }
+};
+
+/**
+ * Cache line ping-pong between two cpus.
+ * RETURN:
+ *   round trip latency [ns].
+ */
+double measurePingPong(size_t cpu0, size_t cpu1, size_t execMs)
+{
+    cybozu::thread::ThreadRunnerSet thSet;
+    alignas(64) std::atomic<uint64_t> line(0);
+    alignas(64) uint64_t counter = 0;
+    alignas(64) std::atomic<bool> isReady(false);
+    alignas(64) std::atomic<bool> isEnd(false);
+    auto w0 = std::make_shared<PingPongWorker>(line, counter, true, isReady, isEnd);
+    auto w1 = std::make_shared<PingPongWorker>(line, counter, false, isReady, isEnd);
+    w0->setCpu(cpu0);
+    w1->setCpu(cpu1);
+    thSet.add(w0);
+    thSet.add(w1);
+    cybozu::time::TimeStack<> ts;
+    bench::runBench(thSet, isReady, isEnd, ts, execMs);
+
+    if (counter == 0) return 0;
+    return ts.elapsedInNs() / (double)counter;
+}
+
+/**
+ * Lock handoff between two cpus.
+ * RETURN:
+ *   handoff latency [ns].
+ */
+template <typename Mutex, typename Lock>
+double measureLockHandoff(size_t cpu0, size_t cpu1, size_t execMs)
+{
+    cybozu::thread::ThreadRunnerSet thSet;
+    alignas(64) Mutex mutex{};
+    alignas(64) uint64_t turn = 0;
+    alignas(64) uint64_t counter = 0;
+    alignas(64) std::atomic<bool> isReady(false);
+    alignas(64) std::atomic<bool> isEnd(false);
+    using Worker = LockHandoffWorker<Mutex, Lock>;
+    auto w0 = std::make_shared<Worker>(mutex, turn, counter, 0, isReady, isEnd);
+    auto w1 = std::make_shared<Worker>(mutex, turn, counter, 1, isReady, isEnd);
+    w0->setCpu(cpu0);
+    w1->setCpu(cpu1);
+    thSet.add(w0);
+    thSet.add(w1);
+    cybozu::time::TimeStack<> ts;
+    bench::runBench(thSet, isReady, isEnd, ts, execMs);
+
+    if (counter == 0) return 0;
+    return ts.elapsedInNs() / (double)counter;
+}
+
+using MeasureFunc = double (*)(size_t cpu0, size_t cpu1, size_t execMs);
+
+/**
+ * Measure all the cpu pairs and print the matrix.
+ * The diagonal is not measured.
+ */
+void printMatrix(const char *name, MeasureFunc measure,
+                 const std::vector<size_t> &cpus, size_t execMs)
+{
+    ::printf("%s [ns]\n", name);
+    ::printf("%6s", "");
+    for (size_t c : cpus) ::printf(" %7zu", c);
+    ::printf("\n");
+    for (size_t c0 : cpus) {
+        ::printf("%6zu", c0);
+        for (size_t c1 : cpus) {
+            if (c0 == c1) {
+                ::printf(" %7s", "-");
+            } else {
+                ::printf(" %7.1f", measure(c0, c1, execMs));
+            }
+            ::fflush(::stdout);
+        }
+        ::printf("\n");
+    }
+    ::printf("\n");
+    ::fflush(::stdout);
+}
+
+/**
+ * Usage: bench_c2c [execMs [cpu0 cpu1 ...]]
+ * All the online cpus will be used by default.
+ */
+int main(int argc, char *argv[])
+{
+    size_t execMs = 100;
+    if (1 < argc) execMs = ::atoi(argv[1]);
+    std::vector<size_t> cpus;
+    for (int i = 2; i < argc; i++) {
+        cpus.push_back(::atoi(argv[i]));
+    }
+    if (cpus.empty()) {
+        size_t n = std::thread::hardware_concurrency();
+        for (size_t i = 0; i < n; i++) cpus.push_back(i);
+    }
+    if (cpus.size() < 2) {
+        ::printf("At least two cpus are required.\n");
+        return 1;
+    }
+
+    printMatrix("PingPong", measurePingPong, cpus, execMs);
+    printMatrix("Spin_0_0", measureLockHandoff<char, cybozu::Spinlock>, cpus, execMs);
+    printMatrix("Spin_0_1", measureLockHandoff<char, cybozu::Ttaslock>, cpus, execMs);
+    printMatrix("Spin_1_0", measureLockHandoff<char, cybozu::SpinlockHle>, cpus, execMs);
+    printMatrix("Spin_1_1", measureLockHandoff<char, cybozu::TtaslockHle>, cpus, execMs);
+    printMatrix("Mutexlock", measureLockHandoff<std::mutex, std::lock_guard<std::mutex> >, cpus, execMs);
+    return 0;
+}
@@ -0,0 +1,175 @@
+/**
+ * @file
+ * @description regression check between two benchmark runs.
+ *
+ * Read results of bench or bench_map from a baseline file and a new file,
+ * and compare the per-trial throughputs of each variant and number of threads
+ * with the two-sided Mann-Whitney U test (normal approximation with
+ * tie correction and continuity correction).
+ *
+ * Usage: bench_compare [options] BASE NEW
+ *   --alpha A        significance level. (default 0.05)
+ *   --threshold P    fail if a significant slowdown exceeds P percent. (default 5)
+ *   --all            print all the configurations, not only significant ones.
+ *
+ * Exit status:
+ *   0: no regression, 1: regression found, 2: bad usage or input.
+ */
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "bench_result.hpp"
+
+struct UTest
+{
+    double u; /* U statistic of the first sample. */
+    double p; /* two-sided p-value. */
+};
+
+UTest mannWhitney(const std::vector<double> &xs, const std::vector<double> &ys)
+{
+    const size_t n1 = xs.size(), n2 = ys.size(), n = n1 + n2;
+    if (n1 == 0 || n2 == 0) throw std::runtime_error("empty sample.");
+    std::vector<std::pair<double, bool> > v; /* (value, isFirst) */
+    for (double x : xs) v.emplace_back(x, true);
+    for (double y : ys) v.emplace_back(y, false);
+    std::sort(v.begin(), v.end());
+
+    double r1 = 0, tieTerm = 0;
+    for (size_t i = 0; i < n;) {
+        size_t j = i;
+        while (j < n && v[j].first == v[i].first) j++;
+        const double rank = (i + 1 + j) / 2.0; /* average of ranks i+1 .. j. */
+        for (size_t k = i; k < j; k++) {
+            if (v[k].second) r1 += rank;
+        }
+        const double t = j - i;
+        tieTerm += t * t * t - t;
+        i = j;
+    }
+    UTest r;
+    r.u = r1 - n1 * (n1 + 1) / 2.0;
+    const double mu = n1 * n2 / 2.0;
+    const double var = n1 * n2 / 12.0 * ((n + 1) - tieTerm / (n * (n - 1.0)));
+    if (var <= 0) {
+        r.p = 1;
+        return r;
+    }
+    const double z = std::max(0.0, std::fabs(r.u - mu) - 0.5) / std::sqrt(var);
+    r.p = std::erfc(z / std::sqrt(2.0));
+    return r;
+}
+
+double median(std::vector<double> v)
+{
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    const size_t n = v.size();
+    return n % 2 == 1 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+struct Option
+{
+    double alpha;
+    double thresholdPct;
+    bool isAll;
+    std::string basePath;
+    std::string newPath;
+
+    Option() : alpha(0.05), thresholdPct(5), isAll(false) {}
+};
+
+void usage()
+{
+    ::fprintf(::stderr, "Usage: bench_compare [--alpha A] [--threshold PCT] [--all] BASE NEW\n");
+}
+
+Option parseOption(int argc, char *argv[])
+{
+    Option opt;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (argc <= i + 1) throw std::runtime_error(arg + " requires a value.");
+            return argv[++i];
+        };
+        if (arg == "--alpha") {
+            opt.alpha = std::stod(next());
+        } else if (arg == "--threshold") {
+            opt.thresholdPct = std::stod(next());
+        } else if (arg == "--all") {
+            opt.isAll = true;
+        } else if (!arg.empty() && arg[0] == '-') {
+            throw std::runtime_error("bad option: " + arg);
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (files.size() != 2) throw std::runtime_error("specify BASE and NEW.");
+    opt.basePath = files[0];
+    opt.newPath = files[1];
+    return opt;
+}
+
+void readFile(const std::string &path, bench::ResultSet &rs)
+{
+    ::FILE *fp = ::fopen(path.c_str(), "r");
+    if (!fp) throw std::runtime_error("could not open " + path);
+    bench::readResults(fp, rs);
+    ::fclose(fp);
+    if (rs.empty()) throw std::runtime_error("no result in " + path);
+}
+
+int main(int argc, char *argv[])
+{
+    Option opt;
+    bench::ResultSet base, cur;
+    try {
+        opt = parseOption(argc, argv);
+        readFile(opt.basePath, base);
+        readFile(opt.newPath, cur);
+    } catch (std::exception &e) {
+        ::fprintf(::stderr, "error: %s\n", e.what());
+        usage();
+        return 2;
+    }
+
+    size_t nCompared = 0, nFaster = 0, nSlower = 0, nRegressed = 0;
+    ::printf("%-32s %7s %12s %12s %8s %10s %s\n"
+             , "name", "threads", "base", "new", "change", "p", "   [counts/us, median]");
+    for (const auto &pair : cur) {
+        auto it = base.find(pair.first);
+        if (it == base.end()) continue;
+        for (const auto &pair2 : pair.second) {
+            auto it2 = it->second.find(pair2.first);
+            if (it2 == it->second.end()) continue;
+            const std::vector<double> &xs = it2->second, &ys = pair2.second;
+            const double m0 = median(xs), m1 = median(ys);
+            const double changePct = m0 == 0 ? 0 : (m1 / m0 - 1) * 100;
+            const UTest t = mannWhitney(xs, ys);
+            const bool isSignificant = t.p < opt.alpha;
+            const bool isRegressed = isSignificant && changePct < -opt.thresholdPct;
+            nCompared++;
+            if (isSignificant) (changePct < 0 ? nSlower : nFaster)++;
+            if (isRegressed) nRegressed++;
+            if (!isSignificant && !opt.isAll) continue;
+            const char *mark = isRegressed ? "REGRESSION" : !isSignificant ? "" :
+                changePct < 0 ? "slower" : "faster";
+            ::printf("%-32s %7zu %12.3f %12.3f %+7.2f%% %10.2e %s\n"
+                     , pair.first.c_str(), pair2.first, m0, m1, changePct, t.p, mark);
+        }
+    }
+    ::printf("%zu compared  %zu faster  %zu slower  %zu regressions"
+             " (alpha %.3f, threshold %.1f%%)\n"
+             , nCompared, nFaster, nSlower, nRegressed, opt.alpha, opt.thresholdPct);
+    if (nCompared == 0) {
+        ::fprintf(::stderr, "error: no configuration in common.\n");
+        return 2;
+    }
+    return nRegressed == 0 ? 0 : 1;
+}
@@ -1,28 +1,129 @@
 #include <cstdio>
+#include <cstring>
+#include <string>
 #include <map>
 #include <atomic>
 #include <vector>
 #include <memory>
+#include <numeric>
+#include <algorithm>
 #include <cinttypes>
 #include "thread_util.hpp"
 #include "random.hpp"
+#include "random_batch.hpp"
 #include "time.hpp"
+#include "memory_usage.hpp"
 #include "spinlock.hpp"
 #include "bench_util.hpp"
 #include "btree.hpp"
+#include "blink_tree.hpp"
+#include "counter.hpp"
+#include "workload_trace.hpp"
 
 using MapT = std::map<uint32_t, uint32_t>;
 using BtreeMapT = cybozu::BtreeMap<uint32_t, uint32_t>;
+using BlinkTreeMapT = cybozu::BlinkTreeMap<uint32_t, uint32_t>;
+using cybozu::CacheLine;
 
 /**
- * uint64_t integer that owns a 64bytes cache line.
- * Use with alignas(64).
+ * A node of pointer chasing that owns a cache line.
  */
-struct CacheLine
+struct ChaseNode
 {
-    uint64_t value;
+    ChaseNode *next;
     uint64_t hidden_data[7]; /* not used. */
-    CacheLine() : value(0) {}
+};
+
+/**
+ * Dependent loads through a random cyclic list.
+ * This measures the load latency of the working set.
+ */
+class PointerChaseWorker : public bench::Worker
+{
+private:
+    const ChaseNode *head_;
+    uint64_t &counter_;
+public:
+    PointerChaseWorker(const ChaseNode *head, uint64_t &counter,
+                       const std::atomic<bool> &isReady,
+                       const std::atomic<bool> &isEnd)
+        : bench::Worker(isReady, isEnd), head_(head), counter_(counter) {
+    }
+private:
+    void run() override {
+        const ChaseNode *p = head_;
+        while (!isEnd_.load(std::memory_order_relaxed)) {
+            for (size_t i = 0; i < 256; i++) p = p->next;
+            counter_ += 256;
+        }
+        /* Keep the chain alive. */
+        if (p == nullptr) ::printf("never printed\n");
+    }
+};
+
+/**
+ * Sequential read of a buffer.
+ * The counter is the number of cache lines read.
+ */
+class StreamWorker : public bench::Worker
+{
+private:
+    const uint64_t *buf_;
+    const size_t size_; /* number of uint64_t. */
+    uint64_t &counter_;
+public:
+    StreamWorker(const uint64_t *buf, size_t size, uint64_t &counter,
+                 const std::atomic<bool> &isReady,
+                 const std::atomic<bool> &isEnd)
+        : bench::Worker(isReady, isEnd), buf_(buf), size_(size), counter_(counter) {
+    }
+private:
+    void run() override {
+        const size_t chunk = 8192; /* 64KiB */
+        uint64_t sum = 0;
+        size_t off = 0;
+        while (!isEnd_.load(std::memory_order_relaxed)) {
+            for (size_t i = 0; i < chunk; i++) sum += buf_[off + i];
+            counter_ += chunk / 8;
+            off += chunk;
+            if (size_ < off + chunk) off = 0;
+        }
+        if (sum == uint64_t(-1)) ::printf("never printed\n");
+    }
+};
+
+/**
+ * Independent random accesses to cache lines.
+ */
+class RandomAccessWorker : public bench::Worker
+{
+private:
+    const CacheLine *lines_;
+    const size_t nLines_;
+    uint64_t &counter_;
+    cybozu::util::BatchRandom rand_;
+public:
+    RandomAccessWorker(const CacheLine *lines, size_t nLines, uint64_t &counter,
+                       const cybozu::util::BatchRandom &rand,
+                       const std::atomic<bool> &isReady,
+                       const std::atomic<bool> &isEnd)
+        : bench::Worker(isReady, isEnd), lines_(lines), nLines_(nLines)
+        , counter_(counter), rand_(rand) {
+    }
+private:
+    void run() override {
+        uint64_t sum = 0;
+        uint32_t buf[256];
+        while (!isEnd_.load(std::memory_order_relaxed)) {
+            rand_.fill(buf, 256);
+            for (size_t i = 0; i < 256; i++) {
+                /* [0, nLines_) without a division. */
+                sum += lines_[(uint64_t(buf[i]) * nLines_) >> 32].value;
+            }
+            counter_ += 256;
+        }
+        if (sum == uint64_t(-1)) ::printf("never printed\n");
+    }
 };
 
 template <bool useHLE, bool useTTAS>
@@ -32,21 +133,23 @@ private:
     char &mutex_;
     MapT &map_;
     uint64_t &counter_;
-    cybozu::util::XorShift128 rand_;
-    uint16_t readPct_; /* [0, 10000]. */
+    cybozu::util::RandomBuffer rand_;
+    const uint64_t readThreshold_; /* read if a random number is below this. */
 public:
     SpinStdMapWorker(char &mutex, MapT &map, uint64_t &counter,
-                     uint32_t seed, uint16_t readPct,
+                     const cybozu::util::BatchRandom &rand, uint16_t readPct,
                      const std::atomic<bool> &isReady,
                      const std::atomic<bool> &isEnd)
         : bench::Worker(isReady, isEnd)
         , mutex_(mutex), map_(map), counter_(counter)
-        , rand_(seed), readPct_(readPct) {
+        , rand_(rand), readThreshold_(cybozu::util::RandomBuffer::threshold(readPct, 10000)) {
     }
 private:
     void run() override {
+        cybozu::LockProfile &prof = CYBOZU_LOCK_PROFILE(CYBOZU_LOCK_SITE);
         while (!isEnd_.load(std::memory_order_relaxed)) {
-            cybozu::SpinlockT<useHLE, useTTAS> lk(mutex_);
+            rand_.reserve(3);
+            cybozu::ProfiledSpinlockT<useHLE, useTTAS> lk(mutex_, prof);
             runCriticalSection();
             counter_++;
         }
@@ -58,7 +161,7 @@ private:
                 /* Search a key. */
                 auto it = map_.lower_bound(rand_());
                 if (it == map_.end()) continue;
-                if (readPct_ <= rand_() % 10000) {
+                if (!rand_.isBelow(readThreshold_)) {
                     /* Delete a value. */
                     map_.erase(it);
                     isDeleted = true;
@@ -80,21 +183,23 @@ private:
     char &mutex_;
     BtreeMapT &map_;
     uint64_t &counter_;
-    cybozu::util::XorShift128 rand_;
-    uint16_t readPct_; /* [0, 10000]. */
+    cybozu::util::RandomBuffer rand_;
+    const uint64_t readThreshold_; /* read if a random number is below this. */
 public:
     SpinBtreeMapWorker(char &mutex, BtreeMapT &map, uint64_t &counter,
-                       uint32_t seed, uint16_t readPct,
+                       const cybozu::util::BatchRandom &rand, uint16_t readPct,
                        const std::atomic<bool> &isReady,
                        const std::atomic<bool> &isEnd)
         : bench::Worker(isReady, isEnd)
         , mutex_(mutex), map_(map), counter_(counter)
-        , rand_(seed), readPct_(readPct) {
+        , rand_(rand), readThreshold_(cybozu::util::RandomBuffer::threshold(readPct, 10000)) {
     }
 private:
     void run() override {
+        cybozu::LockProfile &prof = CYBOZU_LOCK_PROFILE(CYBOZU_LOCK_SITE);
         while (!isEnd_.load(std::memory_order_relaxed)) {
-            cybozu::SpinlockT<useHLE, useTTAS> lk(mutex_);
+            rand_.reserve(3);
+            cybozu::ProfiledSpinlockT<useHLE, useTTAS> lk(mutex_, prof);
             runCriticalSection();
             counter_++;
         }
@@ -106,7 +211,7 @@ private:
                 /* Search a key. */
                 auto it = map_.lowerBound(rand_());
                 if (it.isEnd()) continue;
-                if (readPct_ <= rand_() % 10000) {
+                if (!rand_.isBelow(readThreshold_)) {
                     /* Delete a value. */
                     it.erase();
                     isDeleted = true;
@@ -121,76 +226,792 @@ private:
     }
 };
 
+/**
+ * Ingest in batches with BtreeMap::applyBatch().
+ * A batch of upserts and erases is made outside the lock
+ * and applied in one critical section.
+ * The erased keys are the ones upserted in the previous batch,
+ * so the map size is kept.
+ * The counter is the number of operations.
+ */
+template <bool useHLE, bool useTTAS>
+class BatchBtreeMapWorker : public bench::Worker
+{
+private:
+    char &mutex_;
+    BtreeMapT &map_;
+    uint64_t &counter_;
+    cybozu::util::RandomBuffer rand_;
+    std::vector<BtreeMapT::BatchOp> ops_;
+    std::vector<uint32_t> keys_; /* upserted in the previous batch. */
+    const size_t batchSize_;
+public:
+    BatchBtreeMapWorker(char &mutex, BtreeMapT &map, uint64_t &counter,
+                        const cybozu::util::BatchRandom &rand, size_t batchSize,
+                        const std::atomic<bool> &isReady,
+                        const std::atomic<bool> &isEnd)
+        : bench::Worker(isReady, isEnd)
+        , mutex_(mutex), map_(map), counter_(counter)
+        , rand_(rand), ops_(), keys_(), batchSize_(batchSize) {
+    }
+private:
+    void run() override {
+        cybozu::LockProfile &prof = CYBOZU_LOCK_PROFILE(CYBOZU_LOCK_SITE);
+        while (!isEnd_.load(std::memory_order_relaxed)) {
+            makeBatch();
+            {
+                cybozu::ProfiledSpinlockT<useHLE, useTTAS> lk(mutex_, prof);
+                map_.applyBatch(ops_);
+            }
+            counter_ += ops_.size();
+        }
+    }
+    void makeBatch() {
+        ops_.clear();
+        for (uint32_t key : keys_) {
+            ops_.push_back(BtreeMapT::BatchOp{BtreeMapT::BatchOp::ERASE, key, 0});
+            if (batchSize_ <= ops_.size()) break;
+        }
+        keys_.clear();
+        while (ops_.size() < batchSize_) {
+            rand_.reserve(1);
+            const uint32_t key = rand_();
+            ops_.push_back(BtreeMapT::BatchOp{BtreeMapT::BatchOp::UPSERT, key, 0});
+            keys_.push_back(key);
+        }
+    }
+};
+
+/**
+ * The same operations as SpinBtreeMapWorker without the map-wide lock.
+ */
+class BlinkTreeMapWorker : public bench::Worker
+{
+private:
+    BlinkTreeMapT &map_;
+    uint64_t &counter_;
+    cybozu::util::RandomBuffer rand_;
+    const uint64_t readThreshold_; /* read if a random number is below this. */
+public:
+    BlinkTreeMapWorker(BlinkTreeMapT &map, uint64_t &counter,
+                       const cybozu::util::BatchRandom &rand, uint16_t readPct,
+                       const std::atomic<bool> &isReady,
+                       const std::atomic<bool> &isEnd)
+        : bench::Worker(isReady, isEnd)
+        , map_(map), counter_(counter)
+        , rand_(rand), readThreshold_(cybozu::util::RandomBuffer::threshold(readPct, 10000)) {
+    }
+private:
+    void run() override {
+        while (!isEnd_.load(std::memory_order_relaxed)) {
+            rand_.reserve(3);
+            runOperation();
+            counter_++;
+        }
+    }
+    void runOperation() {
+        bool isDeleted = false;
+        while (true) {
+            /* Search a key. */
+            uint32_t key, value;
+            if (!map_.lowerBound(rand_(), key, value)) continue;
+            if (!rand_.isBelow(readThreshold_)) {
+                /* Delete a value. Another thread may have deleted it. */
+                isDeleted = map_.erase(key);
+            }
+            break;
+        }
+        /* Insert */
+        if (isDeleted) {
+            map_.insert(rand_(), 0);
+        }
+    }
+};
+
+/**
+ * The same operations as BlinkTreeMapWorker in a transaction:
+ * a read, or a move of a record to an absent key, which keeps the map size.
+ * The counter is the number of commits and aborts are the failed commits.
+ */
+class TxBlinkTreeMapWorker : public bench::Worker
+{
+private:
+    BlinkTreeMapT &map_;
+    uint64_t &counter_;
+    uint64_t &aborts_;
+    cybozu::util::RandomBuffer rand_;
+    const uint64_t readThreshold_; /* read if a random number is below this. */
+    BlinkTreeMapT::Transaction tx_;
+public:
+    TxBlinkTreeMapWorker(BlinkTreeMapT &map, uint64_t &counter, uint64_t &aborts,
+                         const cybozu::util::BatchRandom &rand, uint16_t readPct,
+                         const std::atomic<bool> &isReady,
+                         const std::atomic<bool> &isEnd)
+        : bench::Worker(isReady, isEnd)
+        , map_(map), counter_(counter), aborts_(aborts)
+        , rand_(rand), readThreshold_(cybozu::util::RandomBuffer::threshold(readPct, 10000))
+        , tx_(map) {
+    }
+private:
+    void run() override {
+        while (!isEnd_.load(std::memory_order_relaxed)) {
+            rand_.reserve(3);
+            const uint32_t key0 = rand_(), key1 = rand_();
+            const bool isRead = rand_.isBelow(readThreshold_);
+            while (!runTransaction(key0, key1, isRead)) {}
+            counter_++;
+        }
+    }
+    /**
+     * RETURN:
+     *   false to retry.
+     */
+    bool runTransaction(uint32_t key0, uint32_t key1, bool isRead) {
+        uint32_t key, value, value1;
+        if (!map_.lowerBound(key0, key, value) && !map_.lowerBound(0, key, value)) return true;
+        if (!tx_.find(key, value)) {
+            /* Another thread has erased it after lowerBound(). */
+            tx_.clear();
+            return false;
+        }
+        if (!isRead && !tx_.find(key1, value1)) {
+            tx_.erase(key);
+            tx_.put(key1, value);
+        }
+        if (tx_.commit()) return true;
+        aborts_++;
+        return false;
+    }
+};
+
 template <bool useHLE, bool useTTAS>
 void testSpinStdMapWorker(
-    size_t nThreads, size_t execMs, uint32_t nInitItems, uint16_t readPct)
+    size_t nThreads, size_t execMs, uint32_t nInitItems, uint16_t readPct, uint64_t seed)
 {
     cybozu::thread::ThreadRunnerSet thSet;
     alignas(64) char mutex = 0;
-    std::vector<CacheLine> counterV(nThreads);
+    cybozu::StripedCounter counterV(nThreads);
     alignas(64) std::atomic<bool> isReady(false);
     alignas(64) std::atomic<bool> isEnd(false);
-    cybozu::util::Random<uint32_t> rand;
+    cybozu::util::RandomStreams streams(seed);
+    cybozu::util::Xoshiro128ss rand = streams.next();
     MapT map;
     for (size_t i = 0; i < nInitItems; i++) {
         map.insert(std::make_pair(rand(), 0));
     }
+    std::vector<std::shared_ptr<bench::Worker> > workers;
     for (size_t i = 0; i < nThreads; i++) {
-        uint32_t seed = rand();
         auto worker = std::make_shared<SpinStdMapWorker<useHLE, useTTAS> >(
-            mutex, map, counterV[i].value, seed, readPct, isReady, isEnd);
+            mutex, map, counterV[i], cybozu::util::BatchRandom(streams), readPct, isReady, isEnd);
+        workers.push_back(worker);
         thSet.add(worker);
     }
     cybozu::time::TimeStack<> ts;
     bench::runBench(thSet, isReady, isEnd, ts, execMs);
-
-    uint64_t counter = 0;
-    for (const CacheLine &c : counterV) {
-        counter += c.value;
+    if (cybozu::trace::isEnabled) {
+        char name[128];
+        ::snprintf(name, sizeof(name), "SpinStdMap_%d_%d_%" PRIu32 "_%05u_%zu"
+                   , useHLE, useTTAS, nInitItems, readPct, nThreads);
+        bench::dumpTrace(name);
     }
 
-    ::printf("SpinStdMap_%d_%d_%" PRIu32 "_%05u    %12" PRIu64 " counts  %lu us  %zu threads\n"
+    uint64_t counter = counterV.sum();
+    bench::AllocStat allocStat;
+    for (const auto &w : workers) allocStat += w->allocStat();
+
+    ::printf("SpinStdMap_%d_%d_%" PRIu32 "_%05u    %12" PRIu64 " counts  %lu us  %zu threads"
              , useHLE, useTTAS, nInitItems, readPct
              , counter, ts.elapsedInUs(), nThreads);
+    bench::printAllocStat(allocStat, counter);
+    ::printf("\n");
+    bench::reportLockProfile();
     ::fflush(::stdout);
 }
 
 template <bool useHLE, bool useTTAS>
 void testSpinBtreeMapWorker(
-    size_t nThreads, size_t execMs, uint32_t nInitItems, uint16_t readPct)
+    size_t nThreads, size_t execMs, uint32_t nInitItems, uint16_t readPct, uint64_t seed)
 {
     cybozu::thread::ThreadRunnerSet thSet;
     alignas(64) char mutex = 0;
-    std::vector<CacheLine> counterV(nThreads);
+    cybozu::StripedCounter counterV(nThreads);
     alignas(64) std::atomic<bool> isReady(false);
     alignas(64) std::atomic<bool> isEnd(false);
-    cybozu::util::Random<uint32_t> rand;
+    cybozu::util::RandomStreams streams(seed);
+    cybozu::util::Xoshiro128ss rand = streams.next();
     BtreeMapT map;
+    if (bench::isStatsExported()) map.registerStats("SpinBtreeMap");
     for (size_t i = 0; i < nInitItems; i++) {
         map.insert(rand(), 0);
     }
+    if (cybozu::isHeatEnabled) map.resetHeat();
+    std::vector<std::shared_ptr<bench::Worker> > workers;
     for (size_t i = 0; i < nThreads; i++) {
-        uint32_t seed = rand();
         auto worker = std::make_shared<SpinBtreeMapWorker<useHLE, useTTAS> >(
-            mutex, map, counterV[i].value, seed, readPct, isReady, isEnd);
+            mutex, map, counterV[i], cybozu::util::BatchRandom(streams), readPct, isReady, isEnd);
+        workers.push_back(worker);
         thSet.add(worker);
     }
     cybozu::time::TimeStack<> ts;
     bench::runBench(thSet, isReady, isEnd, ts, execMs);
-
-    uint64_t counter = 0;
-    for (const CacheLine &c : counterV) {
-        counter += c.value;
+    if (cybozu::trace::isEnabled) {
+        char name[128];
+        ::snprintf(name, sizeof(name), "SpinBtreeMap_%d_%d_%" PRIu32 "_%05u_%zu"
+                   , useHLE, useTTAS, nInitItems, readPct, nThreads);
+        bench::dumpTrace(name);
     }
 
-    ::printf("SpinBtreeMap_%d_%d_%" PRIu32 "_%05u  %12" PRIu64 " counts  %lu us  %zu threads\n"
+    uint64_t counter = counterV.sum();
+    bench::AllocStat allocStat;
+    for (const auto &w : workers) allocStat += w->allocStat();
+
+    ::printf("SpinBtreeMap_%d_%d_%" PRIu32 "_%05u  %12" PRIu64 " counts  %lu us  %zu threads"
              , useHLE, useTTAS, nInitItems, readPct
              , counter, ts.elapsedInUs(), nThreads);
+    bench::printAllocStat(allocStat, counter);
+    ::printf("\n");
+    bench::reportLockProfile();
+    if (cybozu::isHeatEnabled) map.printHeat(5, 8);
+    ::fflush(::stdout);
+}
+
+template <bool useHLE, bool useTTAS>
+void testBatchBtreeMapWorker(
+    size_t nThreads, size_t execMs, uint32_t nInitItems, size_t batchSize, uint64_t seed)
+{
+    cybozu::thread::ThreadRunnerSet thSet;
+    alignas(64) char mutex = 0;
+    cybozu::StripedCounter counterV(nThreads);
+    alignas(64) std::atomic<bool> isReady(false);
+    alignas(64) std::atomic<bool> isEnd(false);
+    cybozu::util::RandomStreams streams(seed);
+    cybozu::util::Xoshiro128ss rand = streams.next();
+    BtreeMapT map;
+    for (size_t i = 0; i < nInitItems; i++) {
+        map.insert(rand(), 0);
+    }
+    std::vector<std::shared_ptr<bench::Worker> > workers;
+    for (size_t i = 0; i < nThreads; i++) {
+        auto worker = std::make_shared<BatchBtreeMapWorker<useHLE, useTTAS> >(
+            mutex, map, counterV[i], cybozu::util::BatchRandom(streams), batchSize, isReady, isEnd);
+        workers.push_back(worker);
+        thSet.add(worker);
+    }
+    cybozu::time::TimeStack<> ts;
+    bench::runBench(thSet, isReady, isEnd, ts, execMs);
+
+    uint64_t counter = counterV.sum();
+    bench::AllocStat allocStat;
+    for (const auto &w : workers) allocStat += w->allocStat();
+
+    ::printf("BatchBtreeMap_%d_%d_%" PRIu32 "_%05zu %12" PRIu64 " counts  %lu us  %zu threads"
+             , useHLE, useTTAS, nInitItems, batchSize
+             , counter, ts.elapsedInUs(), nThreads);
+    bench::printAllocStat(allocStat, counter);
+    ::printf("\n");
+    bench::reportLockProfile();
+    ::fflush(::stdout);
+}
+
+void testBlinkTreeMapWorker(
+    size_t nThreads, size_t execMs, uint32_t nInitItems, uint16_t readPct, uint64_t seed)
+{
+    cybozu::thread::ThreadRunnerSet thSet;
+    cybozu::StripedCounter counterV(nThreads);
+    alignas(64) std::atomic<bool> isReady(false);
+    alignas(64) std::atomic<bool> isEnd(false);
+    cybozu::util::RandomStreams streams(seed);
+    cybozu::util::Xoshiro128ss rand = streams.next();
+    BlinkTreeMapT map;
+    for (size_t i = 0; i < nInitItems; i++) {
+        map.insert(rand(), 0);
+    }
+    std::vector<std::shared_ptr<bench::Worker> > workers;
+    for (size_t i = 0; i < nThreads; i++) {
+        auto worker = std::make_shared<BlinkTreeMapWorker>(
+            map, counterV[i], cybozu::util::BatchRandom(streams), readPct, isReady, isEnd);
+        workers.push_back(worker);
+        thSet.add(worker);
+    }
+    cybozu::time::TimeStack<> ts;
+    bench::runBench(thSet, isReady, isEnd, ts, execMs);
+    if (cybozu::trace::isEnabled) {
+        char name[128];
+        ::snprintf(name, sizeof(name), "BlinkTreeMap_%" PRIu32 "_%05u_%zu"
+                   , nInitItems, readPct, nThreads);
+        bench::dumpTrace(name);
+    }
+
+    uint64_t counter = counterV.sum();
+    bench::AllocStat allocStat;
+    for (const auto &w : workers) allocStat += w->allocStat();
+
+    ::printf("BlinkTreeMap_%" PRIu32 "_%05u      %12" PRIu64 " counts  %lu us  %zu threads"
+             , nInitItems, readPct
+             , counter, ts.elapsedInUs(), nThreads);
+    bench::printAllocStat(allocStat, counter);
+    ::printf("\n");
+    ::fflush(::stdout);
+}
+
+/**
+ * Transactions on BlinkTreeMap. The aborts are printed.
+ */
+void testTxBlinkTreeMapWorker(
+    size_t nThreads, size_t execMs, uint32_t nInitItems, uint16_t readPct, uint64_t seed)
+{
+    cybozu::thread::ThreadRunnerSet thSet;
+    cybozu::StripedCounter counterV(nThreads);
+    cybozu::StripedCounter abortsV(nThreads);
+    alignas(64) std::atomic<bool> isReady(false);
+    alignas(64) std::atomic<bool> isEnd(false);
+    cybozu::util::RandomStreams streams(seed);
+    cybozu::util::Xoshiro128ss rand = streams.next();
+    BlinkTreeMapT map;
+    for (size_t i = 0; i < nInitItems; i++) {
+        map.insert(rand(), 0);
+    }
+    std::vector<std::shared_ptr<bench::Worker> > workers;
+    for (size_t i = 0; i < nThreads; i++) {
+        auto worker = std::make_shared<TxBlinkTreeMapWorker>(
+            map, counterV[i], abortsV[i], cybozu::util::BatchRandom(streams), readPct, isReady, isEnd);
+        workers.push_back(worker);
+        thSet.add(worker);
+    }
+    cybozu::time::TimeStack<> ts;
+    bench::runBench(thSet, isReady, isEnd, ts, execMs);
+
+    uint64_t counter = counterV.sum();
+    bench::AllocStat allocStat;
+    for (const auto &w : workers) allocStat += w->allocStat();
+
+    ::printf("TxBlinkTreeMap_%" PRIu32 "_%05u    %12" PRIu64 " counts  %lu us  %zu threads"
+             , nInitItems, readPct
+             , counter, ts.elapsedInUs(), nThreads);
+    bench::printAllocStat(allocStat, counter);
+    ::printf("  aborts %" PRIu64 "\n", abortsV.sum());
     ::fflush(::stdout);
 }
 
-int main()
+/**
+ * Pointer chasing latency in a working set.
+ */
+void testPointerChase(size_t execMs, size_t bytes, uint64_t seed)
 {
+    const size_t n = bytes / sizeof(ChaseNode);
+    std::vector<ChaseNode> nodes(n);
+    std::vector<size_t> idx(n);
+    std::iota(idx.begin(), idx.end(), 0);
+    std::shuffle(idx.begin() + 1, idx.end(), std::mt19937_64(seed));
+    for (size_t i = 0; i < n; i++) {
+        nodes[idx[i]].next = &nodes[idx[(i + 1) % n]];
+    }
+
+    cybozu::thread::ThreadRunnerSet thSet;
+    alignas(64) uint64_t counter = 0;
+    alignas(64) std::atomic<bool> isReady(false);
+    alignas(64) std::atomic<bool> isEnd(false);
+    thSet.add(std::make_shared<PointerChaseWorker>(&nodes[0], counter, isReady, isEnd));
+    cybozu::time::TimeStack<> ts;
+    bench::runBench(thSet, isReady, isEnd, ts, execMs);
+
+    ::printf("PointerChase_%zu  %12" PRIu64 " counts  %lu us  %zu threads  %f ns/load\n"
+             , bytes, counter, ts.elapsedInUs(), (size_t)1
+             , ts.elapsedInNs() / (double)counter);
+    ::fflush(::stdout);
+}
+
+/**
+ * Streaming read bandwidth.
+ * Each thread reads its own slice of the buffer.
+ */
+void testStream(size_t nThreads, size_t execMs, size_t bytes)
+{
+    std::vector<uint64_t> buf(bytes / sizeof(uint64_t), 1);
+    const size_t slice = buf.size() / nThreads;
+
+    cybozu::thread::ThreadRunnerSet thSet;
+    cybozu::StripedCounter counterV(nThreads);
+    alignas(64) std::atomic<bool> isReady(false);
+    alignas(64) std::atomic<bool> isEnd(false);
+    for (size_t i = 0; i < nThreads; i++) {
+        thSet.add(std::make_shared<StreamWorker>(
+                      &buf[slice * i], slice, counterV[i], isReady, isEnd));
+    }
+    cybozu::time::TimeStack<> ts;
+    bench::runBench(thSet, isReady, isEnd, ts, execMs);
+
+    uint64_t counter = counterV.sum();
+    ::printf("StreamRead_%zu  %12" PRIu64 " counts  %lu us  %zu threads  %f GB/s\n"
+             , bytes, counter, ts.elapsedInUs(), nThreads
+             , counter * 64 / (double)ts.elapsedInNs());
+    ::fflush(::stdout);
+}
+
+/**
+ * Random 64B access throughput.
+ */
+void testRandomAccess(size_t nThreads, size_t execMs, size_t bytes, uint64_t seed)
+{
+    cybozu::CacheLineArray lines(bytes / sizeof(CacheLine));
+
+    cybozu::thread::ThreadRunnerSet thSet;
+    cybozu::StripedCounter counterV(nThreads);
+    alignas(64) std::atomic<bool> isReady(false);
+    alignas(64) std::atomic<bool> isEnd(false);
+    cybozu::util::RandomStreams streams(seed);
+    for (size_t i = 0; i < nThreads; i++) {
+        thSet.add(std::make_shared<RandomAccessWorker>(
+                      lines.begin(), lines.size(), counterV[i], cybozu::util::BatchRandom(streams)
+                      , isReady, isEnd));
+    }
+    cybozu::time::TimeStack<> ts;
+    bench::runBench(thSet, isReady, isEnd, ts, execMs);
+
+    uint64_t counter = counterV.sum();
+    ::printf("RandomAccess_%zu  %12" PRIu64 " counts  %lu us  %zu threads  %f ns/access\n"
+             , bytes, counter, ts.elapsedInUs(), nThreads
+             , ts.elapsedInNs() / (double)counter);
+    ::fflush(::stdout);
+}
+
+/**
+ * Memory consumption of the initial population.
+ */
+template <typename Map, typename Insert>
+void testMapMemory(const char *name, uint32_t nInitItems, uint64_t seed, Insert insert)
+{
+    cybozu::util::releaseFreeMemory();
+    cybozu::util::resetPeakRss();
+    auto m0 = cybozu::util::MemoryUsage::now();
+    size_t nEntries;
+    cybozu::util::MemoryUsage m1;
+    {
+        Map map;
+        cybozu::util::Xoshiro128ss rand = cybozu::util::RandomStreams(seed).next();
+        for (size_t i = 0; i < nInitItems; i++) {
+            insert(map, rand());
+        }
+        nEntries = map.size();
+        m1 = cybozu::util::MemoryUsage::now();
+    }
+    size_t rss = m1.rss - std::min(m0.rss, m1.rss);
+    size_t heap = m1.heap - std::min(m0.heap, m1.heap);
+    ::printf("Memory_%s_%" PRIu32 "  entries %zu  rss %zu KiB  heap %zu KiB  peak rss %zu KiB"
+             "  %.1f bytes/entry (heap)  %.1f bytes/entry (rss)\n"
+             , name, nInitItems, nEntries, rss >> 10, heap >> 10, m1.peakRss >> 10
+             , heap / (double)nEntries, rss / (double)nEntries);
+    ::fflush(::stdout);
+}
+
+/**
+ * Map operations for trace replay.
+ * Keys are truncated to 32 bits.
+ */
+struct StdMapOps
+{
+    using Map = MapT;
+    static const char *name() { return "StdMap"; }
+    static void apply(Map &map, const cybozu::workload::Record &rec, uint64_t &sum) {
+        using Op = cybozu::workload::Op;
+        const uint32_t key = uint32_t(rec.key);
+        switch (rec.op) {
+        case Op::GET: {
+            auto it = map.lower_bound(key);
+            if (it != map.end()) sum += it->second;
+            break;
+        }
+        case Op::INSERT:
+            map.insert(std::make_pair(key, rec.valueSize));
+            break;
+        case Op::UPDATE:
+            map[key] = rec.valueSize;
+            break;
+        case Op::ERASE:
+            map.erase(key);
+            break;
+        }
+    }
+};
+
+struct BtreeMapOps
+{
+    using Map = BtreeMapT;
+    static const char *name() { return "BtreeMap"; }
+    static void apply(Map &map, const cybozu::workload::Record &rec, uint64_t &sum) {
+        using Op = cybozu::workload::Op;
+        const uint32_t key = uint32_t(rec.key);
+        switch (rec.op) {
+        case Op::GET: {
+            auto it = map.lowerBound(key);
+            if (!it.isEnd()) sum += it.value();
+            break;
+        }
+        case Op::INSERT:
+            map.insert(key, rec.valueSize);
+            break;
+        case Op::UPDATE:
+            if (!map.insert(key, rec.valueSize)) {
+                map.erase(key);
+                map.insert(key, rec.valueSize);
+            }
+            break;
+        case Op::ERASE:
+            map.erase(key);
+            break;
+        }
+    }
+};
+
+/**
+ * Which records each replay thread executes.
+ * This is built before the replay so that workers only read arrays.
+ */
+struct ReplayPlan
+{
+    std::vector<std::vector<uint32_t> > idxV; /* record indices for each thread. */
+    std::vector<uint64_t> timeNs; /* time of each record from the beginning. empty if not paced. */
+
+    /**
+     * @isByTid partition by the recorded thread id (tid % nThreads) if true,
+     *   round-robin otherwise.
+     */
+    ReplayPlan(const cybozu::workload::TraceFile &trace, size_t nThreads, bool isByTid, bool isPaced)
+        : idxV(nThreads) {
+        if (UINT32_MAX < trace.size()) throw std::runtime_error("too many records.");
+        for (size_t i = 0; i < trace.size(); i++) {
+            size_t t = isByTid ? trace[i].tid % nThreads : i % nThreads;
+            idxV[t].push_back(i);
+        }
+        if (isPaced) {
+            timeNs.resize(trace.size());
+            uint64_t ns = 0;
+            for (size_t i = 0; i < trace.size(); i++) {
+                ns += trace[i].tsDelta;
+                timeNs[i] = ns;
+            }
+        }
+    }
+};
+
+template <typename Ops, bool useHLE, bool useTTAS>
+class ReplayWorker : public bench::Worker
+{
+private:
+    char &mutex_;
+    typename Ops::Map &map_;
+    const cybozu::workload::TraceFile &trace_;
+    const std::vector<uint32_t> &idxV_;
+    const std::vector<uint64_t> &timeNs_;
+    uint64_t &counter_;
+public:
+    ReplayWorker(char &mutex, typename Ops::Map &map,
+                 const cybozu::workload::TraceFile &trace, const ReplayPlan &plan, size_t id,
+                 uint64_t &counter,
+                 const std::atomic<bool> &isReady, const std::atomic<bool> &isEnd)
+        : bench::Worker(isReady, isEnd)
+        , mutex_(mutex), map_(map), trace_(trace)
+        , idxV_(plan.idxV[id]), timeNs_(plan.timeNs), counter_(counter) {
+    }
+private:
+    void run() override {
+        using Clock = std::chrono::steady_clock;
+        const bool isPaced = !timeNs_.empty();
+        const Clock::time_point begin = Clock::now();
+        uint64_t sum = 0;
+        cybozu::LockProfile &prof = CYBOZU_LOCK_PROFILE(CYBOZU_LOCK_SITE);
+        for (uint32_t idx : idxV_) {
+            if (isPaced) {
+                const Clock::time_point t = begin + std::chrono::nanoseconds(timeNs_[idx]);
+                while (Clock::now() < t) _mm_pause();
+            }
+            cybozu::ProfiledSpinlockT<useHLE, useTTAS> lk(mutex_, prof);
+            Ops::apply(map_, trace_[idx], sum);
+            counter_++;
+        }
+        if (sum == uint64_t(-1)) ::printf("never printed\n");
+    }
+};
+
+/**
+ * Replay a trace once and print the throughput.
+ * The map is empty at the beginning.
+ */
+template <typename Ops, bool useHLE, bool useTTAS>
+void replayTrace(const cybozu::workload::TraceFile &trace, const ReplayPlan &plan,
+                 const char *partitionName)
+{
+    const size_t nThreads = plan.idxV.size();
+    cybozu::thread::ThreadRunnerSet thSet;
+    alignas(64) char mutex = 0;
+    cybozu::StripedCounter counterV(nThreads);
+    alignas(64) std::atomic<bool> isReady(false);
+    alignas(64) std::atomic<bool> isEnd(false);
+    typename Ops::Map map;
+    for (size_t i = 0; i < nThreads; i++) {
+        thSet.add(std::make_shared<ReplayWorker<Ops, useHLE, useTTAS> >(
+                      mutex, map, trace, plan, i, counterV[i], isReady, isEnd));
+    }
+    cybozu::time::TimeStack<> ts;
+    thSet.start();
+    ts.pushNow();
+    isReady.store(true, std::memory_order_relaxed);
+    thSet.join();
+    ts.pushNow();
+
+    uint64_t counter = counterV.sum();
+    ::printf("Replay_%s_%d_%d_%s  %12" PRIu64 " counts  %lu us  %zu threads  %f counts/us\n"
+             , Ops::name(), useHLE, useTTAS, partitionName
+             , counter, ts.elapsedInUs(), nThreads, counter / (double)ts.elapsedInUs());
+    bench::reportLockProfile();
+    ::fflush(::stdout);
+}
+
+/**
+ * Generate a synthetic trace.
+ * The first tenth of the records populates the map,
+ * and the rest are reads and erase/insert pairs.
+ * The records are 1us apart.
+ */
+void generateTrace(const std::string &path, size_t nRecords, size_t nThreads, uint16_t readPct,
+                   uint64_t seed)
+{
+    using Op = cybozu::workload::Op;
+    cybozu::workload::TraceRecorder recorder(path);
+    cybozu::util::Xoshiro128ss xrand(seed);
+    const size_t nInit = nRecords / 10;
+    for (size_t i = 0; i < nRecords; i++) {
+        const uint8_t tid = i % nThreads;
+        Op op;
+        if (i < nInit) {
+            op = Op::INSERT;
+        } else if (xrand() % 10000 < readPct) {
+            op = Op::GET;
+        } else {
+            op = (i % 2 == 0) ? Op::ERASE : Op::INSERT;
+        }
+        recorder.recordWithDelta(op, xrand(), sizeof(uint32_t), tid, 1000);
+    }
+    recorder.close();
+}
+
+void runReplay(const std::string &path, size_t nThreads, bool isByTid, bool isPaced)
+{
+    cybozu::workload::TraceFile trace(path);
+    ReplayPlan plan(trace, nThreads, isByTid, isPaced);
+    const char *partitionName = isByTid ? "tid" : "rr";
+    ::printf("trace %s  %zu records  %zu recorded threads\n"
+             , path.c_str(), trace.size(), trace.numThreads());
+    replayTrace<StdMapOps, 0, 0>(trace, plan, partitionName);
+    replayTrace<StdMapOps, 1, 0>(trace, plan, partitionName);
+    replayTrace<BtreeMapOps, 0, 0>(trace, plan, partitionName);
+    replayTrace<BtreeMapOps, 1, 0>(trace, plan, partitionName);
+}
+
+/**
+ * Memory baselines to relate the map results with cache misses.
+ */
+void runMemoryBaseline(size_t execMs, uint64_t seed)
+{
+    for (size_t bytes = 4 << 10; bytes <= (256 << 20); bytes *= 4) {
+        testPointerChase(execMs, bytes, seed);
+    }
+    std::vector<size_t> threadsV = {1};
+    const size_t maxThreads = std::thread::hardware_concurrency();
+    if (1 < maxThreads) threadsV.push_back(maxThreads);
+    for (size_t nThreads : threadsV) {
+        testStream(nThreads, execMs, 256 << 20);
+        testRandomAccess(nThreads, execMs, 256 << 20, seed);
+    }
+}
+
+struct Option
+{
+    std::string replayPath;
+    std::string genTracePath;
+    size_t nThreads;
+    bool isByTid;
+    bool isPaced;
+    bool isSmoke;
+    size_t nRecords;
+    uint16_t readPct;
+    uint64_t seed;
+    size_t batchSize;
+
+    Option()
+        : nThreads(1), isByTid(true), isPaced(false), isSmoke(false)
+        , nRecords(1000000), readPct(9000)
+        , seed(std::random_device()()), batchSize(0) {}
+};
+
+void usage()
+{
+    ::printf("Usage: bench_map [options]\n"
+             "  (no option)           run all the benchmarks.\n"
+             "  --smoke               a short map sweep for regression checks with bench_compare.\n"
+             "  --replay FILE         replay a workload trace.\n"
+             "  --gen-trace FILE      generate a synthetic workload trace.\n"
+             "  --threads N           replay threads or recorded threads. (default 1)\n"
+             "  --partition tid|rr    assign records by recorded thread id or round-robin. (default tid)\n"
+             "  --paced               replay at the original pacing.\n"
+             "  --records N           records to generate. (default 1000000)\n"
+             "  --read-pct P          reads in 1/10000 to generate. (default 9000)\n"
+             "  --seed N              master seed of keys and accesses. (default random)\n"
+             "  --batch N             run only the batch ingest of BtreeMap with batch size 1 and N.\n");
+}
+
+Option parseOption(int argc, char *argv[])
+{
+    Option opt;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (argc <= i + 1) throw std::runtime_error(arg + " requires a value.");
+            return argv[++i];
+        };
+        if (arg == "--replay") {
+            opt.replayPath = next();
+        } else if (arg == "--gen-trace") {
+            opt.genTracePath = next();
+        } else if (arg == "--threads") {
+            opt.nThreads = std::stoul(next());
+        } else if (arg == "--partition") {
+            const std::string v = next();
+            if (v != "tid" && v != "rr") throw std::runtime_error("bad partition: " + v);
+            opt.isByTid = v == "tid";
+        } else if (arg == "--paced") {
+            opt.isPaced = true;
+        } else if (arg == "--smoke") {
+            opt.isSmoke = true;
+        } else if (arg == "--records") {
+            opt.nRecords = std::stoul(next());
+        } else if (arg == "--read-pct") {
+            opt.readPct = std::stoul(next());
+        } else if (arg == "--seed") {
+            opt.seed = std::stoull(next(), nullptr, 0);
+        } else if (arg == "--batch") {
+            opt.batchSize = std::stoul(next());
+            if (opt.batchSize == 0) throw std::runtime_error("bad batch size.");
+        } else {
+            usage();
+            throw std::runtime_error("bad option: " + arg);
+        }
+    }
+    if (opt.nThreads == 0 || 256 < opt.nThreads) throw std::runtime_error("bad number of threads.");
+    return opt;
+}
+
+int main(int argc, char *argv[]) try
+{
+    const Option opt = parseOption(argc, argv);
+    if (!opt.genTracePath.empty()) {
+        generateTrace(opt.genTracePath, opt.nRecords, opt.nThreads, opt.readPct, opt.seed);
+        return 0;
+    }
+    if (!opt.replayPath.empty()) {
+        runReplay(opt.replayPath, opt.nThreads, opt.isByTid, opt.isPaced);
+        return 0;
+    }
 #if 1
     size_t execMs = 10000;
     size_t nTrials = 10;
@@ -198,20 +1019,55 @@ int main()
     size_t execMs = 3000;
     size_t nTrials = 1;
 #endif
-    for (uint32_t nInitItems : {10000, 1000000}) {
-        for (size_t nThreads = 1; nThreads <= 12; nThreads++) {
-            for (uint16_t readPct : {0, 9000, 9900, 10000}) {
+    std::vector<uint32_t> nInitItemsV = {10000, 1000000};
+    size_t maxThreads = 12;
+    std::vector<uint16_t> readPctV = {0, 9000, 9900, 10000};
+    if (opt.isSmoke) {
+        execMs = 100;
+        nTrials = 7;
+        nInitItemsV = {10000};
+        maxThreads = 2;
+        readPctV = {9000};
+    }
+    ::printf("seed %" PRIu64 "\n", opt.seed);
+    bench::startStatsExporter();
+    if (opt.batchSize != 0) {
+        for (uint32_t nInitItems : nInitItemsV) {
+            for (size_t nThreads = 1; nThreads <= maxThreads; nThreads++) {
+                for (size_t i = 0; i < nTrials; i++) {
+                    testBatchBtreeMapWorker<0,1>(nThreads, execMs, nInitItems, 1, opt.seed);
+                    testBatchBtreeMapWorker<0,1>(nThreads, execMs, nInitItems, opt.batchSize, opt.seed);
+                }
+            }
+        }
+        return 0;
+    }
+    if (!opt.isSmoke) runMemoryBaseline(1000, opt.seed);
+    for (uint32_t nInitItems : nInitItemsV) {
+        testMapMemory<MapT>("StdMap", nInitItems, opt.seed, [](MapT &m, uint32_t k) {
+                m.insert(std::make_pair(k, 0));
+            });
+        testMapMemory<BtreeMapT>("BtreeMap", nInitItems, opt.seed, [](BtreeMapT &m, uint32_t k) {
+                m.insert(k, 0);
+            });
+        for (size_t nThreads = 1; nThreads <= maxThreads; nThreads++) {
+            for (uint16_t readPct : readPctV) {
                 for (size_t i = 0; i < nTrials; i++) {
-                    testSpinStdMapWorker<0,0>(nThreads, execMs, nInitItems, readPct);
-                    testSpinStdMapWorker<0,1>(nThreads, execMs, nInitItems, readPct);
-                    testSpinStdMapWorker<1,0>(nThreads, execMs, nInitItems, readPct);
-                    testSpinStdMapWorker<1,1>(nThreads, execMs, nInitItems, readPct);
-                    testSpinBtreeMapWorker<0,0>(nThreads, execMs, nInitItems, readPct);
-                    testSpinBtreeMapWorker<0,1>(nThreads, execMs, nInitItems, readPct);
-                    testSpinBtreeMapWorker<1,0>(nThreads, execMs, nInitItems, readPct);
-                    testSpinBtreeMapWorker<1,1>(nThreads, execMs, nInitItems, readPct);
+                    testSpinStdMapWorker<0,0>(nThreads, execMs, nInitItems, readPct, opt.seed);
+                    testSpinStdMapWorker<0,1>(nThreads, execMs, nInitItems, readPct, opt.seed);
+                    testSpinStdMapWorker<1,0>(nThreads, execMs, nInitItems, readPct, opt.seed);
+                    testSpinStdMapWorker<1,1>(nThreads, execMs, nInitItems, readPct, opt.seed);
+                    testSpinBtreeMapWorker<0,0>(nThreads, execMs, nInitItems, readPct, opt.seed);
+                    testSpinBtreeMapWorker<0,1>(nThreads, execMs, nInitItems, readPct, opt.seed);
+                    testSpinBtreeMapWorker<1,0>(nThreads, execMs, nInitItems, readPct, opt.seed);
+                    testSpinBtreeMapWorker<1,1>(nThreads, execMs, nInitItems, readPct, opt.seed);
+                    testBlinkTreeMapWorker(nThreads, execMs, nInitItems, readPct, opt.seed);
+                    testTxBlinkTreeMapWorker(nThreads, execMs, nInitItems, readPct, opt.seed);
                 }
             }
         }
     }
+} catch (std::exception &e) {
+    ::fprintf(::stderr, "error: %s\n", e.what());
+    return 1;
 }
@@ -0,0 +1,79 @@
+#pragma once
+/**
+ * @file
+ * @description benchmark result parser.
+ *
+ * Result lines printed by bench and bench_map look like:
+ *   NAME[:] COUNTS counts US us THREADS threads ...
+ * Other lines are ignored.
+ */
+#include <cstdio>
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <map>
+
+namespace bench {
+
+struct Result
+{
+    std::string name;
+    uint64_t counts;
+    uint64_t us;
+    size_t nThreads;
+
+    /**
+     * [counts/us].
+     */
+    double throughput() const {
+        if (us == 0) return 0;
+        return counts / (double)us;
+    }
+};
+
+/**
+ * RETURN:
+ *   true if the line is a result line.
+ */
+static inline bool parseResult(const char *line, Result &r)
+{
+    char name[256];
+    uint64_t counts, us;
+    size_t nThreads;
+    if (::sscanf(line, "%255s %" SCNu64 " counts %" SCNu64 " us %zu threads"
+                 , name, &counts, &us, &nThreads) != 4) {
+        return false;
+    }
+    std::string s(name);
+    if (!s.empty() && s.back() == ':') s.pop_back();
+    r.name = s;
+    r.counts = counts;
+    r.us = us;
+    r.nThreads = nThreads;
+    return true;
+}
+
+/**
+ * Per-trial throughputs for each variant and number of threads.
+ */
+using ResultSet = std::map<std::string, std::map<size_t, std::vector<double> > >;
+
+static inline void readResults(::FILE *fp, ResultSet &rs)
+{
+    char line[1024];
+    Result r;
+    while (::fgets(line, sizeof(line), fp)) {
+        if (!parseResult(line, r)) continue;
+        rs[r.name][r.nThreads].push_back(r.throughput());
+    }
+}
+
+static inline double average(const std::vector<double> &v)
+{
+    if (v.empty()) return 0;
+    double total = 0;
+    for (double d : v) total += d;
+    return total / v.size();
+}
+
+} //namespace bench
@@ -0,0 +1,67 @@
+/**
+ * @file
+ * @description scalability model fitting for thread sweeps.
+ *
+ * Read results of bench or bench_map and fit the Universal Scalability Law
+ *   X(N) = X(1) * N / (1 + sigma * (N - 1) + kappa * N * (N - 1))
+ * to the average throughput of each variant.
+ * sigma is the contention coefficient and kappa is the coherency coefficient.
+ * kappa = 0 corresponds to Amdahl's law.
+ *
+ * Usage: bench_usl [result file ...]
+ *   stdin will be read if no file is specified.
+ */
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "bench_result.hpp"
+#include "usl.hpp"
+
+int main(int argc, char *argv[])
+{
+    bench::ResultSet rs;
+    if (argc < 2) {
+        bench::readResults(::stdin, rs);
+    }
+    for (int i = 1; i < argc; i++) {
+        ::FILE *fp = ::fopen(argv[i], "r");
+        if (!fp) {
+            ::perror(argv[i]);
+            return 1;
+        }
+        bench::readResults(fp, rs);
+        ::fclose(fp);
+    }
+
+    const std::vector<size_t> predictN = {16, 32, 64, 128};
+    ::printf("%-32s %10s %10s %6s %8s %10s", "name", "sigma", "kappa", "R^2", "peakN", "peakX");
+    for (size_t n : predictN) ::printf(" %7s", ("X(" + std::to_string(n) + ")").c_str());
+    ::printf("   [counts/us]\n");
+    for (const auto &pair : rs) {
+        std::map<size_t, double> xs;
+        for (const auto &p : pair.second) {
+            xs[p.first] = bench::average(p.second);
+        }
+        if (xs.size() < 2) continue;
+        bench::UslParam p;
+        try {
+            p = bench::fitUsl(xs);
+        } catch (std::exception &e) {
+            ::printf("%-32s %s\n", pair.first.c_str(), e.what());
+            continue;
+        }
+        const double peakN = p.peakThreads();
+        ::printf("%-32s %10.3e %10.3e %6.3f", pair.first.c_str(), p.sigma, p.kappa, p.r2);
+        if (std::isinf(peakN)) {
+            ::printf(" %8s %10s", "inf", "inf");
+        } else {
+            ::printf(" %8.1f %10.3f", peakN, p.peakThroughput());
+        }
+        for (size_t n : predictN) ::printf(" %7.3f", p.predict(n));
+        ::printf("\n");
+    }
+    return 0;
+}
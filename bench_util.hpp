@@ -8,15 +8,25 @@
  * (C) 2013 HOSHINO Takashi
  */
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <memory>
 #include <chrono>
 #include <thread>
 #include <atomic>
 #include <stdexcept>
+#include <system_error>
 
+#include <pthread.h>
+#include <sched.h>
 #include <immintrin.h> /* for _mm_pause() */
 
 #include "thread_util.hpp"
 #include "time.hpp"
+#include "alloc_count.hpp"
+#include "trace.hpp"
+#include "lock_prof.hpp"
 
 namespace bench {
 
@@ -35,24 +45,48 @@ static inline void delayUsec(uint64_t usec)
     return;
 }
 
+/**
+ * Pin the calling thread to a cpu.
+ */
+static inline void setCpuAffinity(size_t cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+    if (err) {
+        throw std::system_error(err, std::system_category(), "pthread_setaffinity_np");
+    }
+}
+
 class Worker : public cybozu::thread::Runnable
 {
 protected:
     const std::atomic<bool> &isReady_;
     const std::atomic<bool> &isEnd_;
+    int cpu_; /* -1 means not pinned. */
+    AllocStat allocStat_; /* allocations during run(). */
 public:
     Worker(const std::atomic<bool> &isReady, const std::atomic<bool> &isEnd)
-        : isReady_(isReady), isEnd_(isEnd) {
+        : isReady_(isReady), isEnd_(isEnd), cpu_(-1), allocStat_() {
     }
     virtual ~Worker() noexcept = default;
+    /**
+     * The worker thread will be pinned to the cpu before starting.
+     */
+    void setCpu(int cpu) { cpu_ = cpu; }
     void operator()() noexcept override try {
+        if (0 <= cpu_) setCpuAffinity(cpu_);
         waitForReady();
+        AllocStat s0 = getAllocStat();
         run();
+        allocStat_ = getAllocStat() - s0;
         done();
     } catch (...) {
         throwErrorLater();
     }
     virtual void run() = 0;
+    const AllocStat &allocStat() const { return allocStat_; }
 protected:
     void waitForReady() {
         while (!isReady_.load(std::memory_order_relaxed)) {
@@ -74,6 +108,7 @@ void runBench(cybozu::thread::ThreadRunnerSet &thSet,
               std::atomic<bool> &isReady, std::atomic<bool> &isEnd,
               cybozu::time::TimeStack<> &ts, size_t execMs)
 {
+    if (cybozu::trace::isEnabled) cybozu::trace::clear();
     thSet.start();
     ts.pushNow();
     isReady.store(true, std::memory_order_relaxed);
@@ -83,4 +118,78 @@ void runBench(cybozu::thread::ThreadRunnerSet &thSet,
     thSet.join();
 }
 
+/**
+ * Write the trace records to BENCH_TRACE_DIR/name.json
+ * if tracing is enabled and the environment variable is set.
+ * The records will be cleared in any case.
+ * Call this after all the workers have been joined.
+ */
+static inline void dumpTrace(const std::string &name)
+{
+    if (!cybozu::trace::isEnabled) return;
+    const char *dir = ::getenv("BENCH_TRACE_DIR");
+    if (dir) {
+        std::string path = std::string(dir) + "/" + name + ".json";
+        ::FILE *fp = ::fopen(path.c_str(), "w");
+        if (!fp) throw std::runtime_error("could not open " + path);
+        cybozu::trace::dumpChromeTrace(fp);
+        ::fclose(fp);
+    }
+    cybozu::trace::clear();
+}
+
+/**
+ * Print allocations per operation if counting is enabled.
+ * This does not print a newline.
+ */
+static inline void printAllocStat(const AllocStat &s, uint64_t nOps)
+{
+    if (!isAllocCountEnabled) return;
+    ::printf("  %.3f allocs/op  %.1f bytes/op", s.allocsPerOp(nOps), s.bytesPerOp(nOps));
+}
+
+static inline std::unique_ptr<cybozu::stats::Exporter> &statsExporter()
+{
+    static std::unique_ptr<cybozu::stats::Exporter> p;
+    return p;
+}
+
+/**
+ * Start the stats exporter if BENCH_STATS_FILE and/or BENCH_STATS_SOCKET is set.
+ * BENCH_STATS_JSON=1 selects JSON instead of Prometheus text.
+ * It will run until the process exits.
+ */
+static inline void startStatsExporter()
+{
+    cybozu::stats::Exporter::Option opt;
+    const char *file = ::getenv("BENCH_STATS_FILE");
+    const char *sock = ::getenv("BENCH_STATS_SOCKET");
+    const char *json = ::getenv("BENCH_STATS_JSON");
+    if (!file && !sock) return;
+    if (file) opt.filePath = file;
+    if (sock) opt.socketPath = sock;
+    opt.isJson = json && ::strcmp(json, "1") == 0;
+    statsExporter().reset(new cybozu::stats::Exporter(opt));
+}
+
+/**
+ * Benchmarks register their maps only when exported
+ * so that counting does not affect the results.
+ */
+static inline bool isStatsExported()
+{
+    return statsExporter() != nullptr;
+}
+
+/**
+ * Print and reset the lock profiles if profiling is enabled.
+ * Call this after all the workers have been joined.
+ */
+static inline void reportLockProfile()
+{
+    if (!cybozu::isLockProfEnabled) return;
+    cybozu::printLockProfile(::stdout);
+    cybozu::resetLockProfile();
+}
+
 } //namespace bench
@@ -0,0 +1,745 @@
+#pragma once
+/**
+ * @file
+ * @description concurrent B-link tree (Lehman and Yao).
+ *
+ * Each node has a high key and a link to its right sibling.
+ * A split moves the upper half of a node to a new right sibling
+ * and links it before the separator is inserted into the parent,
+ * so a search that reaches a node after its split moves right
+ * instead of restarting from the root.
+ *
+ * Readers take no lock. They read a node optimistically,
+ * validate its version and retry the node if a writer has changed it.
+ * Writers lock one node at a time: the leaf, and then the parents
+ * while a split propagates upwards (Sagiv's variant of Lehman and Yao).
+ * Nodes are neither merged nor freed until the map is destroyed,
+ * so following a stale pointer is always safe.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <atomic>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <immintrin.h> /* for _mm_pause() */
+#include "util.hpp"
+#include "counter.hpp"
+
+namespace cybozu {
+
+/**
+ * Node size in bytes. The same as the page size of BtreeMap.
+ */
+constexpr size_t BLINK_NODE_SIZE = 1024;
+
+/**
+ * Key and T must be trivially copyable
+ * because readers copy them without locks.
+ */
+template <typename Key, typename T, class CompareT = std::less<Key> >
+class BlinkTreeMap
+{
+    static_assert(std::is_trivially_copyable<Key>::value, "Key must be trivially copyable.");
+    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable.");
+private:
+    struct Node;
+    union Slot
+    {
+        T value; /* leaf. */
+        Node *child; /* branch. */
+    };
+    static constexpr size_t HEADER_SIZE = 64;
+    static constexpr size_t CAPACITY = (BLINK_NODE_SIZE - HEADER_SIZE) / (sizeof(Key) + sizeof(Slot));
+    static_assert(4 <= CAPACITY, "too large Key or T.");
+    static constexpr size_t MAX_HEIGHT = 32;
+
+    struct Node
+    {
+        std::atomic<uint64_t> version; /* odd while locked. */
+        const uint16_t level; /* 0 for leaves. */
+        uint16_t n;
+        bool hasHighKey; /* false for the right-most node of a level. */
+        Key highKey; /* all the keys in the node are less than it. */
+        Node *right;
+        Key keys[CAPACITY];
+        Slot slots[CAPACITY];
+
+        explicit Node(uint16_t level0)
+            : version(0), level(level0), n(0), hasHighKey(false), highKey(), right(nullptr) {
+        }
+        /**
+         * Wait for writers and get the version to validate an optimistic read.
+         */
+        uint64_t stableVersion() const {
+            uint64_t v = version.load(std::memory_order_acquire);
+            while (v & 1) {
+                _mm_pause();
+                v = version.load(std::memory_order_acquire);
+            }
+            return v;
+        }
+        /**
+         * RETURN:
+         *   true if nothing has been changed since stableVersion() returned v.
+         */
+        bool isStable(uint64_t v) const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return version.load(std::memory_order_relaxed) == v;
+        }
+        void lock() {
+            uint64_t v = version.load(std::memory_order_relaxed);
+            while ((v & 1) || !version.compare_exchange_weak(v, v + 1, std::memory_order_acquire)) {
+                _mm_pause();
+                v = version.load(std::memory_order_relaxed);
+            }
+        }
+        /**
+         * Lock the node if it has not been changed since stableVersion() returned v.
+         */
+        bool tryLock(uint64_t v) {
+            return version.compare_exchange_strong(v, v + 1, std::memory_order_acquire);
+        }
+        void unlock() {
+            version.fetch_add(1, std::memory_order_release);
+        }
+        /**
+         * Number of records. A reader may see any value written by writers.
+         */
+        uint16_t size() const {
+            uint16_t n0 = __atomic_load_n(&n, __ATOMIC_RELAXED);
+            return n0 < CAPACITY ? n0 : CAPACITY;
+        }
+        bool isFull() const { return n == CAPACITY; }
+        bool isLeaf() const { return level == 0; }
+        /**
+         * RETURN:
+         *   true if the key belongs to the right siblings.
+         */
+        bool isUpper(const Key &key) const {
+            return hasHighKey && !CompareT()(key, highKey);
+        }
+        /**
+         * RETURN:
+         *   index of the first key in [bgn, size()) that is not less than the key.
+         */
+        uint16_t lowerBound(const Key &key, uint16_t bgn = 0) const {
+            uint16_t lo = bgn, hi = size();
+            while (lo < hi) {
+                const uint16_t mid = (lo + hi) / 2;
+                if (CompareT()(keys[mid], key)) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return lo;
+        }
+        bool isFound(uint16_t i, const Key &key) const {
+            return i < size() && !CompareT()(key, keys[i]);
+        }
+        /**
+         * Child whose range has the key.
+         * keys[0] of a branch is not used for search:
+         * the first child has all the keys less than keys[1],
+         * because a split of the left-most child may make a separator less than keys[0].
+         */
+        Node *child(const Key &key) const {
+            uint16_t i = lowerBound(key, 1);
+            if (i == size() || CompareT()(key, keys[i])) i--;
+            return slots[i].child;
+        }
+        void insert(const Key &key, const Slot &slot) {
+            assert(!isFull());
+            const uint16_t i = lowerBound(key, isLeaf() ? 0 : 1);
+            ::memmove(&keys[i + 1], &keys[i], (n - i) * sizeof(Key));
+            ::memmove(&slots[i + 1], &slots[i], (n - i) * sizeof(Slot));
+            keys[i] = key;
+            slots[i] = slot;
+            n++;
+        }
+        void erase(uint16_t i) {
+            assert(i < n);
+            ::memmove(&keys[i], &keys[i + 1], (n - i - 1) * sizeof(Key));
+            ::memmove(&slots[i], &slots[i + 1], (n - i - 1) * sizeof(Slot));
+            n--;
+        }
+    };
+
+    /**
+     * Nodes visited by a descent. nodes[i] is at level i.
+     */
+    struct Path
+    {
+        Node *nodes[MAX_HEIGHT];
+        uint16_t height;
+    };
+
+    std::atomic<Node *> root_;
+
+public:
+    BlinkTreeMap() : root_(newNode(0)) {}
+    ~BlinkTreeMap() noexcept {
+        /* The left-most node of each level is the first child of the upper one. */
+        Node *left = root_.load(std::memory_order_relaxed);
+        while (left) {
+            Node *next = left->isLeaf() ? nullptr : left->slots[0].child;
+            while (left) {
+                Node *right = left->right;
+                deleteNode(left);
+                left = right;
+            }
+            left = next;
+        }
+    }
+    BlinkTreeMap(const BlinkTreeMap &) = delete;
+    BlinkTreeMap &operator=(const BlinkTreeMap &) = delete;
+
+    /**
+     * RETURN:
+     *   false if the key exists.
+     */
+    bool insert(const Key &key, const T &value) {
+        Path path;
+        Node *node = lockForKey(descend(key, 0, &path), key);
+        if (node->isFound(node->lowerBound(key), key)) {
+            node->unlock();
+            return false;
+        }
+        Slot slot;
+        slot.value = value;
+        insertAndUnlock(node, key, slot, path);
+        return true;
+    }
+    /**
+     * RETURN:
+     *   false if the key does not exist.
+     */
+    bool update(const Key &key, const T &value) {
+        Node *node = lockForKey(descend(key, 0, nullptr), key);
+        const uint16_t i = node->lowerBound(key);
+        const bool found = node->isFound(i, key);
+        if (found) node->slots[i].value = value;
+        node->unlock();
+        return found;
+    }
+    /**
+     * Leaves are not merged even if they become empty.
+     * RETURN:
+     *   false if the key does not exist.
+     */
+    bool erase(const Key &key) {
+        Node *node = lockForKey(descend(key, 0, nullptr), key);
+        const uint16_t i = node->lowerBound(key);
+        const bool found = node->isFound(i, key);
+        if (found) node->erase(i);
+        node->unlock();
+        return found;
+    }
+    bool find(const Key &key, T &value) const {
+        bool found;
+        uint64_t v;
+        findLeaf(key, value, found, v);
+        return found;
+    }
+    /**
+     * Get the first record whose key is not less than the key.
+     * RETURN:
+     *   false if there is no such record.
+     */
+    bool lowerBound(const Key &key, Key &foundKey, T &value) const {
+        const Node *node = descend(key, 0, nullptr);
+        while (true) {
+            const uint64_t v = node->stableVersion();
+            const bool isUpper = node->isUpper(key);
+            const uint16_t i = isUpper ? 0 : node->lowerBound(key);
+            const bool found = !isUpper && i < node->size();
+            if (found) {
+                foundKey = node->keys[i];
+                value = node->slots[i].value;
+            }
+            const Node *right = node->right;
+            if (!node->isStable(v)) continue;
+            if (found) return true;
+            /* All the keys of the right siblings are larger than the key. */
+            if (!right) return false;
+            node = right;
+        }
+    }
+    /**
+     * Call fn(key, value) for the records whose keys are not less than the key
+     * in the key order until fn returns false.
+     * Each leaf is copied by an optimistic read and fn is called outside the read,
+     * so a record inserted into a leaf after the copy may not be visited.
+     */
+    template <typename Func>
+    void scan(const Key &key, Func fn) const {
+        scanFrom(descend(key, 0, nullptr), &key, fn);
+    }
+    /**
+     * scan() from the first record.
+     */
+    template <typename Func>
+    void scan(Func fn) const {
+        const Node *node = root_.load(std::memory_order_acquire);
+        while (!node->isLeaf()) {
+            const uint64_t v = node->stableVersion();
+            const Node *next = node->slots[0].child;
+            if (node->isStable(v)) node = next;
+        }
+        scanFrom(node, nullptr, fn);
+    }
+    class Transaction;
+
+    /**
+     * The followings are not thread-safe with writers.
+     */
+    size_t size() const {
+        size_t n = 0;
+        for (const Node *node = leftMostLeaf(); node; node = node->right) n += node->n;
+        return n;
+    }
+    bool empty() const {
+        for (const Node *node = leftMostLeaf(); node; node = node->right) {
+            if (node->n != 0) return false;
+        }
+        return true;
+    }
+    size_t height() const {
+        return root_.load(std::memory_order_relaxed)->level + 1;
+    }
+    /**
+     * Check the key order, the high keys and that the children of each level
+     * are the same as the right-link chain of the lower level.
+     */
+    bool isValid() const {
+        const Node *left = root_.load(std::memory_order_relaxed);
+        if (left->hasHighKey || left->right) {
+            ::printf("error: root has a right sibling.\n");
+            return false;
+        }
+        while (left) {
+            const Node *lower = left->isLeaf() ? nullptr : left->slots[0].child;
+            for (const Node *node = left; node; node = node->right) {
+                if (!isValidNode(node)) return false;
+                if (!node->isLeaf() && node->n == 0) {
+                    ::printf("error: empty branch.\n");
+                    return false;
+                }
+                for (uint16_t i = 0; i < node->n && !node->isLeaf(); i++) {
+                    const Node *child = node->slots[i].child;
+                    if (child != lower) {
+                        ::printf("error: children differ from the right links.\n");
+                        return false;
+                    }
+                    if (i != 0 && child->n != 0 && CompareT()(child->keys[0], node->keys[i])) {
+                        ::printf("error: a key is less than the separator.\n");
+                        return false;
+                    }
+                    lower = lower->right;
+                }
+            }
+            if (lower) {
+                ::printf("error: a node is not linked from the parent.\n");
+                return false;
+            }
+            left = left->isLeaf() ? nullptr : left->slots[0].child;
+        }
+        return true;
+    }
+private:
+    static Node *newNode(uint16_t level) {
+        void *p;
+        if (::posix_memalign(&p, CACHE_LINE_SIZE, sizeof(Node)) != 0) {
+            throw std::bad_alloc();
+        }
+        return new(p) Node(level);
+    }
+    static void deleteNode(Node *node) {
+        node->~Node();
+        ::free(node);
+    }
+    const Node *leftMostLeaf() const {
+        const Node *node = root_.load(std::memory_order_relaxed);
+        while (!node->isLeaf()) node = node->slots[0].child;
+        return node;
+    }
+    bool isValidNode(const Node *node) const {
+        for (uint16_t i = node->isLeaf() ? 1 : 2; i < node->n; i++) {
+            if (!CompareT()(node->keys[i - 1], node->keys[i])) {
+                ::printf("error: keys are not sorted.\n");
+                return false;
+            }
+        }
+        if (node->hasHighKey != (node->right != nullptr)) {
+            ::printf("error: high key without a right sibling.\n");
+            return false;
+        }
+        if (node->hasHighKey && node->n != 0 && node->isUpper(node->keys[node->n - 1])) {
+            ::printf("error: a key is not less than the high key.\n");
+            return false;
+        }
+        const Node *right = node->right;
+        if (right && right->n != 0 && CompareT()(right->keys[0], node->highKey)) {
+            ::printf("error: a key of the right sibling is less than the high key.\n");
+            return false;
+        }
+        return true;
+    }
+    /**
+     * @key the lower bound. nullptr for no bound.
+     */
+    template <typename Func>
+    static void scanFrom(const Node *node, const Key *key, Func &fn) {
+        Key keys[CAPACITY];
+        T values[CAPACITY];
+        while (node) {
+            const uint64_t v = node->stableVersion();
+            const bool isUpper = key && node->isUpper(*key);
+            const uint16_t n = isUpper ? 0 : node->size();
+            const uint16_t i0 = key && !isUpper ? node->lowerBound(*key) : 0;
+            for (uint16_t i = i0; i < n; i++) {
+                keys[i] = node->keys[i];
+                values[i] = node->slots[i].value;
+            }
+            const Node *right = node->right;
+            if (!node->isStable(v)) continue;
+            for (uint16_t i = i0; i < n; i++) {
+                if (!fn(keys[i], values[i])) return;
+            }
+            node = right;
+        }
+    }
+    /**
+     * Optimistic read of the key.
+     * @version the version of the leaf that decided the result.
+     * RETURN:
+     *   the leaf.
+     */
+    const Node *findLeaf(const Key &key, T &value, bool &found, uint64_t &version) const {
+        const Node *node = descend(key, 0, nullptr);
+        while (true) {
+            const uint64_t v = node->stableVersion();
+            if (node->isUpper(key)) {
+                const Node *right = node->right;
+                if (node->isStable(v)) node = right;
+                continue;
+            }
+            const uint16_t i = node->lowerBound(key);
+            found = node->isFound(i, key);
+            if (found) value = node->slots[i].value;
+            if (node->isStable(v)) {
+                version = v;
+                return node;
+            }
+        }
+    }
+    /**
+     * Go down to the node of a level that may have the key, without locks.
+     * @path the node of each upper level is recorded if not nullptr.
+     */
+    Node *descend(const Key &key, uint16_t level, Path *path) const {
+        Node *node = root_.load(std::memory_order_acquire);
+        if (path) path->height = node->level + 1;
+        while (node->level != level) {
+            const uint64_t v = node->stableVersion();
+            Node *next = node->isUpper(key) ? node->right : node->child(key);
+            if (!node->isStable(v)) continue;
+            if (path) path->nodes[node->level] = node;
+            node = next;
+        }
+        return node;
+    }
+    /**
+     * Lock the node and move right until the node may have the key.
+     * Only one node is locked at a time.
+     */
+    static Node *lockForKey(Node *node, const Key &key) {
+        node->lock();
+        while (node->isUpper(key)) {
+            Node *right = node->right;
+            node->unlock();
+            right->lock();
+            node = right;
+        }
+        return node;
+    }
+    /**
+     * Move the upper half to a new right sibling.
+     * The new node is not visible until the node is unlocked.
+     */
+    static Node *split(Node *node) {
+        Node *right = newNode(node->level);
+        const uint16_t mid = node->n / 2;
+        right->n = node->n - mid;
+        ::memcpy(&right->keys[0], &node->keys[mid], right->n * sizeof(Key));
+        ::memcpy(&right->slots[0], &node->slots[mid], right->n * sizeof(Slot));
+        right->hasHighKey = node->hasHighKey;
+        right->highKey = node->highKey;
+        right->right = node->right;
+        node->n = mid;
+        node->hasHighKey = true;
+        node->highKey = right->keys[0];
+        node->right = right;
+        return right;
+    }
+    /**
+     * Make a new root whose children are the locked root and its new right sibling.
+     * The tree grows while the old root is locked,
+     * so only one thread can replace the root.
+     */
+    void growRoot(Node *node, Node *right) {
+        const uint16_t level = node->level + 1;
+        assert(level < MAX_HEIGHT);
+        Node *root = newNode(level);
+        root->keys[0] = node->keys[0];
+        root->slots[0].child = node;
+        root->keys[1] = right->keys[0];
+        root->slots[1].child = right;
+        root->n = 2;
+        root_.store(root, std::memory_order_release);
+    }
+    /**
+     * Insert a record into a locked node, splitting it and its ancestors if full.
+     */
+    void insertAndUnlock(Node *node, Key key, Slot slot, Path &path) {
+        while (true) {
+            if (!node->isFull()) {
+                node->insert(key, slot);
+                node->unlock();
+                return;
+            }
+            Node *right = split(node);
+            (CompareT()(key, right->keys[0]) ? node : right)->insert(key, slot);
+            const Key sep = right->keys[0];
+            const uint16_t level = node->level + 1;
+            if (node == root_.load(std::memory_order_relaxed)) {
+                growRoot(node, right);
+                node->unlock();
+                return;
+            }
+            node->unlock();
+            /* The parent may have been split or the tree may have grown since the descent. */
+            Node *parent = level < path.height ? path.nodes[level] : descend(sep, level, &path);
+            node = lockForKey(parent, sep);
+            key = sep;
+            slot.child = right;
+        }
+    }
+};
+
+/**
+ * Optimistic transaction over several keys.
+ *
+ * Writes are buffered until commit() and find() sees them.
+ * A read records the version of the leaf that decided the result,
+ * so an absent key is protected as well as an existing one.
+ * commit() locks the leaves of the written keys in the key order,
+ * validates that no other writer has changed the read leaves
+ * and applies the writes before unlocking the leaves.
+ * Separators of the leaves split by the writes are inserted into the parents
+ * after the unlock, as the right links keep the new leaves reachable.
+ * Readers of the map never wait for a transaction except during its apply.
+ */
+template <typename Key, typename T, class CompareT>
+class BlinkTreeMap<Key, T, CompareT>::Transaction
+{
+private:
+    struct Read
+    {
+        const Node *node;
+        uint64_t version;
+    };
+    struct Write
+    {
+        Key key;
+        bool isErased;
+        T value;
+    };
+    BlinkTreeMap &map_;
+    std::vector<Read> reads_;
+    std::vector<Write> writes_;
+    std::vector<Node *> leaves_; /* the locked leaf of each write. */
+    std::vector<Node *> locked_; /* in the key order. */
+    std::vector<std::pair<Key, Node *> > splits_; /* separators to insert into the parents. */
+
+public:
+    explicit Transaction(BlinkTreeMap &map)
+        : map_(map), reads_(), writes_(), leaves_(), locked_(), splits_() {
+    }
+    /**
+     * Find the key in the buffered writes and then in the map.
+     */
+    bool find(const Key &key, T &value) {
+        for (size_t i = writes_.size(); i > 0; i--) {
+            const Write &w = writes_[i - 1];
+            if (!isEqual(w.key, key)) continue;
+            if (w.isErased) return false;
+            value = w.value;
+            return true;
+        }
+        Read r;
+        bool found;
+        r.node = map_.findLeaf(key, value, found, r.version);
+        reads_.push_back(r);
+        return found;
+    }
+    /**
+     * Insert or update.
+     */
+    void put(const Key &key, const T &value) {
+        writes_.push_back(Write{key, false, value});
+    }
+    /**
+     * Erasing an absent key is ignored at commit.
+     */
+    void erase(const Key &key) {
+        writes_.push_back(Write{key, true, T()});
+    }
+    /**
+     * The transaction is cleared after commit for reuse.
+     * RETURN:
+     *   false if another writer has changed a read. Nothing is written then.
+     */
+    bool commit() {
+        sortWrites();
+        lockLeaves();
+        const bool isValid = validate();
+        if (isValid) applyWrites();
+        for (Node *node : locked_) node->unlock();
+        linkSplits();
+        clear();
+        return isValid;
+    }
+    void clear() {
+        reads_.clear();
+        writes_.clear();
+        leaves_.clear();
+        locked_.clear();
+        splits_.clear();
+    }
+    size_t numReads() const { return reads_.size(); }
+    size_t numWrites() const { return writes_.size(); }
+
+private:
+    static bool isEqual(const Key &a, const Key &b) {
+        return !CompareT()(a, b) && !CompareT()(b, a);
+    }
+    /**
+     * Sort the writes by key and keep the last write of each key.
+     */
+    void sortWrites() {
+        std::stable_sort(writes_.begin(), writes_.end(), [](const Write &a, const Write &b) {
+                return CompareT()(a.key, b.key);
+            });
+        size_t j = 0;
+        for (size_t i = 0; i < writes_.size(); i++) {
+            if (i + 1 < writes_.size() && isEqual(writes_[i].key, writes_[i + 1].key)) continue;
+            writes_[j++] = writes_[i];
+        }
+        writes_.resize(j);
+    }
+    /**
+     * Lock the leaves from left to right, so transactions do not deadlock.
+     * Only the first leaf is found by a descent. The next one is on the right links
+     * of the last locked leaf, which do not change while it is locked,
+     * so no leaf left of a locked one is locked.
+     */
+    void lockLeaves() {
+        for (const Write &w : writes_) {
+            Node *node;
+            if (locked_.empty()) {
+                node = map_.descend(w.key, 0, nullptr);
+            } else {
+                node = locked_.back();
+                if (!node->isUpper(w.key)) {
+                    leaves_.push_back(node);
+                    continue;
+                }
+                node = node->right;
+            }
+            node = lockLeaf(node, w.key);
+            locked_.push_back(node);
+            leaves_.push_back(node);
+        }
+    }
+    /**
+     * Move right to the leaf of the key and lock it.
+     * The leaves on the way are read optimistically and not locked,
+     * so the versions of them read by this transaction are kept.
+     */
+    static Node *lockLeaf(Node *node, const Key &key) {
+        while (true) {
+            const uint64_t v = node->stableVersion();
+            const bool isUpper = node->isUpper(key);
+            Node *right = node->right;
+            if (!node->isStable(v)) continue;
+            if (isUpper) {
+                node = right;
+            } else if (node->tryLock(v)) {
+                return node;
+            }
+        }
+    }
+    bool validate() const {
+        std::vector<const Node *> locked(locked_.begin(), locked_.end());
+        std::sort(locked.begin(), locked.end());
+        for (const Read &r : reads_) {
+            uint64_t v = r.node->version.load(std::memory_order_acquire);
+            /* locked once by this transaction. */
+            if (std::binary_search(locked.begin(), locked.end(), r.node)) v--;
+            if (v != r.version) return false;
+        }
+        return true;
+    }
+    /**
+     * A full leaf is split and the new right sibling is locked
+     * until the other leaves are unlocked.
+     */
+    void applyWrites() {
+        for (size_t i = 0; i < writes_.size(); i++) {
+            const Write &w = writes_[i];
+            Node *node = leaves_[i];
+            while (node->isUpper(w.key)) node = node->right; /* split by a previous write. */
+            const uint16_t j = node->lowerBound(w.key);
+            if (node->isFound(j, w.key)) {
+                if (w.isErased) {
+                    node->erase(j);
+                } else {
+                    node->slots[j].value = w.value;
+                }
+                continue;
+            }
+            if (w.isErased) continue;
+            if (node->isFull()) {
+                Node *right = split(node);
+                right->lock();
+                locked_.push_back(right);
+                if (node == map_.root_.load(std::memory_order_relaxed)) {
+                    map_.growRoot(node, right);
+                } else {
+                    splits_.emplace_back(right->keys[0], right);
+                }
+                if (!CompareT()(w.key, right->keys[0])) node = right;
+            }
+            Slot slot;
+            slot.value = w.value;
+            node->insert(w.key, slot);
+        }
+    }
+    void linkSplits() {
+        for (const auto &pair : splits_) {
+            Path path;
+            Node *parent = map_.descend(pair.first, 1, &path);
+            Slot slot;
+            slot.child = pair.second;
+            map_.insertAndUnlock(lockForKey(parent, pair.first), pair.first, slot, path);
+        }
+    }
+};
+
+} //namespace cybozu
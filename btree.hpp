@@ -6,13 +6,20 @@
 #include <cstdlib>
 #include <cassert>
 #include <cstring>
+#include <cinttypes>
 #include <stdexcept>
 #include <thread>
 #include <mutex>
 #include <sstream>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
 #include <condition_variable>
 #include "util.hpp"
+#include "trace.hpp"
+#include "btree_prof.hpp"
+#include "stats.hpp"
 
 namespace cybozu {
 
@@ -108,6 +115,17 @@ public:
     /* unlock */
 };
 
+/**
+ * Define CYBOZU_BTREE_PAGE_ID (make PAGE_ID=1) to refer to pages by 32-bit IDs
+ * through the page table instead of pointers.
+ * Branch records and page headers get smaller and the fanout gets larger.
+ */
+#ifdef CYBOZU_BTREE_PAGE_ID
+using PageRef = uint32_t; /* 0 is null. */
+#else
+using PageRef = void *;
+#endif
+
 /**
  * Page header data.
  */
@@ -117,7 +135,19 @@ struct header
     uint16_t stubBgnOff; /* stub begin offset in the page. */
     uint16_t level; /* 0 for leaf nodes. */
     uint16_t totalDataSize; /* total data size in the page. */
-    void *parent; /* parent pointer. nullptr in a root node. */
+    uint16_t freeHead; /* offset of the first free block. 0 for none. */
+    PageRef parent; /* parent page. null in a root node. */
+} PACKED;
+
+/**
+ * Free block in the record area, left by an erased record.
+ * Free blocks are linked from header::freeHead.
+ * Records smaller than it are not reused until gc().
+ */
+struct freeBlock
+{
+    uint16_t size; /* [byte] */
+    uint16_t next; /* offset of the next free block. 0 for none. */
 } PACKED;
 
 constexpr uint16_t EMPTY = uint16_t(-1);
@@ -128,36 +158,243 @@ static bool isNormalIndex(uint16_t idx)
     return idx != EMPTY && idx != LOWER && idx != UPPER;
 }
 
+/**
+ * Define CYBOZU_BTREE_HEAT (make HEAT=1) to count page accesses.
+ */
+#ifdef CYBOZU_BTREE_HEAT
+constexpr bool isHeatEnabled = true;
+#define CYBOZU_BTREE_HEAT_DO(...) do { __VA_ARGS__; } while (0)
+#else
+constexpr bool isHeatEnabled = false;
+#define CYBOZU_BTREE_HEAT_DO(...) ((void)0)
+#endif
+
+#ifndef CYBOZU_BTREE_HEAT_SAMPLE
+#define CYBOZU_BTREE_HEAT_SAMPLE 16 /* count 1 in N accesses. power of two. */
+#endif
+
+/**
+ * Access counters of a leaf page.
+ * nRead and nWrite are sampled. nSplit is exact.
+ */
+struct PageHeat
+{
+    uint32_t nRead;
+    uint32_t nWrite;
+    uint32_t nSplit; /* number of splits of the page and its ancestor pages. */
+
+    PageHeat() : nRead(0), nWrite(0), nSplit(0) {}
+    uint64_t nAccess() const { return uint64_t(nRead) + nWrite; }
+    void add(const PageHeat &rhs) {
+        nRead += rhs.nRead;
+        nWrite += rhs.nWrite;
+        nSplit = std::max(nSplit, rhs.nSplit);
+    }
+    /**
+     * Heat inherited by each page of a split.
+     */
+    PageHeat half() const {
+        PageHeat h;
+        h.nRead = nRead / 2;
+        h.nWrite = nWrite / 2;
+        h.nSplit = nSplit + 1;
+        return h;
+    }
+};
+
+/**
+ * Thread-local sampling decision.
+ */
+static inline bool sampleHeat()
+{
+    static thread_local uint32_t n = 0;
+    return (n++ & (CYBOZU_BTREE_HEAT_SAMPLE - 1)) == 0;
+}
+
+/**
+ * Page allocation counters shared by all the pages.
+ */
+struct PageStats
+{
+    stats::Counter nAlloc;
+    stats::Counter nFree;
+    stats::Counter nGc;
+    stats::Collector collector;
+
+    PageStats() : collector([this](std::vector<stats::Sample> &v) {
+            using stats::Type;
+            const uint64_t nAlloc0 = nAlloc.value();
+            const uint64_t nFree0 = nFree.value();
+            stats::addSample(v, "cybozu_btree_page_alloc_total", "Allocated pages."
+                             , Type::COUNTER, {}, nAlloc0);
+            stats::addSample(v, "cybozu_btree_page_free_total", "Freed pages."
+                             , Type::COUNTER, {}, nFree0);
+            stats::addSample(v, "cybozu_btree_page_bytes", "Memory of live pages."
+                             , Type::GAUGE, {}, double(nAlloc0 - nFree0) * PAGE_SIZE);
+            stats::addSample(v, "cybozu_btree_page_gc_total", "Garbage collections in pages."
+                             , Type::COUNTER, {}, nGc.value());
+        }) {
+    }
+};
+
+static inline PageStats &pageStats()
+{
+    static PageStats s;
+    return s;
+}
+
+#ifdef CYBOZU_BTREE_PAGE_ID
+/**
+ * Table from page IDs to page objects shared by all the pages.
+ * Entries are allocated in chunks that never move, so lookups do not lock.
+ * IDs of removed pages are reused.
+ */
+class PageTable
+{
+private:
+    static constexpr uint32_t CHUNK_BITS = 16;
+    static constexpr uint32_t CHUNK_SIZE = 1U << CHUNK_BITS;
+    static constexpr uint32_t NUM_CHUNKS = 1U << (32 - CHUNK_BITS);
+
+    std::unique_ptr<void *[]> chunks_[NUM_CHUNKS];
+    std::vector<uint32_t> freeIds_;
+    uint32_t nextId_;
+    size_t size_;
+    mutable std::mutex mutex_;
+
+    void *&slot(uint32_t id) const {
+        return chunks_[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+    }
+public:
+    PageTable() : chunks_(), freeIds_(), nextId_(1), size_(0) {}
+    uint32_t add(void *p) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        uint32_t id;
+        if (!freeIds_.empty()) {
+            id = freeIds_.back();
+            freeIds_.pop_back();
+        } else {
+            if (nextId_ == 0) throw std::runtime_error("PageTable: no more page IDs.");
+            id = nextId_++;
+            std::unique_ptr<void *[]> &chunk = chunks_[id >> CHUNK_BITS];
+            if (!chunk) chunk.reset(new void *[CHUNK_SIZE]);
+        }
+        slot(id) = p;
+        size_++;
+        return id;
+    }
+    void remove(uint32_t id) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        assert(id != 0);
+        slot(id) = nullptr;
+        freeIds_.push_back(id);
+        size_--;
+    }
+    void *get(uint32_t id) const {
+        assert(id != 0);
+        return slot(id);
+    }
+    /**
+     * Number of pages having IDs.
+     */
+    size_t size() const {
+        std::lock_guard<std::mutex> lk(mutex_);
+        return size_;
+    }
+};
+
+static inline PageTable &pageTable()
+{
+    static PageTable t;
+    return t;
+}
+#endif
+
+/**
+ * Aggregation policy of BtreeMap.
+ * A policy is a monoid over records:
+ *   Value: aggregate type. default constructible and copyable.
+ *   identity(): the identity element.
+ *   of(key, value): aggregate of a record.
+ *   combine(a, b): aggregate of a followed by b. it must be associative.
+ * NoAggregate disables aggregation and costs nothing.
+ */
+struct NoAggregate
+{
+    struct Value {};
+    static Value identity() { return Value(); }
+    template <typename Key, typename T>
+    static Value of(const Key &, const T &) { return Value(); }
+    static Value combine(const Value &, const Value &) { return Value(); }
+};
+
+/**
+ * Number of records.
+ */
+struct CountAggregate
+{
+    using Value = uint64_t;
+    static Value identity() { return 0; }
+    template <typename Key, typename T>
+    static Value of(const Key &, const T &) { return 1; }
+    static Value combine(const Value &a, const Value &b) { return a + b; }
+};
+
+/**
+ * Sum of values in type V.
+ */
+template <typename V>
+struct SumAggregate
+{
+    using Value = V;
+    static Value identity() { return Value(); }
+    template <typename Key, typename T>
+    static Value of(const Key &, const T &value) { return Value(value); }
+    static Value combine(const Value &a, const Value &b) { return a + b; }
+};
+
 /**
  * Page wrapper.
  * This store sorted key-value records.
  *
  * CompareT type must be the same as CompareX.
+ * AggT is the aggregate type of the subtree, which is maintained by BtreeMap.
  */
-template <typename CompareT>
+template <typename CompareT, typename AggT = NoAggregate::Value>
 class PageX
 {
 private:
     std::mutex mutex_;
     std::condition_variable cv_;
     Mgl mgl_;
+#ifdef CYBOZU_BTREE_HEAT
+    PageHeat heat_; /* kept in the object so that gc() does not reset it. */
+#endif
+    AggT agg_; /* aggregate of the subtree. kept in the object so that gc() does not reset it. */
+#ifdef CYBOZU_BTREE_PAGE_ID
+    mutable uint32_t id_ = 0; /* assigned when the page is referred first. */
+#endif
 
-    using Page = PageX<CompareT>;
+    using Page = PageX<CompareT, AggT>;
 
     /* All persistent data are stored in the page. */
     char *page_;
 
 public:
-    explicit PageX() : page_(allocPageStatic()) {
+    explicit PageX() : agg_(), page_(allocPageStatic()) {
         init();
     }
     virtual ~PageX() noexcept {
+        if (page_) pageStats().nFree.add();
         ::free(page_);
+#ifdef CYBOZU_BTREE_PAGE_ID
+        if (id_ != 0) pageTable().remove(id_);
+#endif
     }
-    PageX(const Page &rhs) : page_(allocPageStatic()) {
+    PageX(const Page &rhs) : agg_(rhs.agg_), page_(allocPageStatic()) {
         ::memcpy(page_, rhs.page_, PAGE_SIZE);
     }
-    PageX(Page &&rhs) : page_(rhs.page_) {
+    PageX(Page &&rhs) : agg_(rhs.agg_), page_(rhs.page_) {
         rhs.page_ = nullptr;
     }
     Page &operator=(const Page &rhs) {
@@ -181,9 +418,10 @@ public:
     void clear() {
         header().recEndOff = headerEndOff();
         header().stubBgnOff = PAGE_SIZE;
-        header().parent = nullptr;
+        header().parent = PageRef();
         header().level = uint16_t(-1); /* POISON value. You must set it by yourself. */
         header().totalDataSize = 0;
+        header().freeHead = 0;
 #ifdef DEBUG
         /* zero-clear except for header area. */
         uint16_t size = PAGE_SIZE - headerEndOff();
@@ -195,6 +433,12 @@ public:
         if (!(stubBgnOff() <= PAGE_SIZE)) return false;
 #ifdef DEBUG
         if (totalDataSize() != calcTotalDataSize()) return false;
+        size_t freeBytes = 0;
+        for (uint16_t off = header().freeHead; off != 0; off = freeBlockAt(off).next) {
+            if (off < headerEndOff() || recEndOff() < off + freeBlockAt(off).size) return false;
+            freeBytes += freeBlockAt(off).size;
+            if (emptySize() < freeBytes) return false; /* a cycle. */
+        }
 #endif
         return true;
     }
@@ -226,8 +470,13 @@ public:
     uint16_t emptySize() const {
         return PAGE_SIZE - headerEndOff();
     }
+    /**
+     * A record goes to the free space or a free block,
+     * and its stub always goes to the free space.
+     */
     bool canInsert(uint16_t size) const {
-        return size + sizeof(struct stub) <= freeSpace();
+        if (size + sizeof(struct stub) <= freeSpace()) return true;
+        return sizeof(struct stub) <= freeSpace() && findFreeBlock(size) != 0;
     }
     bool insert(const void *keyPtr0, uint16_t keySize0,
                 const void *valuePtr0, uint16_t valueSize0, BtreeError *err = nullptr) {
@@ -239,6 +488,7 @@ public:
                 return false;
             }
         }
+        CYBOZU_BTREE_PROF_PAGE_PHASE(MODIFY);
 
         /* Check free space. */
         if (!canInsert(keySize0 + valueSize0)) {
@@ -247,8 +497,7 @@ public:
         }
 
         /* Allocate space for new record. */
-        uint16_t recOff = recEndOff();
-        header().recEndOff += keySize0 + valueSize0;
+        const uint16_t recOff = allocRecord(keySize0 + valueSize0);
         header().stubBgnOff -= sizeof(struct stub);
 
         /* Copy record data. */
@@ -273,12 +522,61 @@ public:
     }
     template <typename Key, typename T>
     bool insert(const Key &key, const T &value, BtreeError *err = nullptr) {
+        static_assert(!std::is_same<T, Page *>::value, "use insertChild() for child pages.");
         return insert(&key, sizeof(key), &value, sizeof(value), err);
     }
+    /**
+     * Append a record whose key is larger than all keys in the page.
+     * This is for sorted input and does not compare keys.
+     * RETURN:
+     *   false if there is no space.
+     */
+    bool append(const void *keyPtr0, uint16_t keySize0,
+                const void *valuePtr0, uint16_t valueSize0) {
+        assert(empty() || isUpper(keyPtr0, keySize0));
+        if (!canInsert(keySize0 + valueSize0)) return false;
+
+        const uint16_t recOff = allocRecord(keySize0 + valueSize0);
+        const uint16_t n = numStub();
+        header().stubBgnOff -= sizeof(struct stub);
+        ::memmove(page_ + stubBgnOff(), page_ + stubBgnOff() + sizeof(struct stub),
+                  n * sizeof(struct stub));
+
+        ::memcpy(page_ + recOff, keyPtr0, keySize0);
+        ::memcpy(page_ + recOff + keySize0, valuePtr0, valueSize0);
+        stub(n).off = recOff;
+        stub(n).keySize = keySize0;
+        stub(n).valueSize = valueSize0;
+        header().totalDataSize += keySize0 + valueSize0 + sizeof(struct stub);
+        return true;
+    }
+    template <typename Key, typename T>
+    bool append(const Key &key, const T &value) {
+        static_assert(!std::is_same<T, Page *>::value, "use appendChild() for child pages.");
+        return append(&key, sizeof(key), &value, sizeof(value));
+    }
+    /**
+     * Move the records from idx to the end into the end of dst.
+     * The keys must be larger than all keys in dst.
+     * The moved records become free blocks.
+     */
+    void moveTail(uint16_t idx, Page &dst) {
+        const uint16_t n = numStub();
+        assert(idx <= n);
+        for (uint16_t i = idx; i < n; i++) {
+            UNUSED bool ret = dst.append(keyPtr(i), keySize(i), valuePtr(i), valueSize(i));
+            assert(ret);
+            header().totalDataSize -= keySize(i) + valueSize(i) + sizeof(struct stub);
+            freeRecord(stub(i).off, keySize(i) + valueSize(i));
+        }
+        const uint16_t shift = (n - idx) * sizeof(struct stub);
+        ::memmove(page_ + stubBgnOff() + shift, page_ + stubBgnOff(), idx * sizeof(struct stub));
+        header().stubBgnOff += shift;
+    }
     /**
      * remove a record.
-     * Stub area will be shrinked, but record area will not.
-     * You must call gc() explicitly.
+     * Stub area will be shrinked, and the record becomes a free block
+     * reused by later insertions. gc() compacts the page.
      */
     bool erase(const void *keyPtr, uint16_t keySize) {
         uint16_t idx = lowerBoundStub(keyPtr, keySize);
@@ -307,6 +605,7 @@ public:
     }
     template <typename Key, typename T>
     bool update(const Key &key, const T &value) {
+        static_assert(!std::is_same<T, Page *>::value, "use updateChild() for child pages.");
         return update(&key, sizeof(key), &value, sizeof(value));
     }
     bool isLower(const void *keyPtr0, uint16_t keySize0) const {
@@ -365,6 +664,9 @@ public:
      * Collect garbage.
      */
     void gc() {
+        CYBOZU_TRACE_EVENT(GC, level());
+        CYBOZU_BTREE_PROF_PHASE(GC);
+        pageStats().nGc.add();
         Page p;
         for (size_t i = 0; i < numStub(); i++) {
             UNUSED bool ret;
@@ -388,6 +690,7 @@ public:
         if (::posix_memalign(&p, PAGE_SIZE, PAGE_SIZE) != 0) {
             throw std::bad_alloc();
         }
+        pageStats().nAlloc.add();
 #ifdef DEBUG
         ::memset(p, 0, PAGE_SIZE);
 #endif
@@ -400,12 +703,39 @@ public:
     const struct header &header() const {
         return *reinterpret_cast<const struct header *>(page_);
     }
-    const Page *parent() const { return reinterpret_cast<const Page *>(header().parent); }
-    Page *parent() { return reinterpret_cast<Page *>(header().parent); }
+    const Page *parent() const { return deref(header().parent); }
+    Page *parent() { return deref(header().parent); }
+    void setParent(const Page *page) { header().parent = page ? page->ref() : PageRef(); }
     bool isRoot() const { return parent() == nullptr; }
     bool isBranch() const { return header().level != 0; } /* may include root. */
     bool isLeaf() const { return header().level == 0; } /* may include root. */
     uint16_t level() const { return header().level; }
+#ifdef CYBOZU_BTREE_HEAT
+    PageHeat &heat() { return heat_; }
+    const PageHeat &heat() const { return heat_; }
+#endif
+    AggT &agg() { return agg_; }
+    const AggT &agg() const { return agg_; }
+
+    /**
+     * Reference to the page stored in branch records and headers.
+     * The page ID is taken at the first call in the page ID mode.
+     */
+    PageRef ref() const {
+#ifdef CYBOZU_BTREE_PAGE_ID
+        if (id_ == 0) id_ = pageTable().add(const_cast<Page *>(this));
+        return id_;
+#else
+        return const_cast<Page *>(this);
+#endif
+    }
+    static Page *deref(PageRef ref) {
+#ifdef CYBOZU_BTREE_PAGE_ID
+        return ref == 0 ? nullptr : static_cast<Page *>(pageTable().get(ref));
+#else
+        return static_cast<Page *>(ref);
+#endif
+    }
 
     /**
      * Swap page_.
@@ -536,9 +866,10 @@ public:
         const void *valuePtr() const { return pageP_->valuePtr(idx_); }
         uint16_t valueSize() const { return pageP_->valueSize(idx_); }
         template <typename Key>
-        const Key &key() const { return pageP_->key<Key>(idx_); }
+        const Key &key() const { return pageP_->template key<Key>(idx_); }
         template <typename T>
-        const T &value() const { return pageP_->value<T>(idx_); }
+        const T &value() const { return pageP_->template value<T>(idx_); }
+        PageT *childPage() const { return pageP_->childPage(idx_); }
 
         PageT *page() { return pageP_; }
         const PageT *page() const { return pageP_; }
@@ -663,7 +994,7 @@ public:
         if (i == LOWER) return leftMostChild();
         if (i == UPPER) return rightMostChild();
         assert(isNormalIndex(i));
-        return value<Page *>(i);
+        return childPage(i);
     }
     template <typename Key>
     const Page *child(const Key &key) const {
@@ -672,23 +1003,31 @@ public:
         if (i == LOWER) return leftMostChild();
         if (i == UPPER) return rightMostChild();
         assert(isNormalIndex(i));
-        return value<const Page *>(i);
+        return childPage(i);
     }
+    Page *childPage(uint16_t i) { return deref(value<PageRef>(i)); }
+    const Page *childPage(uint16_t i) const { return deref(value<PageRef>(i)); }
+    template <typename Key>
+    bool insertChild(const Key &key, const Page *child) { return insert<Key, PageRef>(key, child->ref()); }
+    template <typename Key>
+    bool updateChild(const Key &key, const Page *child) { return update<Key, PageRef>(key, child->ref()); }
+    template <typename Key>
+    bool appendChild(const Key &key, const Page *child) { return append<Key, PageRef>(key, child->ref()); }
     Page *leftMostChild() {
         assert(!empty());
-        return value<Page *>(0);
+        return childPage(0);
     }
     const Page *leftMostChild() const {
         assert(!empty());
-        return value<const Page *>(0);
+        return childPage(0);
     }
     Page *rightMostChild() {
         assert(!empty());
-        return value<Page *>(numStub() - 1);
+        return childPage(numStub() - 1);
     }
     const Page *rightMostChild() const {
         assert(!empty());
-        return value<const Page *>(numStub() - 1);
+        return childPage(numStub() - 1);
     }
 
 private:
@@ -737,6 +1076,7 @@ private:
      *   stub index for other cases (0 <= i < numStub()).
      */
     uint16_t lowerBoundStub(const void *keyPtr0, uint16_t keySize0) const {
+        CYBOZU_BTREE_PROF_PAGE_PHASE(SEARCH);
         if (empty()) return EMPTY;
         if (isUpper(keyPtr0, keySize0)) return UPPER;
         if (isLower(keyPtr0, keySize0)) return 0;
@@ -861,12 +1201,77 @@ private:
      */
     void eraseStub(size_t i) {
         assert(i < numStub());
+        CYBOZU_BTREE_PROF_PAGE_PHASE(MODIFY);
         header().totalDataSize -= stub(i).keySize + stub(i).valueSize + sizeof(struct stub);
+        freeRecord(stub(i).off, stub(i).keySize + stub(i).valueSize);
         for (uint16_t j = i; 0 < j; j--) {
             stub(j) = stub(j - 1);
         }
         header().stubBgnOff += sizeof(struct stub);
     }
+    struct freeBlock &freeBlockAt(uint16_t off) {
+        return *reinterpret_cast<struct freeBlock *>(page_ + off);
+    }
+    const struct freeBlock &freeBlockAt(uint16_t off) const {
+        return *reinterpret_cast<const struct freeBlock *>(page_ + off);
+    }
+    /**
+     * First fit.
+     * @prevOff the previous free block is set if not nullptr. 0 for the head.
+     * RETURN:
+     *   offset of the free block that can hold the size. 0 for none.
+     */
+    uint16_t findFreeBlock(uint16_t size, uint16_t *prevOff = nullptr) const {
+        uint16_t prev = 0;
+        for (uint16_t off = header().freeHead; off != 0; off = freeBlockAt(off).next) {
+            if (size <= freeBlockAt(off).size) {
+                if (prevOff) *prevOff = prev;
+                return off;
+            }
+            prev = off;
+        }
+        return 0;
+    }
+    /**
+     * Allocate a record area from the free space or a free block.
+     * The rest of a free block too small for another block is lost until gc().
+     */
+    uint16_t allocRecord(uint16_t size) {
+        if (size + sizeof(struct stub) <= freeSpace()) {
+            const uint16_t off = recEndOff();
+            header().recEndOff += size;
+            return off;
+        }
+        uint16_t prev = 0;
+        const uint16_t off = findFreeBlock(size, &prev);
+        assert(off != 0);
+        struct freeBlock &block = freeBlockAt(off);
+        if (size + sizeof(struct freeBlock) <= block.size) {
+            /* Take the tail of the block. */
+            block.size -= size;
+            return off + block.size;
+        }
+        if (prev == 0) {
+            header().freeHead = block.next;
+        } else {
+            freeBlockAt(prev).next = block.next;
+        }
+        return off;
+    }
+    /**
+     * The record area at the end is returned to the free space.
+     */
+    void freeRecord(uint16_t off, uint16_t size) {
+        if (off + size == recEndOff()) {
+            header().recEndOff = off;
+            return;
+        }
+        if (size < sizeof(struct freeBlock)) return;
+        struct freeBlock &block = freeBlockAt(off);
+        block.size = size;
+        block.next = header().freeHead;
+        header().freeHead = off;
+    }
     template <typename Key>
     const Key &key(size_t i) const {
         assert(sizeof(Key) == keySize(i));
@@ -954,11 +1359,17 @@ public:
  *
  * Key: key type. copyable.
  * Value: value type. copyable.
+ * Agg: aggregation policy. See NoAggregate.
  */
 template <typename Key, typename T,
-          class CompareT = std::less<Key> >
+          class CompareT = std::less<Key>, class Agg = NoAggregate>
 class BtreeMap
 {
+public:
+    using AggValue = typename Agg::Value;
+private:
+    static constexpr bool isAggEnabled = !std::is_same<Agg, NoAggregate>::value;
+
 private:
     struct Compare
     {
@@ -973,13 +1384,71 @@ private:
             return 1;
         }
     };
-    using Page = PageX<Compare>;
+    /**
+     * Equivalence by CompareT. Key may not have operator==.
+     */
+    static bool isEqual(const Key &a, const Key &b) {
+        return !CompareT()(a, b) && !CompareT()(b, a);
+    }
+    using Page = PageX<Compare, AggValue>;
     Page root_;
 
+    /**
+     * Counters of a map. The gauges are derived from them,
+     * so reading them does not touch the map.
+     */
+    struct Stats
+    {
+        stats::Counter nInsert;
+        stats::Counter nErase;
+        stats::Counter nSplit;
+        stats::Counter nMerge;
+        stats::Counter nPageAdd;
+        stats::Counter nPageRemove;
+        stats::Counter nRootGrow;
+        stats::Counter nLiftUp;
+        stats::Collector collector;
+
+        explicit Stats(const std::string &name) : collector([this, name](std::vector<stats::Sample> &v) {
+                collect(v, name);
+            }) {
+        }
+        uint64_t numRecords() const { return nInsert.value() - nErase.value(); }
+        uint64_t numPages() const { return 1 + nPageAdd.value() - nPageRemove.value(); }
+        uint64_t height() const { return 1 + nRootGrow.value() - nLiftUp.value(); }
+        void collect(std::vector<stats::Sample> &v, const std::string &name) const {
+            using stats::Type;
+            const stats::Labels labels{{"map", name}};
+            const uint64_t nRecords = numRecords();
+            const uint64_t nPages = numPages();
+            const double recSize = sizeof(Key) + sizeof(T) + sizeof(struct stub);
+            stats::addSample(v, "cybozu_btree_insert_total", "Inserted records."
+                             , Type::COUNTER, labels, nInsert.value());
+            stats::addSample(v, "cybozu_btree_erase_total", "Erased records."
+                             , Type::COUNTER, labels, nErase.value());
+            stats::addSample(v, "cybozu_btree_split_total", "Page splits."
+                             , Type::COUNTER, labels, nSplit.value());
+            stats::addSample(v, "cybozu_btree_merge_total", "Page merges."
+                             , Type::COUNTER, labels, nMerge.value());
+            stats::addSample(v, "cybozu_btree_records", "Records in the map."
+                             , Type::GAUGE, labels, nRecords);
+            stats::addSample(v, "cybozu_btree_pages", "Pages of the map."
+                             , Type::GAUGE, labels, nPages);
+            stats::addSample(v, "cybozu_btree_height", "Height of the tree."
+                             , Type::GAUGE, labels, height());
+            stats::addSample(v, "cybozu_btree_fill_ratio", "Estimated fill ratio of the pages."
+                             , Type::GAUGE, labels
+                             , nRecords * recSize / (nPages * double(PAGE_SIZE - sizeof(struct header))));
+        }
+    };
+    std::unique_ptr<Stats> stats_; /* nullptr if not registered. */
+    bool isTopDown_;
+
 public:
-    BtreeMap() {
+    BtreeMap() : isTopDown_(false) {
         root_.header().level = 0;
-        root_.header().parent = nullptr;
+        root_.setParent(nullptr);
+        root_.agg() = Agg::identity();
     }
     ~BtreeMap() noexcept {
         try {
@@ -987,29 +1456,79 @@ public:
         } catch (...) {
         }
     }
+    BtreeMap(const BtreeMap &) = delete;
+    BtreeMap &operator=(const BtreeMap &) = delete;
+    BtreeMap(BtreeMap &&rhs) : BtreeMap() {
+        swap(rhs);
+    }
+    BtreeMap &operator=(BtreeMap &&rhs) {
+        BtreeMap tmp(std::move(rhs));
+        swap(tmp);
+        return *this;
+    }
     bool insert(const Key &key, const T &value, BtreeError *err = nullptr) {
+        CYBOZU_BTREE_PROF_OP(INSERT);
         size_t size = sizeof(key) + sizeof(value);
         assert(size < (2 << 16));
 
         /* Get the corresponding leaf page. */
-        Page *p = searchLeaf(key);
+        Page *p = isTopDown_ ? searchLeafSplitting(key) : searchLeaf(key);
         assert(p->isLeaf());
 
         if (!p->canInsert(size) && p->shouldGc()) p->gc();
         if (!p->canInsert(size)) p = splitLeaf(p, key);
 
         assert(p->canInsert(size));
-        return p->template insert<Key, T>(key, value, err);
+        CYBOZU_BTREE_HEAT_DO(if (sampleHeat()) p->heat().nWrite++);
+        bool ret = p->template insert<Key, T>(key, value, err);
+        if (ret && stats_) stats_->nInsert.add();
+        if (ret && isAggEnabled) updateAggPath(p);
+        return ret;
+    }
+    /**
+     * Export counters of the map to the stats registry
+     * with a label map="name". It is costless if not registered.
+     */
+    void registerStats(const std::string &name) {
+        stats_.reset();
+        stats_.reset(new Stats(name));
+        stats_->nInsert.add(size());
+        stats_->nRootGrow.add(root_.level());
+        stats_->nPageAdd.add(countPages(&root_) - 1);
+    }
+    void unregisterStats() {
+        stats_.reset();
+    }
+    /**
+     * Top-down mode.
+     * insert() splits full branch pages and erase() merges sparse pages
+     * on the way down, so that a structural change never goes up
+     * beyond the parent of the page. The pages touched by an operation are
+     * the path and the siblings of the pages on it.
+     * ItemIterator::erase() erases by the key and searches the next item again.
+     * The mode can be switched at any time.
+     */
+    void setTopDown(bool isTopDown) { isTopDown_ = isTopDown; }
+    bool isTopDown() const { return isTopDown_; }
+    /**
+     * The root is level 0 if the map has only one page.
+     */
+    size_t height() const {
+        return root_.level() + 1;
     }
     /**
      * Delete all records by more efficient way.
      */
     void clear() {
+        if (stats_) {
+            stats_->nErase.add(size());
+            stats_->nLiftUp.add(root_.level());
+        }
         if (!root_.isLeaf()) {
             /* Delete all pages recursively. */
             typename Page::Iterator it = root_.begin();
             while (it != root_.end()) {
-                Page *child = it.template value<Page *>();
+                Page *child = it.childPage();
                 deleteRecursive(child);
                 it.erase();
             }
@@ -1017,7 +1536,8 @@ public:
         /* Clear the root page and set as a leaf page. */
         root_.clear();
         root_.header().level = 0;
-        root_.header().parent = nullptr;
+        root_.setParent(nullptr);
+        root_.agg() = Agg::identity();
     }
     void print() const {
         ::printf("---BEGIN-----------------\n");
@@ -1029,11 +1549,11 @@ public:
             p->template print<Key, T>();
             return;
         }
-        p->template print<Key, Page *>();
+        p->template print<Key, PageRef>();
 
         typename Page::ConstIterator it = p->template cBegin();
         while (it != p->cEnd()) {
-            const Page *child = it.template value<Page *>();
+            const Page *child = it.childPage();
             printRecursive(child);
             ++it;
         }
@@ -1045,7 +1565,7 @@ public:
     class PageIterator
     {
     protected:
-        using MapT = BtreeMap<Key, T, CompareT>;
+        using MapT = BtreeMap<Key, T, CompareT, Agg>;
         using It = PageIterator;
         MapT *mapP_;
         Page *pageP_; /* Nullptr indicates the end. */
@@ -1110,7 +1630,7 @@ public:
     class ConstPageIterator : public PageIterator
     {
     private:
-        using MapT = BtreeMap<Key, T, CompareT>;
+        using MapT = BtreeMap<Key, T, CompareT, Agg>;
         using It = ConstPageIterator;
     public:
         ConstPageIterator(const MapT *mapP, const Page *pageP)
@@ -1137,7 +1657,7 @@ public:
     class ItemIterator
     {
     protected:
-        using MapT = BtreeMap<Key, T, CompareT>;
+        using MapT = BtreeMap<Key, T, CompareT, Agg>;
         using PageIt = MapT::PageIterator;
         using ItInPage = typename Page::Iterator;
         using It = ItemIterator;
@@ -1222,9 +1742,17 @@ public:
          * The iterator will indicate the next item.
          */
         void erase() {
+            CYBOZU_BTREE_PROF_OP(ERASE);
             assert(!isEnd());
             Key lastKey = it_.template key<Key>();
+            if (mapP_->isTopDown_) {
+                mapP_->eraseTopDown(lastKey);
+                *this = mapP_->lowerBound(lastKey);
+                return;
+            }
             Page *page = it_.page();
+            if (mapP_->stats_) mapP_->stats_->nErase.add();
+            CYBOZU_BTREE_HEAT_DO(if (sampleHeat()) page->heat().nWrite++);
 
             if (it_.page()->numRecords() == 1) {
                 typename Page::Iterator it = it_;
@@ -1246,6 +1774,7 @@ public:
             it_ = mapP_->tryMerge(it_);
             if (isEnd) assert(it_.isEnd());
             else assert(key == it_.template key<Key>());
+            if (isAggEnabled) mapP_->updateAggPath(page);
             mapP_->liftUp();
         }
         const Key &key() const {
@@ -1289,19 +1818,24 @@ public:
         return ItemIterator(this, pit, typename Page::Iterator(nullptr, 0));
     }
     ItemIterator lowerBound(const Key &key) {
+        CYBOZU_BTREE_PROF_OP(LOWER_BOUND);
         Page *page = searchLeaf(key);
         assert(page);
         typename Page::Iterator it = page->lowerBound(key);
         if (it.isEnd()) {
             /* The record is the first one of the next page
                if the next page exists. */
-            page = nextPage(page);
+            {
+                CYBOZU_BTREE_PROF_PHASE(DESCENT);
+                page = nextPage(page);
+            }
             if (page) {
                 it = page->lowerBound(key);
             } else {
                 /* Not found */
             }
         }
+        CYBOZU_BTREE_HEAT_DO(if (page && sampleHeat()) page->heat().nRead++);
         PageIterator pit(this, page);
         if (it.isEnd()) {
             return ItemIterator(this, endPage(), it);
@@ -1320,12 +1854,105 @@ public:
      * Delete a record.
      */
     bool erase(const Key &key) {
+        CYBOZU_BTREE_PROF_OP(ERASE);
+        if (isTopDown_) return eraseTopDown(key);
         ItemIterator it = lowerBound(key);
         if (it.isEnd()) return false;
         if (it.key() != key) return false;
         it.erase();
         return true;
     }
+    /**
+     * An operation of applyBatch().
+     */
+    struct BatchOp
+    {
+        enum Type : uint8_t
+        {
+            INSERT, /* insert if the key does not exist. */
+            UPSERT, /* insert or update. */
+            ERASE, /* the value is not used. */
+        };
+        Type type;
+        Key key;
+        T value;
+    };
+    /**
+     * Apply operations in the key order.
+     * The operations are stable-sorted in place, so the ones with the same key
+     * are applied in the given order. A run of operations in the same leaf
+     * shares one descent, and the leaf is merged and its ancestors are updated
+     * once at the end of the run. Only an insertion into a full leaf
+     * takes the usual path with a split.
+     * RETURN:
+     *   number of operations that changed the map.
+     */
+    size_t applyBatch(std::vector<BatchOp> &ops) {
+        std::stable_sort(ops.begin(), ops.end(), [](const BatchOp &a, const BatchOp &b) {
+                return CompareT()(a.key, b.key);
+            });
+        size_t nChanged = 0;
+        Page *leaf = nullptr;
+        bool isModified = false, isErased = false, isMinErased = false;
+        Key erasedKey = Key();
+        auto finishLeaf = [&]() {
+            if (leaf && isModified) finishBatchLeaf(leaf, isErased, isMinErased, erasedKey);
+            leaf = nullptr;
+            isModified = isErased = isMinErased = false;
+        };
+        for (const BatchOp &op : ops) {
+            if (leaf && (leaf->empty() || leaf->isUpper(op.key))) finishLeaf();
+            if (!leaf) leaf = searchLeaf(op.key);
+            if (op.type == BatchOp::ERASE) {
+                typename Page::Iterator it = leaf->lowerBound(op.key);
+                if (it.isEnd() || !isEqual(it.template key<Key>(), op.key)) continue;
+                if (it.isBegin()) isMinErased = true;
+                it.erase();
+                erasedKey = op.key;
+                isModified = isErased = true;
+                if (stats_) stats_->nErase.add();
+                nChanged++;
+                continue;
+            }
+            if (op.type == BatchOp::UPSERT && leaf->update(op.key, op.value)) {
+                isModified = true;
+                nChanged++;
+                continue;
+            }
+            BtreeError err;
+            if (leaf->insert(op.key, op.value, &err)) {
+                isModified = true;
+                if (stats_) stats_->nInsert.add();
+                nChanged++;
+                continue;
+            }
+            if (err == BtreeError::KEY_EXISTS) continue;
+            /* The leaf is full. */
+            finishLeaf();
+            UNUSED bool ret = insert(op.key, op.value);
+            assert(ret);
+            nChanged++;
+        }
+        finishLeaf();
+        return nChanged;
+    }
+    /**
+     * Aggregate of the records whose keys are in [lo, hi).
+     * Whole subtrees in the range are not visited,
+     * so this is O(fanout * height).
+     */
+    AggValue aggregate(const Key &lo, const Key &hi) const {
+        static_assert(isAggEnabled, "aggregate() requires an aggregation policy.");
+        if (!CompareT()(lo, hi)) return Agg::identity();
+        return aggregateRange(&root_, lo, hi, true, true);
+    }
+    /**
+     * Aggregate of all the records.
+     */
+    const AggValue &aggregate() const {
+        static_assert(isAggEnabled, "aggregate() requires an aggregation policy.");
+        return root_.agg();
+    }
     bool isValid() const {
         return isValid(&root_);
     }
@@ -1340,7 +1967,7 @@ public:
         uint16_t level = p->level();
         typename Page::ConstIterator it = p->begin();
         while (it != p->end()) {
-            const Page *child = it.template value<const Page *>();
+            const Page *child = it.childPage();
             assert(child);
             if (!(child->level() + 1 == level)) {
                 ::printf("error: child level is not valid.\n");
@@ -1378,7 +2005,670 @@ public:
         }
         return total;
     }
+    /**
+     * Print access heat of leaf pages (requires CYBOZU_BTREE_HEAT).
+     * Counts are estimated from the samples.
+     *
+     * @topN number of the hottest pages to list with their key ranges.
+     * @nBuckets the leaves are divided into the buckets in the key order.
+     *   Each bucket has the same number of leaves.
+     */
+    void printHeat(UNUSED size_t topN = 10, UNUSED size_t nBuckets = 16) const {
+#ifdef CYBOZU_BTREE_HEAT
+        struct Leaf
+        {
+            const Page *page;
+            PageHeat heat;
+        };
+        std::vector<Leaf> v;
+        uint64_t total = 0;
+        ConstPageIterator it = beginPage();
+        while (it != endPage()) {
+            const Page *p = it.page();
+            if (!p->empty()) {
+                v.push_back(Leaf{p, p->heat()});
+                total += p->heat().nAccess();
+            }
+            ++it;
+        }
+        if (v.empty()) return;
+        const uint64_t scale = CYBOZU_BTREE_HEAT_SAMPLE;
+        auto range = [](const Page *first, const Page *last) {
+            std::stringstream ss;
+            ss << "[" << first->template minKey<Key>()
+               << ", " << last->template maxKey<Key>() << "]";
+            return ss.str();
+        };
+        auto share = [&](uint64_t n) {
+            return total == 0 ? 0.0 : n * 100.0 / total;
+        };
+
+        ::printf("heat: %zu leaves  %" PRIu64 " accesses (estimated)\n", v.size(), total * scale);
+        std::vector<Leaf> hot(v);
+        topN = std::min(topN, hot.size());
+        std::partial_sort(
+            hot.begin(), hot.begin() + topN, hot.end(),
+            [](const Leaf &a, const Leaf &b) { return a.heat.nAccess() > b.heat.nAccess(); });
+        for (size_t i = 0; i < topN; i++) {
+            const Leaf &l = hot[i];
+            ::printf("  top%-3zu %-32s %10" PRIu64 " reads %10" PRIu64 " writes %4u splits %4zu records %6.2f%%\n"
+                     , i, range(l.page, l.page).c_str()
+                     , l.heat.nRead * scale, l.heat.nWrite * scale
+                     , l.heat.nSplit, l.page->numRecords(), share(l.heat.nAccess()));
+        }
+
+        nBuckets = std::min(nBuckets, v.size());
+        for (size_t i = 0; i < nBuckets; i++) {
+            size_t bgn = v.size() * i / nBuckets;
+            size_t end = v.size() * (i + 1) / nBuckets;
+            uint64_t n = 0;
+            for (size_t j = bgn; j < end; j++) n += v[j].heat.nAccess();
+            double pct = share(n);
+            ::printf("  bucket%-3zu %-32s %6.2f%% ", i, range(v[bgn].page, v[end - 1].page).c_str(), pct);
+            for (size_t j = 0; j < size_t(pct / 2 + 0.5); j++) ::putchar('#');
+            ::putchar('\n');
+        }
+#endif
+    }
+    /**
+     * Clear the heat counters of all leaf pages.
+     */
+    void resetHeat() {
+#ifdef CYBOZU_BTREE_HEAT
+        PageIterator it = beginPage();
+        while (it != endPage()) {
+            it.page()->heat() = PageHeat();
+            ++it;
+        }
+#endif
+    }
+
+    /**
+     * Bottom-up bulk loader.
+     * Records must be appended in strictly increasing key order.
+     * Leaves and branches are filled to the full
+     * and the tree is attached to the map by finish().
+     */
+    class Builder
+    {
+    private:
+        using MapT = BtreeMap<Key, T, CompareT, Agg>;
+        MapT &map_;
+        std::vector<Page *> path_; /* the right-most page of each level. */
+        size_t nRecords_;
+        size_t nPages_;
+        Key lastKey_;
+
+    public:
+        /**
+         * @map must be empty.
+         */
+        explicit Builder(MapT &map) : map_(map), nRecords_(0), nPages_(0), lastKey_() {
+            if (!map.empty()) throw std::runtime_error("Builder: the map is not empty.");
+        }
+        ~Builder() noexcept {
+            /* Pages of an unfinished build. */
+            if (!path_.empty()) freeRecursive(path_.back());
+        }
+        Builder(const Builder &) = delete;
+        Builder &operator=(const Builder &) = delete;
+
+        void append(const Key &key, const T &value) {
+            if (nRecords_ != 0 && !CompareT()(lastKey_, key)) {
+                throw std::runtime_error("Builder: keys are not in increasing order.");
+            }
+            if (path_.empty()) path_.push_back(newPage(0));
+            if (!path_[0]->canInsert(sizeof(Key) + sizeof(T))) {
+                addChild(1, key, newPage(0));
+            }
+            UNUSED bool ret = path_[0]->append(key, value);
+            assert(ret);
+            lastKey_ = key;
+            nRecords_++;
+        }
+        /**
+         * Attach the built tree to the map.
+         */
+        void finish() {
+            if (path_.empty()) return;
+            Page *top = path_.back();
+            for (Page *p : path_) updateAgg(p); /* the right-most pages are not closed yet. */
+            path_.clear();
+            Page &root = map_.root_;
+            root.swap(*top);
+            CYBOZU_BTREE_HEAT_DO(std::swap(root.heat(), top->heat()));
+            std::swap(root.agg(), top->agg());
+            root.setParent(nullptr);
+            map_.setParentOfChildren(&root);
+            delete top;
+            if (map_.stats_) {
+                map_.stats_->nInsert.add(nRecords_);
+                map_.stats_->nPageAdd.add(nPages_ - 1);
+                map_.stats_->nRootGrow.add(root.level());
+            }
+        }
+    private:
+        static void freeRecursive(Page *page) {
+            if (!page->isLeaf()) {
+                typename Page::Iterator it = page->begin();
+                for (; it != page->end(); ++it) freeRecursive(it.childPage());
+            }
+            delete page;
+        }
+        Page *newPage(uint16_t level) {
+            Page *p = new Page();
+            p->header().level = level;
+            p->setParent(nullptr);
+            nPages_++;
+            return p;
+        }
+        /**
+         * Add a new right-most page to the level - 1.
+         * @key the first key that will be stored in the child.
+         */
+        void addChild(size_t level, const Key &key, Page *child) {
+            const uint16_t recSize = sizeof(Key) + sizeof(PageRef);
+            /* Close the page first, because the parent may be closed below. */
+            updateAgg(path_[level - 1]);
+            if (path_.size() == level) {
+                /* The tree grows. */
+                Page *first = path_[level - 1];
+                path_.push_back(newPage(level));
+                UNUSED bool ret = path_[level]->appendChild(first->template minKey<Key>(), first);
+                assert(ret);
+                first->setParent(path_[level]);
+            }
+            if (!path_[level]->canInsert(recSize)) {
+                addChild(level + 1, key, newPage(level));
+            }
+            Page *parent = path_[level];
+            UNUSED bool ret = parent->appendChild(key, child);
+            assert(ret);
+            child->setParent(parent);
+            path_[level - 1] = child;
+        }
+    };
+
+    /**
+     * Swap the contents of two maps.
+     * Stats registrations are swapped too, so they follow the contents.
+     */
+    void swap(BtreeMap &rhs) {
+        swapTree(rhs);
+        std::swap(stats_, rhs.stats_);
+    }
+    /**
+     * Union.
+     * The value of rhs is taken for a key in both maps.
+     */
+    void merge(const BtreeMap &rhs) {
+        if (&rhs == this || rhs.empty()) return;
+        const size_t n = size(), m = rhs.size();
+        if (m * SET_OP_IN_PLACE_RATIO <= n) {
+            mergeInPlace(rhs);
+            return;
+        }
+        rebuild([&](Builder &builder) {
+                Cursor c0(*this), c1(rhs);
+                while (!c0.isEnd() && !c1.isEnd()) {
+                    if (CompareT()(c0.key(), c1.key())) {
+                        builder.append(c0.key(), c0.value());
+                        c0.next();
+                    } else {
+                        if (!CompareT()(c1.key(), c0.key())) c0.next();
+                        builder.append(c1.key(), c1.value());
+                        c1.next();
+                    }
+                }
+                for (; !c0.isEnd(); c0.next()) builder.append(c0.key(), c0.value());
+                for (; !c1.isEnd(); c1.next()) builder.append(c1.key(), c1.value());
+            });
+    }
+    /**
+     * Intersection.
+     * Records whose keys are not in rhs are removed.
+     */
+    void intersect(const BtreeMap &rhs) {
+        if (&rhs == this) return;
+        if (empty()) return;
+        if (rhs.empty()) {
+            clear();
+            return;
+        }
+        const bool isRhsSmaller = rhs.size() < size();
+        rebuild([&](Builder &builder) {
+                /* Walk the smaller one and seek in the other one. */
+                Cursor c0(*this), c1(rhs);
+                Cursor &walker = isRhsSmaller ? c1 : c0;
+                Cursor &seeker = isRhsSmaller ? c0 : c1;
+                for (; !walker.isEnd(); walker.next()) {
+                    seeker.seek(walker.key());
+                    if (seeker.isEnd()) break;
+                    if (CompareT()(walker.key(), seeker.key())) continue;
+                    builder.append(c0.key(), c0.value());
+                }
+            });
+    }
+    /**
+     * Difference.
+     * Records whose keys are in rhs are removed.
+     */
+    void subtract(const BtreeMap &rhs) {
+        if (&rhs == this) {
+            clear();
+            return;
+        }
+        if (empty() || rhs.empty()) return;
+        const size_t n = size(), m = rhs.size();
+        if (m * SET_OP_IN_PLACE_RATIO <= n) {
+            subtractInPlace(rhs);
+            return;
+        }
+        rebuild([&](Builder &builder) {
+                Cursor c0(*this), c1(rhs);
+                for (; !c0.isEnd(); c0.next()) {
+                    if (!c1.isEnd()) c1.seek(c0.key());
+                    if (c1.isEnd() || CompareT()(c0.key(), c1.key())) {
+                        builder.append(c0.key(), c0.value());
+                    }
+                }
+            });
+    }
+    /**
+     * Move the records whose keys are not less than the key to a new map.
+     * Only the pages on the path to the key are rewritten.
+     * With registered stats, the records are counted (linear in the leaves).
+     */
+    BtreeMap splitAt(const Key &key) {
+        BtreeMap out;
+        if (empty()) return out;
+        StatsSnapshot s0;
+        if (stats_) s0 = snapshotStats();
+        std::unique_ptr<Stats> stats = std::move(stats_);
+
+        /* Cut the pages on the path bottom up.
+           left is the page on the path, and right has the records moved from it. */
+        Page *left = searchLeaf(key);
+        Page *right = new Page();
+        right->header().level = 0;
+        left->moveTail(left->lowerBound(key).idx(), *right);
+        while (!left->isRoot()) {
+            Page *parent = left->parent();
+            typename Page::Iterator it = parent->search(key);
+            assert(it.childPage() == left);
+            Page *rightParent = new Page();
+            rightParent->header().level = parent->level();
+            if (right->empty()) {
+                delete right;
+            } else {
+                UNUSED bool ret = rightParent->appendChild(right->template minKey<Key>(), right);
+                assert(ret);
+            }
+            parent->moveTail(it.idx() + 1, *rightParent);
+            setParentOfChildren(rightParent);
+            if (left->empty()) {
+                it.erase();
+                delete left;
+            }
+            left = parent;
+            right = rightParent;
+        }
+        assert(left == &root_);
+        if (root_.empty()) {
+            root_.clear();
+            root_.header().level = 0;
+        }
+        if (isAggEnabled) updateAggPath(rightMostPage());
+        rebalanceSpine(true);
+
+        if (right->empty()) {
+            delete right;
+        } else {
+            out.root_.swap(*right);
+            out.root_.setParent(nullptr);
+            out.setParentOfChildren(&out.root_);
+            delete right;
+            if (isAggEnabled) out.updateAggPath(out.leftMostPage());
+            out.rebalanceSpine(false);
+        }
+        stats_ = std::move(stats);
+        if (stats_) updateStats(s0);
+        return out;
+    }
+    /**
+     * Append all the records of rhs.
+     * The keys of rhs must be larger than all keys of the map.
+     * The lower tree is grafted on the spine of the higher one,
+     * so only the pages on the spine are rewritten. rhs will be empty.
+     * With registered stats, the records are counted (linear in the leaves).
+     */
+    void concat(BtreeMap &&rhs) {
+        if (&rhs == this) throw std::runtime_error("concat: the same map.");
+        if (rhs.empty()) return;
+        if (!empty() && !CompareT()(rightMostPage()->template maxKey<Key>(),
+                                    rhs.leftMostPage()->template minKey<Key>())) {
+            throw std::runtime_error("concat: keys are not in order.");
+        }
+        StatsSnapshot s0, s1;
+        if (stats_) s0 = snapshotStats();
+        if (rhs.stats_) s1 = rhs.snapshotStats();
+        std::unique_ptr<Stats> stats0 = std::move(stats_), stats1 = std::move(rhs.stats_);
+
+        if (empty()) {
+            swapTree(rhs);
+        } else if (rhs.height() <= height()) {
+            graft(rhs, true);
+        } else {
+            rhs.graft(*this, false);
+            swapTree(rhs);
+        }
+        stats_ = std::move(stats0);
+        rhs.stats_ = std::move(stats1);
+        if (stats_) updateStats(s0);
+        if (rhs.stats_) rhs.updateStats(s1);
+    }
 private:
+    /**
+     * Set operations modify the map in place
+     * if rhs is smaller than this by the ratio.
+     * Otherwise they stream both maps into a new tree.
+     */
+    static constexpr size_t SET_OP_IN_PLACE_RATIO = 16;
+
+    /**
+     * Read-only position in the leaves for set operations.
+     */
+    class Cursor
+    {
+    private:
+        const BtreeMap &map_;
+        const Page *page_; /* nullptr indicates the end. */
+        uint16_t idx_;
+    public:
+        explicit Cursor(const BtreeMap &map)
+            : map_(map), page_(map.leftMostPage()), idx_(0) {
+            if (page_->empty()) page_ = nullptr;
+        }
+        bool isEnd() const { return page_ == nullptr; }
+        const Key &key() const { return keyAt(idx_); }
+        const T &value() const {
+            return typename Page::ConstIterator(page_, idx_).template value<T>();
+        }
+        void next() {
+            assert(!isEnd());
+            if (++idx_ == page_->numRecords()) nextPage();
+        }
+        /**
+         * Move to the first record whose key is not less than the key.
+         * Leaves are skipped by their maximum keys,
+         * then the position in a leaf gallops from the current one.
+         */
+        void seek(const Key &key) {
+            assert(!isEnd());
+            if (!CompareT()(keyAt(idx_), key)) return;
+            while (CompareT()(page_->template maxKey<Key>(), key)) {
+                nextPage();
+                if (isEnd()) return;
+            }
+            if (!CompareT()(keyAt(idx_), key)) return;
+            /* keyAt(lo) < key <= keyAt(hi). */
+            const uint16_t n = page_->numRecords();
+            uint16_t lo = idx_, step = 1;
+            while (lo + step < n - 1 && CompareT()(keyAt(lo + step), key)) {
+                lo += step;
+                step *= 2;
+            }
+            uint16_t hi = std::min<uint16_t>(lo + step, n - 1);
+            while (lo + 1 < hi) {
+                uint16_t mid = (lo + hi) / 2;
+                if (CompareT()(keyAt(mid), key)) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+            idx_ = hi;
+        }
+    private:
+        const Key &keyAt(uint16_t i) const {
+            return typename Page::ConstIterator(page_, i).template key<Key>();
+        }
+        void nextPage() {
+            page_ = map_.nextPage(page_);
+            idx_ = 0;
+        }
+    };
+
+    /**
+     * Replace the tree with the one made by build(builder).
+     */
+    template <typename Build>
+    void rebuild(Build build) {
+        BtreeMap out;
+        Builder builder(out);
+        build(builder);
+        builder.finish();
+        if (stats_) {
+            stats_->nErase.add(size());
+            stats_->nPageRemove.add(countPages(&root_) - 1);
+            stats_->nLiftUp.add(root_.level());
+        }
+        swapTree(out);
+        if (stats_) {
+            stats_->nInsert.add(size());
+            stats_->nPageAdd.add(countPages(&root_) - 1);
+            stats_->nRootGrow.add(root_.level());
+        }
+    }
+    /**
+     * Insert or update the records of a small rhs.
+     * The leaf of the previous key is reused while the key is in it.
+     */
+    void mergeInPlace(const BtreeMap &rhs) {
+        Page *leaf = nullptr;
+        for (Cursor c(rhs); !c.isEnd(); c.next()) {
+            const Key &key = c.key();
+            if (!leaf || leaf->empty() || leaf->isUpper(key)) leaf = searchLeaf(key);
+            if (leaf->update(key, c.value())) {
+                if (isAggEnabled) updateAggPath(leaf);
+                continue;
+            }
+            if (leaf->canInsert(sizeof(Key) + sizeof(T))) {
+                UNUSED bool ret = leaf->insert(key, c.value());
+                assert(ret);
+                if (stats_) stats_->nInsert.add();
+                if (isAggEnabled) updateAggPath(leaf);
+                continue;
+            }
+            insert(key, c.value());
+            leaf = nullptr; /* the leaf may be split. */
+        }
+    }
+    /**
+     * Erase the keys of a small rhs.
+     * Only existing keys cause a descent after the first one.
+     */
+    void subtractInPlace(const BtreeMap &rhs) {
+        Page *leaf = nullptr;
+        for (Cursor c(rhs); !c.isEnd(); c.next()) {
+            const Key &key = c.key();
+            if (empty()) return;
+            if (!leaf || leaf->isUpper(key)) leaf = searchLeaf(key);
+            typename Page::Iterator it = leaf->lowerBound(key);
+            if (it.isEnd() || !isEqual(it.template key<Key>(), key)) continue;
+            ItemIterator(this, PageIterator(this, leaf), it).erase();
+            leaf = nullptr; /* pages may be merged or deleted. */
+        }
+    }
+    /**
+     * Do the deferred work of a leaf changed by applyBatch().
+     * @erasedKey one of the erased keys, which locates the leaf in its parent.
+     */
+    void finishBatchLeaf(Page *leaf, bool isErased, bool isMinErased, const Key &erasedKey) {
+        if (leaf->empty()) {
+            deleteEmptyPage(leaf, erasedKey);
+            liftUp();
+            return;
+        }
+        if (isMinErased) updateMinKey(leaf);
+        if (isErased) tryMerge(leaf->begin());
+        if (isAggEnabled) updateAggPath(leaf);
+        if (isErased) liftUp();
+    }
+    /**
+     * Swap the trees. The stats are not swapped.
+     */
+    void swapTree(BtreeMap &rhs) {
+        root_.swap(rhs.root_);
+        CYBOZU_BTREE_HEAT_DO(std::swap(root_.heat(), rhs.root_.heat()));
+        std::swap(root_.agg(), rhs.root_.agg());
+        setParentOfChildren(&root_);
+        rhs.setParentOfChildren(&rhs.root_);
+    }
+    void setParentOfChildren(Page *page) {
+        if (page->isLeaf()) return;
+        typename Page::Iterator it = page->begin();
+        while (it != page->end()) {
+            it.childPage()->setParent(page);
+            ++it;
+        }
+    }
+    /**
+     * Move the tree to a new page and make the map empty.
+     * RETURN:
+     *   the page that has the old root contents.
+     */
+    Page *detachRoot() {
+        Page *p = new Page();
+        p->swap(root_);
+        CYBOZU_BTREE_HEAT_DO(std::swap(p->heat(), root_.heat()));
+        std::swap(p->agg(), root_.agg());
+        p->setParent(nullptr);
+        setParentOfChildren(p);
+        root_.clear();
+        root_.header().level = 0;
+        root_.agg() = Agg::identity();
+        return p;
+    }
+    /**
+     * Attach the tree of rhs as the right-most (toRight) or left-most child
+     * of the spine page one level above its root. rhs will be empty.
+     * The map must not be lower than rhs and both must not be empty.
+     */
+    void graft(BtreeMap &rhs, bool toRight) {
+        assert(rhs.height() <= height());
+        assert(!empty() && !rhs.empty());
+        const Key seamKey = toRight ? rhs.leftMostPage()->template minKey<Key>()
+            : leftMostPage()->template minKey<Key>();
+        Page *t = rhs.detachRoot();
+        const uint16_t level = t->level();
+        const Key key = t->template minKey<Key>();
+        UNUSED bool ret;
+        if (level == root_.level() && root_.totalDataSize() + t->totalDataSize() <= root_.emptySize()) {
+            /* The roots are joined. */
+            if (root_.freeSpace() < t->totalDataSize()) root_.gc();
+            CYBOZU_BTREE_HEAT_DO(root_.heat().add(t->heat()));
+            ret = root_.merge(*t); assert(ret);
+            delete t;
+            setParentOfChildren(&root_);
+            joinSeam(&root_, seamKey);
+            updateAgg(&root_);
+            rebalanceSpine(toRight);
+            return;
+        }
+        if (level == root_.level()) {
+            /* The tree grows. */
+            Page *u = detachRoot();
+            Page *p0 = toRight ? u : t;
+            Page *p1 = toRight ? t : u;
+            root_.header().level = level + 1;
+            ret = root_.insertChild(p0->template minKey<Key>(), p0); assert(ret);
+            ret = root_.insertChild(p1->template minKey<Key>(), p1); assert(ret);
+            setParentOfChildren(&root_);
+            updateAgg(&root_);
+            return;
+        }
+        Page *p = &root_;
+        while (level + 1 < p->level()) {
+            p = toRight ? p->rightMostChild() : p->leftMostChild();
+        }
+        const uint16_t recSize = sizeof(Key) + sizeof(PageRef);
+        if (!p->canInsert(recSize)) p->gc();
+        if (!p->canInsert(recSize)) {
+            Page *p1;
+            std::tie(p, p1) = splitNonLeaf(p, key, key);
+        }
+        ret = p->insertChild(key, t); assert(ret);
+        t->setParent(p);
+        joinSeam(p, seamKey);
+        if (isAggEnabled) updateAggPath(p);
+        rebalanceSpine(toRight);
+    }
+    /**
+     * Merge the children on both sides of the seam key from the page down
+     * while they fit in one page, so that concat() joins the pages cut by splitAt().
+     * The aggregate of the page is not updated.
+     */
+    void joinSeam(Page *p, const Key &seamKey) {
+        while (!p->isLeaf()) {
+            typename Page::Iterator itL = p->search(seamKey);
+            if (itL.isBegin()) return;
+            --itL;
+            Page *left = itL.childPage();
+            Page *right = p->child(seamKey);
+            if (right->emptySize() < left->totalDataSize() + right->totalDataSize()) return;
+            mergeIntoRight(itL);
+            updateAgg(right);
+            p = right;
+        }
+    }
+    /**
+     * Merge or borrow along the right-most (toRight) or left-most path,
+     * whose pages may be sparse or have a single child after splitAt() or graft().
+     * Each pass goes down with prepareChildForErase(),
+     * and a merge may leave its parent with a single child, so it is repeated.
+     */
+    void rebalanceSpine(bool toRight) {
+        bool isMerged = true;
+        while (isMerged) {
+            isMerged = false;
+            liftUp();
+            Page *p = &root_;
+            while (!p->isLeaf()) {
+                const uint16_t n = p->numRecords();
+                typename Page::Iterator it(p, toRight ? n - 1 : 0);
+                Page *child = prepareChildForErase(it);
+                if (p->numRecords() < n) isMerged = true;
+                p = child;
+            }
+        }
+    }
+    /**
+     * Values the derived gauges depend on.
+     */
+    struct StatsSnapshot
+    {
+        size_t nRecords;
+        size_t nPages;
+        size_t height;
+    };
+    StatsSnapshot snapshotStats() const {
+        return StatsSnapshot{size(), countPages(&root_), height()};
+    }
+    /**
+     * Count the difference from a snapshot after a bulk change.
+     */
+    void updateStats(const StatsSnapshot &s0) {
+        assert(stats_);
+        const StatsSnapshot s1 = snapshotStats();
+        auto add = [](stats::Counter &inc, stats::Counter &dec, size_t v0, size_t v1) {
+            if (v0 < v1) inc.add(v1 - v0);
+            if (v1 < v0) dec.add(v0 - v1);
+        };
+        add(stats_->nInsert, stats_->nErase, s0.nRecords, s1.nRecords);
+        add(stats_->nPageAdd, stats_->nPageRemove, s0.nPages, s1.nPages);
+        add(stats_->nRootGrow, stats_->nLiftUp, s0.height, s1.height);
+    }
     /**
      * Split a leaf page.
      * If the ancestors has no space for index records,
@@ -1393,6 +2683,9 @@ private:
      */
     Page *splitLeaf(Page *page, const Key &key) {
         assert(page->isLeaf());
+        CYBOZU_TRACE_EVENT(SPLIT, page->level());
+        CYBOZU_BTREE_PROF_PHASE(SPLIT);
+        if (stats_) stats_->nSplit.add();
 #if 0
         ::printf("splitLeaf: %p (level %u)\n", page, page->level()); /* debug */
         page->print<Key, T>();
@@ -1406,6 +2699,12 @@ private:
         assert(!p1->empty());
         p0->header().level = 0;
         p1->header().level = 0;
+        updateAgg(p0);
+        updateAgg(p1);
+        CYBOZU_BTREE_HEAT_DO(
+            p0->heat() = page->heat().half();
+            p1->heat() = page->heat().half();
+            page->heat() = PageHeat());
         const Key &k0 = p0->template minKey<Key>();
         const Key &k1 = p1->template minKey<Key>();
 
@@ -1418,17 +2717,21 @@ private:
             assert(page == &root_);
             //::printf("page %p\n", page); /* debug */
             assert(page->empty());
-            ret = page->insert(k0, p0); assert(ret);
-            ret = page->insert(k1, p1); assert(ret);
-            p0->header().parent = page;
-            p1->header().parent = page;
+            ret = page->insertChild(k0, p0); assert(ret);
+            ret = page->insertChild(k1, p1); assert(ret);
+            p0->setParent(page);
+            p1->setParent(page);
             page->header().level = 1;
+            if (stats_) {
+                stats_->nRootGrow.add();
+                stats_->nPageAdd.add(2);
+            }
             //::printf("root level %u (splitLeaf)\n", page->level()); /* debug */
         } else {
             Page *parent0 = parent;
             Page *parent1 = parent;
-            const uint16_t recSize = sizeof(Key) + sizeof(Page *);
-            //parent->print<Key, Page *>(); /* debug */
+            const uint16_t recSize = sizeof(Key) + sizeof(PageRef);
+            //parent->print<Key, PageRef>(); /* debug */
             if (!parent->canInsert(recSize)) {
                 parent->gc();
             }
@@ -1438,21 +2741,21 @@ private:
             }
 #if 0
             ::printf("parents %p %p\n", parent0, parent1); /* debug */
-            parent0->print<Key, Page *>(); /* debug */
-            parent1->print<Key, Page *>(); /* debug */
+            parent0->print<Key, PageRef>(); /* debug */
+            parent1->print<Key, PageRef>(); /* debug */
 #endif
 
             typename Page::Iterator it = parent0->search(k0);
             assert(!it.isEnd());
-            assert(it.template value<Page *>() == page);
+            assert(it.childPage() == page);
             const Key &k2 = it.template key<Key>();
             if (k2 == k0) {
-                ret = parent0->update(k0, p0); assert(ret);
+                ret = parent0->updateChild(k0, p0); assert(ret);
             } else {
                 /* This is the case of left-most,
                    or the case left-most-key in the page are deleted. */
                 ret = parent0->erase(k2); assert(ret);
-                ret = parent0->insert(k0, p0); assert(ret);
+                ret = parent0->insertChild(k0, p0); assert(ret);
             }
             /* GC may be reuiqred when
                parent0 and parent1 is the same page.
@@ -1461,12 +2764,16 @@ private:
             if (!parent1->canInsert(recSize)) {
                 parent1->gc();
             }
-            ret = parent1->insert(k1, p1); assert(ret);
-            p0->header().parent = parent0;
-            p1->header().parent = parent1;
+            ret = parent1->insertChild(k1, p1); assert(ret);
+            p0->setParent(parent0);
+            p1->setParent(parent1);
             delete page;
+            if (stats_) stats_->nPageAdd.add();
         }
-        return (CompareT()(key, k1)) ? p0 : p1;
+        Page *target = CompareT()(key, k1) ? p0 : p1;
+        /* The caller updates the path of the target page. */
+        if (isAggEnabled) updateAggPath(target == p0 ? p1 : p0);
+        return target;
     }
     /**
      * Split a non-leaf page.
@@ -1480,6 +2787,9 @@ private:
     std::tuple<Page *, Page *> splitNonLeaf(Page *page, const Key &key0, const Key &key1) {
         assert(!page->isLeaf());
         uint16_t level = page->header().level;
+        CYBOZU_TRACE_EVENT(SPLIT, level);
+        CYBOZU_BTREE_PROF_PHASE(SPLIT);
+        if (stats_) stats_->nSplit.add();
 #if 0
         ::printf("%u splitNonLeaf %p\n", level, page); /* debug */
 #endif
@@ -1490,6 +2800,10 @@ private:
         assert(!p1->empty());
         p0->header().level = level;
         p1->header().level = level;
+        /* The page being split below, if any, still has the aggregate of both halves.
+           Its ancestors are fixed by the caller. */
+        updateAgg(p0);
+        updateAgg(p1);
         const Key &k0 = p0->template minKey<Key>();
         const Key &k1 = p1->template minKey<Key>();
 
@@ -1500,20 +2814,24 @@ private:
         if (!parent) {
             /* Root */
             assert(page->empty());
-            ret = page->insert(k0, p0); assert(ret);
-            ret = page->insert(k1, p1); assert(ret);
-            p0->header().parent = page;
-            p1->header().parent = page;
+            ret = page->insertChild(k0, p0); assert(ret);
+            ret = page->insertChild(k1, p1); assert(ret);
+            p0->setParent(page);
+            p1->setParent(page);
             page->header().level = level + 1;
+            if (stats_) {
+                stats_->nRootGrow.add();
+                stats_->nPageAdd.add(2);
+            }
             //::printf("root level %u (splitNonLeaf)\n", page->level()); /* debug */
-            page->header().parent = nullptr;
+            page->setParent(nullptr);
         } else {
             Page *parent0 = parent;
             Page *parent1 = parent;
-            if (!parent->canInsert(sizeof(Key) + sizeof(Page *))) {
+            if (!parent->canInsert(sizeof(Key) + sizeof(PageRef))) {
                 parent->gc();
             }
-            if (!parent->canInsert(sizeof(Key) + sizeof(Page *))) {
+            if (!parent->canInsert(sizeof(Key) + sizeof(PageRef))) {
                 std::tie(parent0, parent1) = splitNonLeaf(parent, k0, k1);
 #if 0
                 ::printf("%u splitNonLeaf Done parent0 %p parent1 %p\n", level, parent0, parent1); /* debug */
@@ -1522,45 +2840,46 @@ private:
 #if 0
             ::printf("%u try to update %p key %u %p\n", level, parent0, key0, p0); /* debug */
             ::printf("%u try to insert %p key %u %p\n", level, parent1, key1, p1); /* debug */
-            parent0->print<Key, Page *>(); /* debug */
-            parent1->print<Key, Page *>(); /* debug */
+            parent0->print<Key, PageRef>(); /* debug */
+            parent1->print<Key, PageRef>(); /* debug */
 #endif
             typename Page::Iterator it = parent0->search(k0);
             assert(!it.isEnd());
-            assert(it.template value<Page *>() == page);
+            assert(it.childPage() == page);
             const Key &k2 = it.template key<Key>();
             if (k2 == k0) {
-                ret = parent0->update(k2, p0); assert(ret);
+                ret = parent0->updateChild(k2, p0); assert(ret);
             } else {
                 /* This is the case of left-most,
                    or the case left-most-key in the page are deleted. */
                 ret = parent0->erase(k2); assert(ret);
-                ret = parent0->insert(k0, p0); assert(ret);
+                ret = parent0->insertChild(k0, p0); assert(ret);
             }
             /* GC may be reuiqred when
                parent0 and parent1 is the same page.
                After GC, the insertion will success definitely.
             */
-            if (!parent1->canInsert(sizeof(Key) + sizeof(Page *))) {
+            if (!parent1->canInsert(sizeof(Key) + sizeof(PageRef))) {
                 parent1->gc();
             }
-            ret = parent1->insert(k1, p1); assert(ret);
-            p0->header().parent = parent0;
-            p1->header().parent = parent1;
+            ret = parent1->insertChild(k1, p1); assert(ret);
+            p0->setParent(parent0);
+            p1->setParent(parent1);
             delete page;
+            if (stats_) stats_->nPageAdd.add();
         }
 
         /* Update parent field of all children. */
         auto it0 = p0->begin();
         while (it0 != p0->end()) {
-            Page *child = it0.template value<Page *>();
-            child->header().parent = p0;
+            Page *child = it0.childPage();
+            child->setParent(p0);
             ++it0;
         }
         auto it1 = p1->begin();
         while (it1 != p1->end()) {
-            Page *child = it1.template value<Page *>();
-            child->header().parent = p1;
+            Page *child = it1.childPage();
+            child->setParent(p1);
             ++it1;
         }
 
@@ -1569,8 +2888,8 @@ private:
         Page *ret1 = CompareT()(key1, k1) ? p0 : p1;
 #if 0
         ::printf("%u p0 %p p1 %p\n", level, p0, p1); /* debug */
-        p0->template print<Key, Page *>(); /* debug */
-        p1->template print<Key, Page *>(); /* debug */
+        p0->template print<Key, PageRef>(); /* debug */
+        p1->template print<Key, PageRef>(); /* debug */
         ::printf("%u end %p %p\n", level, ret0, ret1); /* debug */
 #endif
         return std::make_tuple(ret0, ret1);
@@ -1581,6 +2900,7 @@ private:
      *   never nullptr.
      */
     Page *searchLeaf(const Key &key) {
+        CYBOZU_BTREE_PROF_PHASE(DESCENT);
         Page *p = &root_;
         while (!p->isLeaf()) p = p->child(key);
         return p;
@@ -1606,11 +2926,11 @@ private:
         /* The key of parent record may be less than the key0
            because some records may have been deleted from the page.
            If so, the next key must be the exact record. */
-        if (it.template value<const Page *>() != page) {
+        if (it.childPage() != page) {
             ++it;
             assert(!it.isEnd());
         }
-        assert(it.template value<const Page *>() == page);
+        assert(it.childPage() == page);
         return it;
     }
     typename Page::Iterator parentRecord(Page *page) {
@@ -1625,11 +2945,11 @@ private:
         /* The key of parent record may be less than the key0
            because some records may have been deleted from the page.
            If so, the next key must be the exact record. */
-        if (it.template value<const Page *>() != page) {
+        if (it.childPage() != page) {
             ++it;
             assert(!it.isEnd());
         }
-        assert(it.template value<const Page *>() == page);
+        assert(it.childPage() == page);
         return it;
     }
     /**
@@ -1648,7 +2968,7 @@ private:
             typename Page::ConstIterator it = parentRecord(p);
             ++it;
             if (it != p->parent()->end()) {
-                p = it.template value<Page *>(); /* child */
+                p = it.childPage(); /* child */
                 break;
             }
             p = p->parent();
@@ -1678,7 +2998,7 @@ private:
             typename Page::ConstIterator it = parentRecord(p);
             if (it != p->parent()->begin()) {
                 --it;
-                p = it.template value<Page *>(); /* child */
+                p = it.childPage(); /* child */
                 break;
             }
             p = p->parent();
@@ -1734,16 +3054,27 @@ private:
      * Delete a page and its descendants recursively.
      * This is top down.
      */
+    size_t countPages(const Page *page) const {
+        if (page->isLeaf()) return 1;
+        size_t n = 1;
+        typename Page::ConstIterator it = page->begin();
+        while (it != page->end()) {
+            n += countPages(it.childPage());
+            ++it;
+        }
+        return n;
+    }
     void deleteRecursive(Page *page) {
         //::printf("deleteRecursive: %p\n", page);
         assert(page);
+        if (stats_) stats_->nPageRemove.add();
         if (page->isLeaf()) {
             delete page;
             return;
         }
         typename Page::Iterator it = page->begin();
         while (it != page->end()) {
-            Page *child = it.template value<Page *>();
+            Page *child = it.childPage();
             deleteRecursive(child);
             it.erase();
         }
@@ -1762,25 +3093,86 @@ private:
     void deleteEmptyPage(Page *page, const Key &key) {
         assert(page);
         assert(page->empty());
-        if (page->isRoot()) return;
+        if (page->isRoot()) {
+            page->agg() = Agg::identity();
+            return;
+        }
+        CYBOZU_BTREE_PROF_PHASE(DELETE_PAGE);
 
         /* Delete the correspoding record from the parent. */
         Page *parent = page->parent();
         assert(parent);
         typename Page::Iterator it = parent->search(key);
-        assert(it.template value<Page *>() == page);
+        assert(it.childPage() == page);
         bool isBegin = it.isBegin();
         it.erase();
 
         delete page;
         page = nullptr;
+        if (stats_) stats_->nPageRemove.add();
 
         /* Call it recursively is necessary. */
         if (parent->empty()) {
             deleteEmptyPage(parent, key);
-        } else if (isBegin) {
-            updateMinKey(parent);
+            return;
         }
+        if (isBegin) updateMinKey(parent);
+        if (isAggEnabled) updateAggPath(parent);
+    }
+    /**
+     * Recompute the aggregate of a page from its records or children.
+     */
+    static void updateAgg(Page *page) {
+        if (!isAggEnabled) return;
+        AggValue v = Agg::identity();
+        typename Page::Iterator it = page->begin();
+        if (page->isLeaf()) {
+            for (; it != page->end(); ++it) {
+                v = Agg::combine(v, Agg::of(it.template key<Key>(), it.template value<T>()));
+            }
+        } else {
+            for (; it != page->end(); ++it) {
+                v = Agg::combine(v, it.childPage()->agg());
+            }
+        }
+        page->agg() = v;
+    }
+    /**
+     * Recompute the aggregates of a page and its ancestors.
+     */
+    void updateAggPath(Page *page) {
+        for (; page; page = page->parent()) updateAgg(page);
+    }
+    /**
+     * Aggregate of the records in [lo, hi) of the subtree.
+     * @checkLo/@checkHi false if the subtree is known to be above lo/below hi.
+     */
+    AggValue aggregateRange(const Page *page, const Key &lo, const Key &hi,
+                            bool checkLo, bool checkHi) const {
+        if (!checkLo && !checkHi) return page->agg();
+        if (page->empty()) return Agg::identity();
+        AggValue v = Agg::identity();
+        if (page->isLeaf()) {
+            typename Page::ConstIterator it = checkLo ? page->lowerBound(lo) : page->cBegin();
+            for (; it != page->cEnd(); ++it) {
+                const Key &key = it.template key<Key>();
+                if (checkHi && !CompareT()(key, hi)) break;
+                v = Agg::combine(v, Agg::of(key, it.template value<T>()));
+            }
+            return v;
+        }
+        /* Children from the one that may have lo to the one that may have hi. */
+        const uint16_t bgn = checkLo ? page->search(lo).idx() : 0;
+        const uint16_t end = checkHi ? page->search(hi).idx() : page->numRecords() - 1;
+        typename Page::ConstIterator it(page, bgn);
+        if (bgn == end) {
+            return aggregateRange(it.childPage(), lo, hi, checkLo, checkHi);
+        }
+        v = aggregateRange(it.childPage(), lo, hi, checkLo, false);
+        for (++it; it.idx() < end; ++it) {
+            v = Agg::combine(v, it.childPage()->agg());
+        }
+        return Agg::combine(v, aggregateRange(it.childPage(), lo, hi, false, checkHi));
     }
     /**
      * Modify the key of ancestors for the minimum key of
@@ -1790,6 +3182,7 @@ private:
         assert(page);
         assert(!page->empty());
         if (page->isRoot()) return;
+        CYBOZU_BTREE_PROF_PHASE(UPDATE_MIN_KEY);
 
         Page *parent = page->parent();
         assert(parent);
@@ -1807,6 +3200,7 @@ private:
      * Try merge the page and its left page.
      */
     typename Page::Iterator tryMerge(typename Page::Iterator it) {
+        CYBOZU_BTREE_PROF_PHASE(MERGE);
         Page *page = it.page();
         assert(page);
         assert(!page->empty());
@@ -1818,62 +3212,174 @@ private:
         typename Page::Iterator it0 = parentRecord(page);
         if (it0.isBegin()) return it;
         --it0;
-        Page *leftPage = it0.template value<Page *>();
+        Page *leftPage = it0.childPage();
         if (page->emptySize() < leftPage->totalDataSize() + page->totalDataSize()) {
             /* No space to merge. */
             return it;
         }
+        uint16_t n = leftPage->numRecords();
+        mergeIntoRight(it0);
+        it.updateIdx(it.idx() + n);
+        tryMerge(it0); /* recursive call. */
+        return it;
+    }
+    /**
+     * Merge a page into its right sibling.
+     * The right sibling must have enough empty space.
+     * @it0 the record of the page in the parent.
+     *   It will indicate the record of the right sibling.
+     */
+    void mergeIntoRight(typename Page::Iterator &it0) {
+        Page *leftPage = it0.childPage();
+        typename Page::Iterator it1 = it0;
+        ++it1;
+        Page *page = it1.childPage();
         if (page->freeSpace() < leftPage->totalDataSize()) {
             page->gc();
         }
+        CYBOZU_TRACE_EVENT(MERGE, page->level());
 #if 0
         ::printf("do really merge (level %u)\n", page->level()); /* debug */
 #endif
         assert(leftPage->totalDataSize() <= page->freeSpace());
         if (!leftPage->isLeaf()) {
             /* Update parent firld of the children of the old left page. */
-            typename Page::Iterator it1 = leftPage->begin();
-            while (!it1.isEnd()) {
-                Page *child = it1.template value<Page *>();
-                child->header().parent = page;
-                ++it1;
+            typename Page::Iterator it2 = leftPage->begin();
+            while (!it2.isEnd()) {
+                Page *child = it2.childPage();
+                child->setParent(page);
+                ++it2;
             }
         }
-        uint16_t n = leftPage->numRecords();
+        CYBOZU_BTREE_HEAT_DO(page->heat().add(leftPage->heat()));
         UNUSED bool ret = page->merge(*leftPage);
         assert(ret);
         delete leftPage;
-        it.updateIdx(it.idx() + n);
+        if (stats_) {
+            stats_->nMerge.add();
+            stats_->nPageRemove.add();
+        }
         Key key = it0.template key<Key>();
         it0.erase(); /* delete leftPage's record in the parent page. */
-        assert(it0.template value<Page *>() == page);
+        assert(it0.childPage() == page);
         /* Update rightPage's key with leftPage's one. */
         ret = it0.page()->updateKey(it0, key);
         assert(ret);
-        tryMerge(it0); /* recursive call. */
-        return it;
+    }
+    /**
+     * Get the leaf for an insertion in the top-down mode.
+     * A full branch page is split before going down,
+     * so a split below never goes up beyond its parent.
+     */
+    Page *searchLeafSplitting(const Key &key) {
+        const uint16_t recSize = sizeof(Key) + sizeof(PageRef);
+        Page *p = &root_;
+        while (!p->isLeaf()) {
+            if (!p->canInsert(recSize)) p->gc();
+            if (!p->canInsert(recSize)) {
+                Page *p1;
+                std::tie(p, p1) = splitNonLeaf(p, key, key);
+            }
+            p = p->child(key);
+        }
+        return p;
+    }
+    /**
+     * Erase in the top-down mode.
+     * Each child on the path is prepared before going down,
+     * so neither an empty page nor a merge goes up.
+     */
+    bool eraseTopDown(const Key &key) {
+        liftUp(); /* the root must have two or more children. */
+        Page *p = &root_;
+        while (!p->isLeaf()) {
+            p = prepareChildForErase(p->search(key));
+        }
+        typename Page::Iterator it = p->lowerBound(key);
+        const bool found = !it.isEnd() && isEqual(it.template key<Key>(), key);
+        if (found) {
+            CYBOZU_BTREE_HEAT_DO(if (sampleHeat()) p->heat().nWrite++);
+            const bool isBegin = it.isBegin();
+            it.erase();
+            if (isBegin && !p->isRoot()) updateMinKey(p);
+            if (stats_) stats_->nErase.add();
+            if (isAggEnabled) updateAggPath(p);
+        }
+        liftUp();
+        return found;
+    }
+    /**
+     * Make a child able to lose a record without changing its parent later.
+     * A sparse child is merged with its left sibling (right one for the left-most child),
+     * and a child with only one record borrows one from the sibling.
+     * @it the record of the child in its parent.
+     * RETURN:
+     *   the child that has the key range of the child now.
+     */
+    Page *prepareChildForErase(typename Page::Iterator it) {
+        Page *page = it.childPage();
+        const bool isSparse = page->totalDataSize() * 3 <= page->emptySize();
+        if (!isSparse && 2 <= page->numRecords()) return page;
+        Page *parent = it.page();
+        assert(2 <= parent->numRecords()); /* the root is lifted up and other pages were prepared. */
+        typename Page::Iterator itL = it, itR = it;
+        if (it.isBegin()) {
+            ++itR;
+        } else {
+            --itL;
+        }
+        Page *left = itL.childPage();
+        Page *right = itR.childPage();
+        if (left->totalDataSize() + right->totalDataSize() <= right->emptySize()) {
+            mergeIntoRight(itL);
+            updateAgg(right);
+            return right;
+        }
+        if (2 <= page->numRecords()) return page;
+
+        /* The sibling has two or more records because they could not be merged. */
+        Page *src = page == left ? right : left;
+        typename Page::Iterator srcIt(src, page == left ? 0 : src->numRecords() - 1);
+        if (!page->canInsert(srcIt.keySize() + srcIt.valueSize())) page->gc();
+        UNUSED bool ret = page->insert(srcIt.keyPtr(), srcIt.keySize(), srcIt.valuePtr(), srcIt.valueSize());
+        assert(ret);
+        if (!page->isLeaf()) srcIt.childPage()->setParent(page);
+        srcIt.erase();
+        ret = parent->updateKey(itR, right->template minKey<Key>());
+        assert(ret);
+        updateAgg(left);
+        updateAgg(right);
+        return page;
     }
     /**
      * Shrink the depth if possible.
      */
     void liftUp() {
         //::printf("liftUp\n"); /* debug */
+        CYBOZU_BTREE_PROF_PHASE(LIFT_UP);
         Page *p = &root_;
         while (!p->isLeaf() && p->numRecords() == 1) {
             UNUSED uint16_t level = p->level();
+            CYBOZU_TRACE_EVENT(LIFT_UP, p->level());
             Page *child = p->leftMostChild();
             p->swap(*child);
-            p->header().parent = nullptr;
+            CYBOZU_BTREE_HEAT_DO(std::swap(p->heat(), child->heat()));
+            std::swap(p->agg(), child->agg());
+            p->setParent(nullptr);
             assert(level == p->level() + 1);
             delete child;
+            if (stats_) {
+                stats_->nLiftUp.add();
+                stats_->nPageRemove.add();
+            }
         }
         if (!p->isLeaf()) {
             /* Update childrens' parent to the root */
             typename Page::Iterator it = p->begin();
             while (it != p->end()) {
-                Page *child = it.template value<Page *>();
+                Page *child = it.childPage();
                 assert(child);
-                child->header().parent = p;
+                child->setParent(p);
                 ++it;
             }
         }
@@ -0,0 +1,290 @@
+#pragma once
+/**
+ * @file
+ * @description cost breakdown of BtreeMap operations.
+ *
+ * Define CYBOZU_BTREE_PROF (make PROF=1) to enable.
+ * Without the macro, the probes are compiled out.
+ *
+ * One in CYBOZU_BTREE_PROF_SAMPLE operations per thread is timed with TSC.
+ * Phases may nest, and each phase is charged its exclusive time
+ * (the time of nested phases is excluded).
+ * The in-page phases (SEARCH and MODIFY) are counted
+ * only when they are entered directly from an operation,
+ * so copying records inside gc() or split() is charged to GC or SPLIT.
+ */
+#include <cstdio>
+#include <cstdint>
+#include <cassert>
+#include <cinttypes>
+#include <iterator>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include "tsc.hpp"
+
+namespace cybozu {
+namespace btree_prof {
+
+#ifdef CYBOZU_BTREE_PROF
+constexpr bool isEnabled = true;
+#else
+constexpr bool isEnabled = false;
+#endif
+
+#ifndef CYBOZU_BTREE_PROF_SAMPLE
+#define CYBOZU_BTREE_PROF_SAMPLE 64 /* time 1 in N operations. power of two. */
+#endif
+
+enum class Op : uint8_t
+{
+    INSERT, ERASE, LOWER_BOUND,
+};
+constexpr size_t NUM_OPS = 3;
+
+enum class Phase : uint8_t
+{
+    OTHER, /* not included in any phase below. */
+    DESCENT, /* searchLeaf() and moving to the next leaf. */
+    SEARCH, /* search in a leaf page. */
+    MODIFY, /* record insertion or deletion in a leaf page. */
+    GC, SPLIT, MERGE, DELETE_PAGE, UPDATE_MIN_KEY, LIFT_UP,
+};
+constexpr size_t NUM_PHASES = 10;
+
+static inline const char *opName(Op op)
+{
+    static const char *const tbl[] = {
+        "insert", "erase", "lowerBound",
+    };
+    return tbl[size_t(op)];
+}
+
+static inline const char *phaseName(Phase phase)
+{
+    static const char *const tbl[] = {
+        "other", "descent", "search", "modify",
+        "gc", "split", "merge", "deleteEmptyPage", "updateMinKey", "liftUp",
+    };
+    return tbl[size_t(phase)];
+}
+
+/**
+ * All the time values are TSC ticks.
+ */
+struct OpStat
+{
+    uint64_t nSampled;
+    uint64_t total;
+    uint64_t phase[NUM_PHASES];
+
+    OpStat() { reset(); }
+    void reset() {
+        nSampled = 0;
+        total = 0;
+        std::fill(std::begin(phase), std::end(phase), 0);
+    }
+    OpStat &operator+=(const OpStat &rhs) {
+        nSampled += rhs.nSampled;
+        total += rhs.total;
+        for (size_t i = 0; i < NUM_PHASES; i++) phase[i] += rhs.phase[i];
+        return *this;
+    }
+};
+
+/**
+ * Per-thread profiling state.
+ */
+class State
+{
+private:
+    static constexpr size_t MAX_DEPTH = 64;
+
+    bool isActive_; /* inside an operation. */
+    bool isSampling_;
+    Op op_;
+    uint32_t nOps_;
+    uint64_t begin_; /* the operation beginning. */
+    uint64_t last_; /* the last phase transition. */
+    size_t depth_;
+    Phase stack_[MAX_DEPTH];
+    OpStat stat_[NUM_OPS];
+
+public:
+    State() : isActive_(false), isSampling_(false), op_(Op::INSERT)
+            , nOps_(0), begin_(0), last_(0), depth_(0) {}
+    /**
+     * RETURN:
+     *   false if it is nested in another operation.
+     */
+    bool beginOp(Op op) {
+        if (isActive_) return false;
+        isActive_ = true;
+        isSampling_ = (nOps_++ & (CYBOZU_BTREE_PROF_SAMPLE - 1)) == 0;
+        if (!isSampling_) return true;
+        op_ = op;
+        depth_ = 0;
+        stack_[depth_++] = Phase::OTHER;
+        begin_ = tsc::now();
+        last_ = begin_;
+        return true;
+    }
+    void endOp() {
+        assert(isActive_);
+        isActive_ = false;
+        if (!isSampling_) return;
+        uint64_t now = tsc::now();
+        OpStat &s = stat_[size_t(op_)];
+        s.phase[size_t(stack_[depth_ - 1])] += now - last_;
+        s.nSampled++;
+        s.total += now - begin_;
+        isSampling_ = false;
+    }
+    /**
+     * RETURN:
+     *   true if the phase has been entered.
+     */
+    bool enter(Phase phase, bool isInPage) {
+        if (!isSampling_) return false;
+        if (isInPage && depth_ != 1) return false;
+        if (depth_ == MAX_DEPTH) return false;
+        transit();
+        stack_[depth_++] = phase;
+        return true;
+    }
+    void leave() {
+        assert(1 < depth_);
+        transit();
+        depth_--;
+    }
+    const OpStat &stat(size_t i) const { return stat_[i]; }
+    void reset() {
+        for (OpStat &s : stat_) s.reset();
+    }
+private:
+    void transit() {
+        uint64_t now = tsc::now();
+        stat_[size_t(op_)].phase[size_t(stack_[depth_ - 1])] += now - last_;
+        last_ = now;
+    }
+};
+
+/**
+ * All the states.
+ * Statistics of exited threads are kept.
+ */
+class Registry
+{
+private:
+    std::mutex mutex_;
+    std::vector<State *> states_;
+    OpStat retired_[NUM_OPS];
+
+public:
+    void add(State *s) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        states_.push_back(s);
+    }
+    void remove(State *s) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (size_t i = 0; i < NUM_OPS; i++) retired_[i] += s->stat(i);
+        states_.erase(std::remove(states_.begin(), states_.end(), s), states_.end());
+    }
+    /**
+     * Profiled threads must not be running operations.
+     */
+    void reset() {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (OpStat &s : retired_) s.reset();
+        for (State *s : states_) s->reset();
+    }
+    void print(::FILE *fp) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (size_t i = 0; i < NUM_OPS; i++) {
+            OpStat s = retired_[i];
+            for (State *st : states_) s += st->stat(i);
+            if (s.nSampled == 0) continue;
+            ::fprintf(fp, "  %-10s %10" PRIu64 " sampled  %8.1f ns/op\n"
+                      , opName(Op(i)), s.nSampled, tsc::toNs(s.total) / s.nSampled);
+            for (size_t j = 0; j < NUM_PHASES; j++) {
+                if (s.phase[j] == 0) continue;
+                ::fprintf(fp, "    %-16s %8.1f ns/op %6.2f%%\n"
+                          , phaseName(Phase(j)), tsc::toNs(s.phase[j]) / s.nSampled
+                          , s.phase[j] * 100.0 / s.total);
+            }
+        }
+        ::fflush(fp);
+    }
+};
+
+static inline Registry &registry()
+{
+    static Registry r;
+    return r;
+}
+
+static inline State &localState()
+{
+    struct Holder
+    {
+        State state;
+        Holder() { registry().add(&state); }
+        ~Holder() noexcept { registry().remove(&state); }
+    };
+    static thread_local Holder holder;
+    return holder.state;
+}
+
+class OpScope
+{
+private:
+    const bool isOuter_;
+public:
+    explicit OpScope(Op op) : isOuter_(localState().beginOp(op)) {}
+    ~OpScope() noexcept {
+        if (isOuter_) localState().endOp();
+    }
+    OpScope(const OpScope &) = delete;
+    OpScope &operator=(const OpScope &) = delete;
+};
+
+class PhaseScope
+{
+private:
+    const bool isEntered_;
+public:
+    explicit PhaseScope(Phase phase, bool isInPage = false)
+        : isEntered_(localState().enter(phase, isInPage)) {}
+    ~PhaseScope() noexcept {
+        if (isEntered_) localState().leave();
+    }
+    PhaseScope(const PhaseScope &) = delete;
+    PhaseScope &operator=(const PhaseScope &) = delete;
+};
+
+static inline void print(::FILE *fp)
+{
+    registry().print(fp);
+}
+
+static inline void reset()
+{
+    registry().reset();
+}
+
+}} //namespace cybozu::btree_prof
+
+#define CYBOZU_BTREE_PROF_CAT0(x, y) x ## y
+#define CYBOZU_BTREE_PROF_CAT(x, y) CYBOZU_BTREE_PROF_CAT0(x, y)
+#ifdef CYBOZU_BTREE_PROF
+#define CYBOZU_BTREE_PROF_OP(op) \
+    ::cybozu::btree_prof::OpScope CYBOZU_BTREE_PROF_CAT(profOp_, __LINE__)(::cybozu::btree_prof::Op::op)
+#define CYBOZU_BTREE_PROF_PHASE(phase) \
+    ::cybozu::btree_prof::PhaseScope CYBOZU_BTREE_PROF_CAT(profPhase_, __LINE__)(::cybozu::btree_prof::Phase::phase)
+#define CYBOZU_BTREE_PROF_PAGE_PHASE(phase) \
+    ::cybozu::btree_prof::PhaseScope CYBOZU_BTREE_PROF_CAT(profPhase_, __LINE__)(::cybozu::btree_prof::Phase::phase, true)
+#else
+#define CYBOZU_BTREE_PROF_OP(op) ((void)0)
+#define CYBOZU_BTREE_PROF_PHASE(phase) ((void)0)
+#define CYBOZU_BTREE_PROF_PAGE_PHASE(phase) ((void)0)
+#endif
@@ -0,0 +1,234 @@
+#pragma once
+/**
+ * @file
+ * @description scalable counters.
+ *
+ * StripedCounter: an array of cache-line padded slots, one per thread.
+ *   Each slot is written by its owner only and sum() aggregates them.
+ * ApproxCounter: threads count locally and fold into a shared counter
+ *   when the local delta reaches a threshold.
+ * Snzi: scalable non-zero indicator.
+ */
+#include <cstdlib>
+#include <cstdint>
+#include <cassert>
+#include <atomic>
+#include <new>
+#include <utility>
+
+namespace cybozu {
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+/**
+ * A cache line with a value.
+ */
+struct CacheLine
+{
+    uint64_t value;
+    uint64_t padding[7];
+    CacheLine() : value(0) {}
+};
+
+static_assert(sizeof(CacheLine) == CACHE_LINE_SIZE, "CacheLine size must be 64.");
+
+/**
+ * Fixed-size array aligned to the cache line size.
+ * Each element must occupy whole cache lines.
+ * (std::vector does not respect alignas(64) before C++17.)
+ */
+template <typename T>
+class CacheAlignedArray
+{
+private:
+    T *p_;
+    size_t n_;
+
+    static_assert(sizeof(T) % CACHE_LINE_SIZE == 0, "T must be a multiple of the cache line size.");
+public:
+    explicit CacheAlignedArray(size_t n) : p_(nullptr), n_(0) {
+        void *p;
+        if (::posix_memalign(&p, CACHE_LINE_SIZE, sizeof(T) * n + (n == 0)) != 0) {
+            throw std::bad_alloc();
+        }
+        p_ = reinterpret_cast<T *>(p);
+        for (; n_ < n; n_++) new (&p_[n_]) T();
+    }
+    ~CacheAlignedArray() noexcept {
+        for (size_t i = 0; i < n_; i++) p_[i].~T();
+        ::free(p_);
+    }
+    CacheAlignedArray(const CacheAlignedArray &) = delete;
+    CacheAlignedArray &operator=(const CacheAlignedArray &) = delete;
+
+    size_t size() const { return n_; }
+    T &operator[](size_t i) { assert(i < n_); return p_[i]; }
+    const T &operator[](size_t i) const { assert(i < n_); return p_[i]; }
+    T *begin() { return p_; }
+    T *end() { return p_ + n_; }
+    const T *begin() const { return p_; }
+    const T *end() const { return p_ + n_; }
+};
+
+using CacheLineArray = CacheAlignedArray<CacheLine>;
+
+/**
+ * Per-thread counters.
+ * Thread i uses slot i. sum() can be called at any time.
+ */
+class StripedCounter
+{
+private:
+    CacheLineArray slots_;
+public:
+    explicit StripedCounter(size_t nSlots) : slots_(nSlots) {}
+    size_t numSlots() const { return slots_.size(); }
+    /**
+     * The slot for the owner thread.
+     * Plain increments are fine if sum() is called after the writers stop.
+     */
+    uint64_t &operator[](size_t i) { return slots_[i].value; }
+    /**
+     * Safe against concurrent sum().
+     */
+    void add(size_t i, uint64_t n = 1) {
+        uint64_t &v = slots_[i].value;
+        __atomic_store_n(&v, v + n, __ATOMIC_RELAXED);
+    }
+    uint64_t sum() const {
+        uint64_t total = 0;
+        for (const CacheLine &c : slots_) total += __atomic_load_n(&c.value, __ATOMIC_RELAXED);
+        return total;
+    }
+    void reset() {
+        for (CacheLine &c : slots_) __atomic_store_n(&c.value, 0, __ATOMIC_RELAXED);
+    }
+};
+
+/**
+ * Approximate counter.
+ * The shared value is updated once per threshold local counts,
+ * so approx() differs from the exact value by less than
+ * threshold for each Local not flushed.
+ */
+class ApproxCounter
+{
+private:
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> global_;
+    const int64_t threshold_;
+public:
+    explicit ApproxCounter(int64_t threshold = 1024)
+        : global_(0), threshold_(threshold) {
+        assert(0 < threshold);
+    }
+    int64_t approx() const { return global_.load(std::memory_order_relaxed); }
+    int64_t threshold() const { return threshold_; }
+    /**
+     * A thread-owned part of the counter.
+     * The remaining delta is folded at destruction.
+     */
+    class Local
+    {
+    private:
+        ApproxCounter &counter_;
+        int64_t delta_;
+    public:
+        explicit Local(ApproxCounter &counter) : counter_(counter), delta_(0) {}
+        ~Local() noexcept { flush(); }
+        Local(const Local &) = delete;
+        Local &operator=(const Local &) = delete;
+        void add(int64_t n = 1) {
+            delta_ += n;
+            if (delta_ >= counter_.threshold_ || delta_ <= -counter_.threshold_) flush();
+        }
+        void flush() {
+            if (delta_ == 0) return;
+            counter_.global_.fetch_add(delta_, std::memory_order_relaxed);
+            delta_ = 0;
+        }
+    };
+};
+
+/**
+ * Scalable non-zero indicator (Ellen et al., PODC 2007).
+ * arrive() and depart() on a leaf touch the shared root
+ * only when the leaf surplus changes between zero and non-zero.
+ * Threads should use different leaves (e.g. leaf = thread id % numLeaves()).
+ */
+class Snzi
+{
+private:
+    /*
+     * Leaf state: low 32 bits is the surplus count c (HALF means 1/2),
+     * high 32 bits is the version v.
+     */
+    static constexpr uint32_t HALF = uint32_t(-1);
+
+    struct alignas(CACHE_LINE_SIZE) Leaf
+    {
+        std::atomic<uint64_t> x;
+        Leaf() : x(0) {}
+    };
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> root_; /* surplus of the leaves. */
+    CacheAlignedArray<Leaf> leaves_;
+
+    static uint64_t pack(uint32_t c, uint32_t v) { return (uint64_t(v) << 32) | c; }
+    static uint32_t count(uint64_t x) { return uint32_t(x); }
+    static uint32_t version(uint64_t x) { return uint32_t(x >> 32); }
+
+public:
+    explicit Snzi(size_t nLeaves) : root_(0), leaves_(nLeaves) {
+        assert(0 < nLeaves);
+    }
+    size_t numLeaves() const { return leaves_.size(); }
+    void arrive(size_t leaf) {
+        std::atomic<uint64_t> &x = leaves_[leaf].x;
+        bool succeeded = false;
+        size_t nUndo = 0;
+        while (!succeeded) {
+            uint64_t x0 = x.load(std::memory_order_acquire);
+            uint32_t c = count(x0);
+            if (c != HALF && c >= 1) {
+                if (x.compare_exchange_weak(x0, pack(c + 1, version(x0)), std::memory_order_acq_rel)) {
+                    succeeded = true;
+                }
+                continue;
+            }
+            if (c == 0) {
+                uint64_t x1 = pack(HALF, version(x0) + 1);
+                if (!x.compare_exchange_weak(x0, x1, std::memory_order_acq_rel)) continue;
+                succeeded = true;
+                x0 = x1;
+                c = HALF;
+            }
+            assert(c == HALF);
+            /* Help to finish the 0 to 1 transition. */
+            root_.fetch_add(1, std::memory_order_acq_rel);
+            if (!x.compare_exchange_strong(x0, pack(1, version(x0)), std::memory_order_acq_rel)) {
+                nUndo++;
+            }
+        }
+        for (; nUndo > 0; nUndo--) root_.fetch_sub(1, std::memory_order_acq_rel);
+    }
+    void depart(size_t leaf) {
+        std::atomic<uint64_t> &x = leaves_[leaf].x;
+        for (;;) {
+            uint64_t x0 = x.load(std::memory_order_acquire);
+            uint32_t c = count(x0);
+            assert(c != HALF && c >= 1);
+            if (x.compare_exchange_weak(x0, pack(c - 1, version(x0)), std::memory_order_acq_rel)) {
+                if (c == 1) root_.fetch_sub(1, std::memory_order_acq_rel);
+                return;
+            }
+        }
+    }
+    /**
+     * RETURN:
+     *   true if arrivals are more than departures.
+     */
+    bool query() const {
+        return root_.load(std::memory_order_acquire) != 0;
+    }
+};
+
+} //namespace cybozu
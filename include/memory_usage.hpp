@@ -0,0 +1,111 @@
+/**
+ * @file
+ * @brief Memory usage of the current process.
+ * @author HOSHINO Takashi
+ *
+ * (C) 2013 Cybozu Labs, Inc.
+ */
+#ifndef CYBOZU_MEMORY_USAGE_HPP
+#define CYBOZU_MEMORY_USAGE_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <malloc.h>
+
+namespace cybozu {
+namespace util {
+
+/**
+ * Resident set size [byte] from /proc/self/statm.
+ */
+static inline size_t getRss()
+{
+    ::FILE *fp = ::fopen("/proc/self/statm", "r");
+    if (!fp) return 0;
+    unsigned long size, resident;
+    int n = ::fscanf(fp, "%lu %lu", &size, &resident);
+    ::fclose(fp);
+    if (n != 2) return 0;
+    return resident * ::sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Peak resident set size [byte] (VmHWM in /proc/self/status).
+ */
+static inline size_t getPeakRss()
+{
+    ::FILE *fp = ::fopen("/proc/self/status", "r");
+    if (!fp) return 0;
+    char line[256];
+    size_t kb = 0;
+    while (::fgets(line, sizeof(line), fp)) {
+        if (::strncmp(line, "VmHWM:", 6) == 0) {
+            ::sscanf(line + 6, "%zu", &kb);
+            break;
+        }
+    }
+    ::fclose(fp);
+    return kb * 1024;
+}
+
+/**
+ * Reset the peak resident set size to the current one.
+ * This is supported by Linux 4.0 or later.
+ * RETURN:
+ *   false if not supported.
+ */
+static inline bool resetPeakRss()
+{
+    ::FILE *fp = ::fopen("/proc/self/clear_refs", "w");
+    if (!fp) return false;
+    bool ret = ::fputs("5", fp) >= 0;
+    ret = (::fclose(fp) == 0) && ret;
+    return ret;
+}
+
+/**
+ * Bytes allocated by malloc() and not freed yet.
+ */
+static inline size_t getHeapUsage()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = ::mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+    struct mallinfo mi = ::mallinfo();
+    return (unsigned int)mi.uordblks + (unsigned int)mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Return free heap memory to the OS
+ * so that the RSS will reflect live data.
+ */
+static inline void releaseFreeMemory()
+{
+#ifdef __GLIBC__
+    ::malloc_trim(0);
+#endif
+}
+
+struct MemoryUsage
+{
+    size_t rss;
+    size_t peakRss;
+    size_t heap;
+
+    static MemoryUsage now() {
+        MemoryUsage m;
+        m.rss = getRss();
+        m.peakRss = getPeakRss();
+        m.heap = getHeapUsage();
+        return m;
+    }
+};
+
+}} //namespace cybozu::util
+
+#endif /* CYBOZU_MEMORY_USAGE_HPP */
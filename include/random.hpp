@@ -8,6 +8,7 @@
 #include <random>
 #include <limits>
 #include <cassert>
+#include <cstdint>
 
 #ifndef RANDOM_HPP
 #define RANDOM_HPP
@@ -76,6 +77,118 @@ public:
     }
 };
 
+/**
+ * SplitMix64.
+ * This is used to expand a seed into generator states.
+ */
+class SplitMix64
+{
+private:
+    uint64_t x_;
+
+public:
+    explicit SplitMix64(uint64_t seed) : x_(seed) {}
+
+    uint64_t operator()() {
+        uint64_t z = (x_ += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+};
+
+/**
+ * xoshiro128** (Blackman and Vigna).
+ * The period is 2^128 - 1 and jump() advances the state by 2^64,
+ * so streams made by repeated jump() do not overlap.
+ */
+class Xoshiro128ss
+{
+private:
+    uint32_t s_[4];
+
+    static uint32_t rotl(uint32_t x, int k) {
+        return (x << k) | (x >> (32 - k));
+    }
+
+public:
+    explicit Xoshiro128ss(uint64_t seed) {
+        SplitMix64 sm(seed);
+        const uint64_t a = sm(), b = sm();
+        s_[0] = uint32_t(a);
+        s_[1] = uint32_t(a >> 32);
+        s_[2] = uint32_t(b);
+        s_[3] = uint32_t(b >> 32);
+        if ((s_[0] | s_[1] | s_[2] | s_[3]) == 0) s_[0] = 1;
+    }
+
+    uint32_t operator()() {
+        return get();
+    }
+
+    uint32_t get() {
+        const uint32_t result = rotl(s_[1] * 5, 7) * 9;
+        const uint32_t t = s_[1] << 9;
+        s_[2] ^= s_[0];
+        s_[3] ^= s_[1];
+        s_[1] ^= s_[2];
+        s_[0] ^= s_[3];
+        s_[2] ^= t;
+        s_[3] = rotl(s_[3], 11);
+        return result;
+    }
+
+    uint32_t get(uint32_t max) {
+        return get() % max;
+    }
+
+    uint32_t get(uint32_t min, uint32_t max) {
+        assert(min < max);
+        return get() % (max - min) + min;
+    }
+
+    /**
+     * The four state words.
+     */
+    const uint32_t *state() const { return s_; }
+
+    /**
+     * Equivalent to 2^64 calls of get().
+     */
+    void jump() {
+        static const uint32_t JUMP[] = {0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b};
+        uint32_t s[4] = {0, 0, 0, 0};
+        for (uint32_t j : JUMP) {
+            for (int b = 0; b < 32; b++) {
+                if (j & (uint32_t(1) << b)) {
+                    for (int i = 0; i < 4; i++) s[i] ^= s_[i];
+                }
+                get();
+            }
+        }
+        for (int i = 0; i < 4; i++) s_[i] = s[i];
+    }
+};
+
+/**
+ * Non-overlapping generators derived from a master seed.
+ * The same seed gives the same sequence of generators.
+ */
+class RandomStreams
+{
+private:
+    Xoshiro128ss gen_;
+
+public:
+    explicit RandomStreams(uint64_t seed) : gen_(seed) {}
+
+    Xoshiro128ss next() {
+        Xoshiro128ss ret = gen_;
+        gen_.jump();
+        return ret;
+    }
+};
+
 }} //namespace cybozu::util
 
 #endif /* RANDOM_HPP */
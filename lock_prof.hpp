@@ -0,0 +1,261 @@
+#pragma once
+/**
+ * @file
+ * @description lock profiling.
+ *
+ * ProfiledLockT<LockT, Mutex> wraps a RAII lock type
+ * (SpinlockT family with char, or std::lock_guard with std::mutex)
+ * and records acquisitions, contended acquisitions,
+ * wait time and hold time into a LockProfile.
+ * LockProfiles are keyed by a name such as a call site.
+ *
+ * Define CYBOZU_LOCK_PROF (make LOCK_PROF=1) to enable profiling.
+ * Otherwise ProfiledLockT is the same as LockT.
+ *
+ * The counters are updated while holding the lock,
+ * so they will abort HLE elision.
+ * When enabled, the profiles are exported to the stats registry.
+ */
+#include <cstdio>
+#include <cstdint>
+#include <cinttypes>
+#include <cstring>
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include "tsc.hpp"
+#include "spinlock.hpp"
+#include "stats.hpp"
+
+namespace cybozu {
+
+#ifdef CYBOZU_LOCK_PROF
+constexpr bool isLockProfEnabled = true;
+#else
+constexpr bool isLockProfEnabled = false;
+#endif
+
+/**
+ * All the time values are TSC ticks.
+ */
+struct LockProfile
+{
+    const std::string name;
+    uint64_t nAcquire;
+    uint64_t nContended;
+    uint64_t waitTotal;
+    uint64_t waitMax;
+    uint64_t holdTotal;
+    uint64_t holdMax;
+
+    explicit LockProfile(const std::string &name0) : name(name0) {
+        reset();
+    }
+    void reset() {
+        nAcquire = 0;
+        nContended = 0;
+        waitTotal = 0;
+        waitMax = 0;
+        holdTotal = 0;
+        holdMax = 0;
+    }
+    /**
+     * Call these while holding the lock.
+     */
+    void acquired(uint64_t wait, bool isContended) {
+        nAcquire++;
+        if (isContended) nContended++;
+        waitTotal += wait;
+        if (waitMax < wait) waitMax = wait;
+    }
+    void released(uint64_t hold) {
+        holdTotal += hold;
+        if (holdMax < hold) holdMax = hold;
+    }
+};
+
+class LockProfileRegistry
+{
+private:
+    std::mutex mutex_;
+    std::map<std::string, std::unique_ptr<LockProfile> > map_;
+    std::unique_ptr<stats::Collector> collector_;
+public:
+    LockProfileRegistry() {
+        if (!isLockProfEnabled) return;
+        collector_.reset(new stats::Collector([this](std::vector<stats::Sample> &v) {
+                    collect(v);
+                }));
+    }
+    LockProfile &get(const std::string &name) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        std::unique_ptr<LockProfile> &p = map_[name];
+        if (!p) p.reset(new LockProfile(name));
+        return *p;
+    }
+    void reset() {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (auto &pair : map_) pair.second->reset();
+    }
+    /**
+     * Sorted by the total wait time.
+     * Values of running locks may be inconsistent.
+     */
+    void print(::FILE *fp) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        std::vector<const LockProfile *> v;
+        for (auto &pair : map_) {
+            if (pair.second->nAcquire != 0) v.push_back(pair.second.get());
+        }
+        std::sort(v.begin(), v.end(), [](const LockProfile *a, const LockProfile *b) {
+                return a->waitTotal > b->waitTotal;
+            });
+        ::fprintf(fp, "%-32s %12s %12s %7s %10s %10s %10s %10s %10s %10s\n"
+                  , "lock", "acquire", "contended", "cont%"
+                  , "wait[ms]", "avg[ns]", "max[ns]", "hold[ms]", "avg[ns]", "max[ns]");
+        for (const LockProfile *p : v) {
+            ::fprintf(fp, "%-32s %12" PRIu64 " %12" PRIu64 " %7.2f"
+                      " %10.3f %10.1f %10.1f %10.3f %10.1f %10.1f\n"
+                      , p->name.c_str(), p->nAcquire, p->nContended
+                      , p->nContended * 100.0 / p->nAcquire
+                      , tsc::toNs(p->waitTotal) / 1e6
+                      , tsc::toNs(p->waitTotal) / p->nAcquire, tsc::toNs(p->waitMax)
+                      , tsc::toNs(p->holdTotal) / 1e6
+                      , tsc::toNs(p->holdTotal) / p->nAcquire, tsc::toNs(p->holdMax));
+        }
+        ::fflush(fp);
+    }
+    /**
+     * Values of running locks may be inconsistent.
+     */
+    void collect(std::vector<stats::Sample> &v) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        using stats::Type;
+        for (auto &pair : map_) {
+            const LockProfile &p = *pair.second;
+            const stats::Labels labels{{"lock", p.name}};
+            stats::addSample(v, "cybozu_lock_acquire_total", "Lock acquisitions."
+                             , Type::COUNTER, labels, p.nAcquire);
+            stats::addSample(v, "cybozu_lock_contended_total", "Lock acquisitions that had to wait."
+                             , Type::COUNTER, labels, p.nContended);
+            stats::addSample(v, "cybozu_lock_wait_seconds_total", "Time waiting for the lock."
+                             , Type::COUNTER, labels, tsc::toNs(p.waitTotal) / 1e9);
+            stats::addSample(v, "cybozu_lock_hold_seconds_total", "Time holding the lock."
+                             , Type::COUNTER, labels, tsc::toNs(p.holdTotal) / 1e9);
+        }
+    }
+};
+
+static inline LockProfileRegistry &lockProfileRegistry()
+{
+    static LockProfileRegistry r;
+    return r;
+}
+
+static inline LockProfile &lockProfile(const std::string &name)
+{
+    return lockProfileRegistry().get(name);
+}
+
+/**
+ * The name followed by the template arguments of the function,
+ * so each instantiation of a template has its own profile.
+ * @func __PRETTY_FUNCTION__ of the function.
+ */
+static inline std::string lockProfileName(const char *name, const char *func)
+{
+    const char *args = ::strchr(func, '['); /* " [with T = ...]" of gcc and clang. */
+    if (!args && ::strchr(func, '<')) args = func; /* clang omits it for a member of a class template. */
+    return args ? std::string(name) + " " + args : std::string(name);
+}
+
+static inline void printLockProfile(::FILE *fp)
+{
+    lockProfileRegistry().print(fp);
+}
+
+static inline void resetLockProfile()
+{
+    lockProfileRegistry().reset();
+}
+
+namespace lock_prof_local {
+
+/**
+ * Whether the lock is held by someone at the moment.
+ */
+static inline bool isLocked(const char &lock)
+{
+    return __atomic_load_n(&lock, __ATOMIC_RELAXED) != 0;
+}
+
+static inline bool isLocked(std::mutex &mutex)
+{
+    if (!mutex.try_lock()) return true;
+    mutex.unlock();
+    return false;
+}
+
+} //namespace lock_prof_local
+
+#ifdef CYBOZU_LOCK_PROF
+template <typename LockT, typename Mutex>
+class ProfiledLockT
+{
+private:
+    LockProfile &prof_;
+    const uint64_t t0_;
+    const bool isContended_;
+    LockT lk_;
+    uint64_t t1_;
+public:
+    ProfiledLockT(Mutex &mutex, LockProfile &prof)
+        : prof_(prof), t0_(tsc::now())
+        , isContended_(lock_prof_local::isLocked(mutex))
+        , lk_(mutex), t1_(tsc::now()) {
+        prof_.acquired(t1_ - t0_, isContended_);
+    }
+    ~ProfiledLockT() noexcept {
+        prof_.released(tsc::now() - t1_);
+    }
+    ProfiledLockT(const ProfiledLockT &) = delete;
+    ProfiledLockT &operator=(const ProfiledLockT &) = delete;
+};
+#else
+template <typename LockT, typename Mutex>
+class ProfiledLockT
+{
+private:
+    LockT lk_;
+public:
+    ProfiledLockT(Mutex &mutex, LockProfile &) : lk_(mutex) {}
+    ProfiledLockT(const ProfiledLockT &) = delete;
+    ProfiledLockT &operator=(const ProfiledLockT &) = delete;
+};
+#endif
+
+template <bool useHLE, bool useTTAS>
+using ProfiledSpinlockT = ProfiledLockT<SpinlockT<useHLE, useTTAS>, char>;
+using ProfiledMutexLock = ProfiledLockT<std::lock_guard<std::mutex>, std::mutex>;
+
+} //namespace cybozu
+
+#define CYBOZU_LOCK_STR0(x) #x
+#define CYBOZU_LOCK_STR(x) CYBOZU_LOCK_STR0(x)
+/**
+ * Call site as a lock profile name.
+ */
+#define CYBOZU_LOCK_SITE __FILE__ ":" CYBOZU_LOCK_STR(__LINE__)
+/**
+ * LockProfile reference that is looked up only once per call site
+ * and per instantiation of the enclosing template.
+ * The name must be a string literal.
+ */
+#define CYBOZU_LOCK_PROFILE(name) \
+    ([](const char *func) -> ::cybozu::LockProfile & {                  \
+        static ::cybozu::LockProfile &p =                               \
+            ::cybozu::lockProfile(::cybozu::lockProfileName(name, func)); \
+        return p; }(__PRETTY_FUNCTION__))
@@ -0,0 +1,349 @@
+#pragma once
+/**
+ * @file
+ * @description multi-version map for snapshot reads without locks.
+ *
+ * Each key of a BlinkTreeMap points to a chain of versions, newest first.
+ * A version has the commit timestamp of the write and a value or a tombstone.
+ * Writers are serialized by a mutex. A commit prepends one version
+ * per written key and then publishes its timestamp by advancing the clock.
+ * A snapshot reads the clock as its timestamp and sees the newest version
+ * not newer than it, so readers take no lock and never block writers.
+ *
+ * Garbage collection uses the horizon, the oldest timestamp of the active snapshots.
+ * The newest version not newer than the horizon is visible to all the snapshots,
+ * so the older versions are freed. A key whose visible version is a tombstone
+ * is erased from the tree and the tombstone is freed by a later collection
+ * after the snapshots that may have found it have gone.
+ */
+#include <cstdio>
+#include <cstdint>
+#include <cassert>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <stdexcept>
+#include "blink_tree.hpp"
+#include "counter.hpp"
+
+namespace cybozu {
+
+/**
+ * Key and T must be trivially copyable as BlinkTreeMap.
+ */
+template <typename Key, typename T, class CompareT = std::less<Key> >
+class MvccMap
+{
+private:
+    struct Version
+    {
+        uint64_t ts; /* commit timestamp. */
+        bool isDeleted; /* tombstone. */
+        T value;
+        std::atomic<Version *> older;
+
+        Version(uint64_t ts0, bool isDeleted0, const T &value0, Version *older0)
+            : ts(ts0), isDeleted(isDeleted0), value(value0), older(older0) {}
+    };
+    using Tree = BlinkTreeMap<Key, Version *, CompareT>;
+    static constexpr size_t MAX_SNAPSHOTS = 64;
+
+    Tree tree_;
+    std::mutex commitMutex_; /* serializes writers. */
+    std::atomic<uint64_t> clock_; /* timestamp of the last commit. */
+    std::atomic<uint64_t> horizon_; /* snapshots older than it must not start. */
+    mutable CacheLineArray slots_; /* timestamps of active snapshots. 0 for a free slot. */
+
+    std::mutex gcMutex_;
+    std::vector<std::pair<uint64_t, Version *> > retired_; /* erased tombstones. */
+    std::thread gcThread_;
+    std::mutex gcThreadMutex_;
+    std::condition_variable gcCv_;
+    bool isGcStopped_;
+
+public:
+    struct Write
+    {
+        Key key;
+        bool isDeleted;
+        T value;
+    };
+
+    /**
+     * A consistent view of the map at a timestamp.
+     * It holds a slot until destroyed and delays garbage collection meanwhile.
+     */
+    class Snapshot
+    {
+    private:
+        const MvccMap *map_;
+        size_t slot_;
+        uint64_t ts_;
+
+        friend class MvccMap;
+        Snapshot(const MvccMap *map, size_t slot, uint64_t ts) : map_(map), slot_(slot), ts_(ts) {}
+    public:
+        Snapshot(Snapshot &&rhs) noexcept : map_(rhs.map_), slot_(rhs.slot_), ts_(rhs.ts_) {
+            rhs.map_ = nullptr;
+        }
+        Snapshot &operator=(Snapshot &&rhs) noexcept {
+            if (this != &rhs) {
+                release();
+                map_ = rhs.map_;
+                slot_ = rhs.slot_;
+                ts_ = rhs.ts_;
+                rhs.map_ = nullptr;
+            }
+            return *this;
+        }
+        ~Snapshot() noexcept { release(); }
+        uint64_t ts() const { return ts_; }
+        bool find(const Key &key, T &value) const {
+            Version *head = nullptr;
+            if (!map_->tree_.find(key, head)) return false;
+            const Version *v = visible(head, ts_);
+            if (!v) return false;
+            value = v->value;
+            return true;
+        }
+        /**
+         * Call fn(key, value) for the records whose keys are not less than the key
+         * in the key order until fn returns false.
+         */
+        template <typename Func>
+        void scan(const Key &key, Func fn) const {
+            map_->tree_.scan(key, Visitor<Func>(ts_, fn));
+        }
+        template <typename Func>
+        void scan(Func fn) const {
+            map_->tree_.scan(Visitor<Func>(ts_, fn));
+        }
+    private:
+        template <typename Func>
+        struct Visitor
+        {
+            uint64_t ts;
+            Func &fn;
+            Visitor(uint64_t ts0, Func &fn0) : ts(ts0), fn(fn0) {}
+            bool operator()(const Key &key, const Version *head) {
+                const Version *v = visible(head, ts);
+                return !v || fn(key, v->value);
+            }
+        };
+        void release() noexcept {
+            if (!map_) return;
+            __atomic_store_n(&map_->slots_[slot_].value, 0, __ATOMIC_RELEASE);
+            map_ = nullptr;
+        }
+    };
+
+    MvccMap()
+        : tree_(), commitMutex_(), clock_(1), horizon_(1), slots_(MAX_SNAPSHOTS)
+        , gcMutex_(), retired_(), gcThread_(), gcThreadMutex_(), gcCv_(), isGcStopped_(true) {
+    }
+    ~MvccMap() noexcept {
+        stopGc();
+        tree_.scan([](const Key &, Version *head) {
+                freeChain(head);
+                return true;
+            });
+        for (auto &pair : retired_) delete pair.second;
+    }
+    MvccMap(const MvccMap &) = delete;
+    MvccMap &operator=(const MvccMap &) = delete;
+
+    void put(const Key &key, const T &value) {
+        commit(std::vector<Write>{Write{key, false, value}});
+    }
+    /**
+     * RETURN:
+     *   false if the key does not exist.
+     */
+    bool erase(const Key &key) {
+        std::lock_guard<std::mutex> lk(commitMutex_);
+        const uint64_t ts = clock_.load(std::memory_order_relaxed) + 1;
+        const bool erased = pushVersion(key, true, T(), ts);
+        if (erased) clock_.store(ts, std::memory_order_release);
+        return erased;
+    }
+    /**
+     * Apply the writes atomically.
+     * Erasing an absent key is ignored.
+     * RETURN:
+     *   commit timestamp.
+     */
+    uint64_t commit(const std::vector<Write> &writes) {
+        std::lock_guard<std::mutex> lk(commitMutex_);
+        const uint64_t ts = clock_.load(std::memory_order_relaxed) + 1;
+        for (const Write &w : writes) pushVersion(w.key, w.isDeleted, w.value, ts);
+        clock_.store(ts, std::memory_order_release);
+        return ts;
+    }
+    /**
+     * Start a snapshot of the last commit.
+     */
+    Snapshot snapshot() const {
+        for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+            uint64_t &slot = slots_[i].value;
+            uint64_t t = clock_.load(std::memory_order_acquire);
+            uint64_t expected = 0;
+            if (!__atomic_compare_exchange_n(&slot, &expected, t, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            /*
+             * gc() may have computed the horizon before the slot is set.
+             * Then the horizon is visible here, and the timestamp is renewed.
+             */
+            while (t < horizon_.load(std::memory_order_seq_cst)) {
+                t = clock_.load(std::memory_order_acquire);
+                __atomic_store_n(&slot, t, __ATOMIC_SEQ_CST);
+            }
+            return Snapshot(this, i, t);
+        }
+        throw std::runtime_error("MvccMap: too many snapshots.");
+    }
+    /**
+     * Free the versions that no snapshot can see.
+     * RETURN:
+     *   number of freed versions.
+     */
+    size_t gc() {
+        std::lock_guard<std::mutex> lk(gcMutex_);
+        uint64_t h = minActive();
+        horizon_.store(h, std::memory_order_seq_cst);
+        h = std::min(h, minActive());
+
+        size_t nFreed = 0;
+        size_t j = 0;
+        for (size_t i = 0; i < retired_.size(); i++) {
+            if (retired_[i].first <= h) {
+                delete retired_[i].second;
+                nFreed++;
+            } else {
+                retired_[j++] = retired_[i];
+            }
+        }
+        retired_.resize(j);
+
+        std::vector<std::pair<Key, Version *> > deadKeys;
+        tree_.scan([&](const Key &key, Version *head) {
+                Version *keep = head;
+                while (keep && h < keep->ts) keep = keep->older.load(std::memory_order_relaxed);
+                if (!keep) return true;
+                Version *older = keep->older.load(std::memory_order_relaxed);
+                if (older) {
+                    keep->older.store(nullptr, std::memory_order_relaxed);
+                    nFreed += freeChain(older);
+                }
+                if (keep == head && keep->isDeleted) deadKeys.emplace_back(key, keep);
+                return true;
+            });
+        if (deadKeys.empty()) return nFreed;
+
+        std::lock_guard<std::mutex> lk2(commitMutex_);
+        const uint64_t ts = clock_.load(std::memory_order_relaxed) + 1;
+        for (const auto &pair : deadKeys) {
+            Version *head = nullptr;
+            if (!tree_.find(pair.first, head) || head != pair.second) continue;
+            tree_.erase(pair.first);
+            retired_.emplace_back(ts, head);
+        }
+        clock_.store(ts, std::memory_order_release);
+        return nFreed;
+    }
+    /**
+     * Run gc() every intervalMs milliseconds in a background thread.
+     */
+    void startGc(size_t intervalMs) {
+        stopGc();
+        isGcStopped_ = false;
+        gcThread_ = std::thread([this, intervalMs]() {
+                std::unique_lock<std::mutex> lk(gcThreadMutex_);
+                while (!isGcStopped_) {
+                    gcCv_.wait_for(lk, std::chrono::milliseconds(intervalMs));
+                    if (isGcStopped_) break;
+                    lk.unlock();
+                    gc();
+                    lk.lock();
+                }
+            });
+    }
+    void stopGc() {
+        if (!gcThread_.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lk(gcThreadMutex_);
+            isGcStopped_ = true;
+        }
+        gcCv_.notify_one();
+        gcThread_.join();
+    }
+    uint64_t lastCommitTs() const { return clock_.load(std::memory_order_acquire); }
+
+    /**
+     * Not thread-safe with writers or gc().
+     */
+    size_t countVersions() const {
+        size_t n = retired_.size();
+        tree_.scan([&](const Key &, const Version *head) {
+                for (const Version *v = head; v; v = v->older.load(std::memory_order_relaxed)) n++;
+                return true;
+            });
+        return n;
+    }
+    /**
+     * Number of keys including those whose visible version is a tombstone.
+     * Not thread-safe with writers or gc().
+     */
+    size_t numKeys() const { return tree_.size(); }
+
+private:
+    /**
+     * The newest version not newer than ts. nullptr for a tombstone or no version.
+     */
+    static const Version *visible(const Version *v, uint64_t ts) {
+        while (v && ts < v->ts) v = v->older.load(std::memory_order_acquire);
+        return v && !v->isDeleted ? v : nullptr;
+    }
+    static size_t freeChain(Version *v) {
+        size_t n = 0;
+        while (v) {
+            Version *older = v->older.load(std::memory_order_relaxed);
+            delete v;
+            v = older;
+            n++;
+        }
+        return n;
+    }
+    /**
+     * Prepend a version to the chain of the key. Call with commitMutex_.
+     * RETURN:
+     *   false if a tombstone is not pushed because the key does not exist.
+     */
+    bool pushVersion(const Key &key, bool isDeleted, const T &value, uint64_t ts) {
+        Version *head = nullptr;
+        const bool found = tree_.find(key, head);
+        if (isDeleted && (!found || head->isDeleted)) return false;
+        Version *v = new Version(ts, isDeleted, value, head);
+        if (found) {
+            tree_.update(key, v);
+        } else {
+            tree_.insert(key, v);
+        }
+        return true;
+    }
+    uint64_t minActive() const {
+        uint64_t h = clock_.load(std::memory_order_seq_cst);
+        for (const CacheLine &c : slots_) {
+            const uint64_t t = __atomic_load_n(&c.value, __ATOMIC_SEQ_CST);
+            if (t != 0 && t < h) h = t;
+        }
+        return h;
+    }
+};
+
+} // namespace cybozu
@@ -0,0 +1,153 @@
+#pragma once
+/**
+ * @file
+ * @description batched random number generation for benchmark workers.
+ *
+ * BatchRandom runs eight xoshiro128** lanes side by side.
+ * With AVX2 the lanes are one 256-bit register per state word,
+ * otherwise they are stepped one by one. Both produce the same output.
+ * RandomBuffer keeps a batch so that workers draw numbers
+ * with a load and decide operations with a compare.
+ */
+#include <cstdint>
+#include <cassert>
+#include <immintrin.h>
+#include "random.hpp"
+
+namespace cybozu {
+namespace util {
+
+class BatchRandom
+{
+public:
+    static constexpr size_t LANES = 8;
+private:
+    uint32_t s_[4][LANES]; /* s_[word][lane]. */
+    bool useAvx2_;
+
+    static uint32_t rotl(uint32_t x, int k) {
+        return (x << k) | (x >> (32 - k));
+    }
+
+public:
+    /**
+     * Each lane takes a stream from streams.
+     */
+    explicit BatchRandom(RandomStreams &streams)
+        : useAvx2_(__builtin_cpu_supports("avx2")) {
+        for (size_t i = 0; i < LANES; i++) {
+            Xoshiro128ss lane = streams.next();
+            for (size_t j = 0; j < 4; j++) s_[j][i] = lane.state()[j];
+        }
+    }
+    bool usesAvx2() const { return useAvx2_; }
+    void setAvx2(bool useAvx2) {
+        useAvx2_ = useAvx2 && __builtin_cpu_supports("avx2");
+    }
+    /**
+     * out[i * LANES + j] is the i-th output of the lane j.
+     * @n must be a multiple of LANES.
+     */
+    void fill(uint32_t *out, size_t n) {
+        assert(n % LANES == 0);
+        if (useAvx2_) {
+            fillAvx2(out, n);
+        } else {
+            fillScalar(out, n);
+        }
+    }
+private:
+    void fillScalar(uint32_t *out, size_t n) {
+        for (size_t i = 0; i < n; i += LANES) {
+            for (size_t j = 0; j < LANES; j++) {
+                uint32_t &s0 = s_[0][j], &s1 = s_[1][j], &s2 = s_[2][j], &s3 = s_[3][j];
+                out[i + j] = rotl(s1 * 5, 7) * 9;
+                const uint32_t t = s1 << 9;
+                s2 ^= s0;
+                s3 ^= s1;
+                s1 ^= s2;
+                s0 ^= s3;
+                s2 ^= t;
+                s3 = rotl(s3, 11);
+            }
+        }
+    }
+    __attribute__((target("avx2")))
+    void fillAvx2(uint32_t *out, size_t n) {
+        __m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s_[0]));
+        __m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s_[1]));
+        __m256i s2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s_[2]));
+        __m256i s3 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s_[3]));
+        for (size_t i = 0; i < n; i += LANES) {
+            /* x * 5 and x * 9 are shifts and adds. */
+            __m256i x = _mm256_add_epi32(_mm256_slli_epi32(s1, 2), s1);
+            x = _mm256_or_si256(_mm256_slli_epi32(x, 7), _mm256_srli_epi32(x, 25));
+            x = _mm256_add_epi32(_mm256_slli_epi32(x, 3), x);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), x);
+            const __m256i t = _mm256_slli_epi32(s1, 9);
+            s2 = _mm256_xor_si256(s2, s0);
+            s3 = _mm256_xor_si256(s3, s1);
+            s1 = _mm256_xor_si256(s1, s2);
+            s0 = _mm256_xor_si256(s0, s3);
+            s2 = _mm256_xor_si256(s2, t);
+            s3 = _mm256_or_si256(_mm256_slli_epi32(s3, 11), _mm256_srli_epi32(s3, 21));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(s_[0]), s0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(s_[1]), s1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(s_[2]), s2);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(s_[3]), s3);
+    }
+};
+
+/**
+ * Pre-generated random numbers.
+ * Call reserve() outside the measured region so that get() does not refill.
+ */
+class RandomBuffer
+{
+public:
+    static constexpr size_t SIZE = 512;
+private:
+    BatchRandom gen_;
+    size_t idx_;
+    uint32_t buf_[SIZE];
+
+    static_assert(SIZE % BatchRandom::LANES == 0, "SIZE must be a multiple of LANES.");
+public:
+    explicit RandomBuffer(const BatchRandom &gen) : gen_(gen), idx_(SIZE) {}
+    /**
+     * Make n numbers available.
+     * The remaining numbers are discarded at refill.
+     */
+    void reserve(size_t n) {
+        assert(n <= SIZE);
+        if (SIZE - idx_ < n) refill();
+    }
+    uint32_t get() {
+        if (idx_ == SIZE) refill();
+        return buf_[idx_++];
+    }
+    uint32_t operator()() { return get(); }
+    /**
+     * Probability threshold for isBelow().
+     * @num / @den is the probability in [0, 1].
+     */
+    static uint64_t threshold(uint64_t num, uint64_t den) {
+        assert(num <= den);
+        return (num << 32) / den;
+    }
+    /**
+     * True with the probability given by threshold(),
+     * without a division.
+     */
+    bool isBelow(uint64_t threshold) {
+        return get() < threshold;
+    }
+private:
+    void refill() {
+        gen_.fill(buf_, SIZE);
+        idx_ = 0;
+    }
+};
+
+}} //namespace cybozu::util
@@ -9,6 +9,7 @@
  */
 #include <atomic>
 #include <immintrin.h> /* for _mm_pause() */
+#include "trace.hpp"
 
 namespace cybozu {
 
@@ -49,6 +50,7 @@ private:
     char &lock_;
 public:
     explicit SpinlockT(char &lock) : lock_(lock) {
+        CYBOZU_TRACE_EVENT(LOCK_TRY, &lock_);
         int flags = __ATOMIC_ACQUIRE | (useHLE ? __ATOMIC_HLE_ACQUIRE : 0);
         if (useTTAS) {
             while (lock_ || __atomic_exchange_n(&lock_, 1, flags))
@@ -57,8 +59,11 @@ public:
             while (__atomic_exchange_n(&lock_, 1, flags))
                 _mm_pause();
         }
+        CYBOZU_TRACE_EVENT(LOCK_ACQUIRE, &lock_);
+        if (useHLE) CYBOZU_TRACE_ELISION(&lock_);
     }
     ~SpinlockT() noexcept {
+        CYBOZU_TRACE_EVENT(LOCK_RELEASE, &lock_);
         int flags = __ATOMIC_RELEASE | (useHLE ? __ATOMIC_HLE_RELEASE : 0);
         __atomic_clear(&lock_, flags);
     }
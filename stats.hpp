@@ -0,0 +1,401 @@
+#pragma once
+/**
+ * @file
+ * @description statistics registry and exporter.
+ *
+ * Counter: per-thread counter. add() writes only a slot of the calling thread,
+ *   and value() sums the slots of all the threads.
+ * Collector: a function that emits samples when the registry is read.
+ *   Maps, lock profiles and page allocators register collectors.
+ * Exporter: a low-priority thread that writes Prometheus text
+ *   or JSON to a file and/or serves it on a Unix domain socket.
+ */
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+#include <system_error>
+#include <algorithm>
+
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "counter.hpp"
+
+namespace cybozu {
+namespace stats {
+
+#ifndef CYBOZU_STATS_MAX_COUNTERS
+#define CYBOZU_STATS_MAX_COUNTERS 1024 /* counters alive at the same time. */
+#endif
+
+enum class Type : uint8_t
+{
+    COUNTER, GAUGE,
+};
+
+using Labels = std::vector<std::pair<std::string, std::string> >;
+
+struct Sample
+{
+    std::string name;
+    std::string help;
+    Type type;
+    Labels labels;
+    double value;
+};
+
+/**
+ * Counter values of a thread.
+ */
+struct alignas(CACHE_LINE_SIZE) Slab
+{
+    uint64_t v[CYBOZU_STATS_MAX_COUNTERS];
+    Slab() { ::memset(v, 0, sizeof(v)); }
+};
+
+class Registry
+{
+private:
+    std::mutex slabMutex_;
+    std::vector<Slab *> slabs_;
+    Slab retired_; /* sum of exited threads. */
+    std::vector<size_t> freeIds_;
+    size_t nIds_;
+
+    std::mutex collectorMutex_;
+    std::map<uint64_t, std::function<void(std::vector<Sample> &)> > collectors_;
+    uint64_t nextCollectorId_;
+
+public:
+    Registry() : nIds_(0), nextCollectorId_(0) {}
+    size_t allocId() {
+        std::lock_guard<std::mutex> lk(slabMutex_);
+        if (!freeIds_.empty()) {
+            size_t id = freeIds_.back();
+            freeIds_.pop_back();
+            return id;
+        }
+        if (nIds_ == CYBOZU_STATS_MAX_COUNTERS) {
+            throw std::runtime_error("too many counters.");
+        }
+        return nIds_++;
+    }
+    /**
+     * The counter must not be used by any thread.
+     */
+    void freeId(size_t id) {
+        std::lock_guard<std::mutex> lk(slabMutex_);
+        retired_.v[id] = 0;
+        for (Slab *s : slabs_) __atomic_store_n(&s->v[id], 0, __ATOMIC_RELAXED);
+        freeIds_.push_back(id);
+    }
+    uint64_t read(size_t id) {
+        std::lock_guard<std::mutex> lk(slabMutex_);
+        uint64_t total = retired_.v[id];
+        for (Slab *s : slabs_) total += __atomic_load_n(&s->v[id], __ATOMIC_RELAXED);
+        return total;
+    }
+    void addSlab(Slab *s) {
+        std::lock_guard<std::mutex> lk(slabMutex_);
+        slabs_.push_back(s);
+    }
+    void removeSlab(Slab *s) {
+        std::lock_guard<std::mutex> lk(slabMutex_);
+        for (size_t i = 0; i < nIds_; i++) retired_.v[i] += s->v[i];
+        slabs_.erase(std::remove(slabs_.begin(), slabs_.end(), s), slabs_.end());
+    }
+    uint64_t addCollector(const std::function<void(std::vector<Sample> &)> &func) {
+        std::lock_guard<std::mutex> lk(collectorMutex_);
+        uint64_t id = nextCollectorId_++;
+        collectors_[id] = func;
+        return id;
+    }
+    void removeCollector(uint64_t id) {
+        std::lock_guard<std::mutex> lk(collectorMutex_);
+        collectors_.erase(id);
+    }
+    /**
+     * Samples are sorted by name.
+     */
+    std::vector<Sample> collect() {
+        std::vector<Sample> v;
+        {
+            std::lock_guard<std::mutex> lk(collectorMutex_);
+            for (auto &pair : collectors_) pair.second(v);
+        }
+        std::stable_sort(v.begin(), v.end(), [](const Sample &a, const Sample &b) {
+                return a.name < b.name;
+            });
+        return v;
+    }
+};
+
+static inline Registry &registry()
+{
+    static Registry r;
+    return r;
+}
+
+/**
+ * Slab of the calling thread.
+ */
+static inline Slab &localSlab()
+{
+    struct Holder
+    {
+        Slab slab;
+        Holder() { registry().addSlab(&slab); }
+        ~Holder() noexcept { registry().removeSlab(&slab); }
+    };
+    static thread_local Holder holder;
+    return holder.slab;
+}
+
+/**
+ * Per-thread counter.
+ * add() does not cause any cache line transfer between cores.
+ */
+class Counter
+{
+private:
+    const size_t id_;
+public:
+    Counter() : id_(registry().allocId()) {}
+    ~Counter() noexcept { registry().freeId(id_); }
+    Counter(const Counter &) = delete;
+    Counter &operator=(const Counter &) = delete;
+    void add(uint64_t n = 1) {
+        uint64_t &v = localSlab().v[id_];
+        __atomic_store_n(&v, v + n, __ATOMIC_RELAXED);
+    }
+    uint64_t value() const {
+        return registry().read(id_);
+    }
+};
+
+/**
+ * Registration of a collector. It is removed at destruction.
+ */
+class Collector
+{
+private:
+    const uint64_t id_;
+public:
+    explicit Collector(const std::function<void(std::vector<Sample> &)> &func)
+        : id_(registry().addCollector(func)) {}
+    ~Collector() noexcept { registry().removeCollector(id_); }
+    Collector(const Collector &) = delete;
+    Collector &operator=(const Collector &) = delete;
+};
+
+static inline std::vector<Sample> collect()
+{
+    return registry().collect();
+}
+
+/**
+ * Helper for collector functions.
+ */
+static inline void addSample(
+    std::vector<Sample> &v, const std::string &name, const std::string &help,
+    Type type, const Labels &labels, double value)
+{
+    v.push_back(Sample{name, help, type, labels, value});
+}
+
+namespace local {
+
+static inline std::string escape(const std::string &s)
+{
+    std::string ret;
+    for (char c : s) {
+        if (c == '\\' || c == '"') ret += '\\';
+        if (c == '\n') {
+            ret += "\\n";
+            continue;
+        }
+        ret += c;
+    }
+    return ret;
+}
+
+static inline std::string formatDouble(double v)
+{
+    char buf[64];
+    ::snprintf(buf, sizeof(buf), "%.17g", v);
+    return buf;
+}
+
+} //namespace local
+
+/**
+ * Prometheus text exposition format.
+ */
+static inline std::string toPrometheus(const std::vector<Sample> &v)
+{
+    std::string s;
+    for (size_t i = 0; i < v.size(); i++) {
+        const Sample &x = v[i];
+        if (i == 0 || v[i - 1].name != x.name) {
+            s += "# HELP " + x.name + " " + x.help + "\n";
+            s += "# TYPE " + x.name + (x.type == Type::COUNTER ? " counter\n" : " gauge\n");
+        }
+        s += x.name;
+        if (!x.labels.empty()) {
+            s += "{";
+            for (size_t j = 0; j < x.labels.size(); j++) {
+                if (j != 0) s += ",";
+                s += x.labels[j].first + "=\"" + local::escape(x.labels[j].second) + "\"";
+            }
+            s += "}";
+        }
+        s += " " + local::formatDouble(x.value) + "\n";
+    }
+    return s;
+}
+
+static inline std::string toJson(const std::vector<Sample> &v)
+{
+    std::string s = "[";
+    for (size_t i = 0; i < v.size(); i++) {
+        const Sample &x = v[i];
+        if (i != 0) s += ",";
+        s += "\n{\"name\":\"" + x.name + "\",\"type\":\"";
+        s += x.type == Type::COUNTER ? "counter" : "gauge";
+        s += "\",\"labels\":{";
+        for (size_t j = 0; j < x.labels.size(); j++) {
+            if (j != 0) s += ",";
+            s += "\"" + local::escape(x.labels[j].first) + "\":\""
+                + local::escape(x.labels[j].second) + "\"";
+        }
+        s += "},\"value\":" + local::formatDouble(x.value) + "}";
+    }
+    s += "\n]\n";
+    return s;
+}
+
+/**
+ * Write the registry periodically to a file (replaced atomically by rename)
+ * and/or serve it to each connection of a Unix domain socket.
+ * The thread runs with SCHED_IDLE if possible.
+ */
+class Exporter
+{
+public:
+    struct Option
+    {
+        std::string filePath; /* empty to disable. */
+        std::string socketPath; /* empty to disable. */
+        size_t intervalMs; /* interval of file writing. */
+        bool isJson; /* Prometheus text if false. */
+        Option() : intervalMs(1000), isJson(false) {}
+    };
+private:
+    const Option opt_;
+    int sockFd_;
+    std::atomic<bool> isEnd_;
+    std::thread thread_;
+
+public:
+    explicit Exporter(const Option &opt)
+        : opt_(opt), sockFd_(-1), isEnd_(false) {
+        if (!opt_.socketPath.empty()) listen();
+        thread_ = std::thread([this]() { run(); });
+    }
+    ~Exporter() noexcept {
+        isEnd_.store(true);
+        thread_.join();
+        if (sockFd_ >= 0) {
+            ::close(sockFd_);
+            ::unlink(opt_.socketPath.c_str());
+        }
+    }
+    Exporter(const Exporter &) = delete;
+    Exporter &operator=(const Exporter &) = delete;
+
+private:
+    std::string serialize() const {
+        std::vector<Sample> v = collect();
+        return opt_.isJson ? toJson(v) : toPrometheus(v);
+    }
+    void listen() {
+        struct sockaddr_un addr;
+        ::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (opt_.socketPath.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("too long socket path: " + opt_.socketPath);
+        }
+        ::strncpy(addr.sun_path, opt_.socketPath.c_str(), sizeof(addr.sun_path) - 1);
+        sockFd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sockFd_ < 0) throw std::system_error(errno, std::system_category(), "socket");
+        ::unlink(opt_.socketPath.c_str());
+        if (::bind(sockFd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            ::listen(sockFd_, 16) != 0) {
+            int err = errno;
+            ::close(sockFd_);
+            sockFd_ = -1;
+            throw std::system_error(err, std::system_category(), "bind/listen " + opt_.socketPath);
+        }
+    }
+    void run() noexcept {
+        struct sched_param param;
+        ::memset(&param, 0, sizeof(param));
+        ::pthread_setschedparam(::pthread_self(), SCHED_IDLE, &param);
+
+        auto next = std::chrono::steady_clock::now();
+        while (!isEnd_.load()) {
+            auto now = std::chrono::steady_clock::now();
+            if (!opt_.filePath.empty() && next <= now) {
+                writeFile();
+                next = now + std::chrono::milliseconds(opt_.intervalMs);
+            }
+            if (sockFd_ < 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            struct pollfd pfd;
+            pfd.fd = sockFd_;
+            pfd.events = POLLIN;
+            if (::poll(&pfd, 1, 10) == 1) serve();
+        }
+    }
+    void writeFile() {
+        std::string tmp = opt_.filePath + ".tmp";
+        ::FILE *fp = ::fopen(tmp.c_str(), "w");
+        if (!fp) return;
+        std::string s = serialize();
+        bool ok = ::fwrite(s.data(), 1, s.size(), fp) == s.size();
+        ok = (::fclose(fp) == 0) && ok;
+        if (ok) ::rename(tmp.c_str(), opt_.filePath.c_str());
+    }
+    void serve() {
+        int fd = ::accept4(sockFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) return;
+        std::string s = serialize();
+        size_t off = 0;
+        while (off < s.size()) {
+            ssize_t r = ::write(fd, s.data() + off, s.size() - off);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            off += r;
+        }
+        ::close(fd);
+    }
+};
+
+}} //namespace cybozu::stats
@@ -1,14 +1,24 @@
 #include <cstdio>
 #include <iostream>
 #include <map>
+#include <set>
+#include <thread>
+#include <vector>
 #include "random.hpp"
+#include "random_batch.hpp"
 #include "btree.hpp"
+#include "blink_tree.hpp"
+#include "mvcc.hpp"
+#include "usl.hpp"
 #include "time.hpp"
+#include "memory_usage.hpp"
+#include "alloc_count.hpp"
+#include "counter.hpp"
 
 template <typename IntT>
 struct CompareInt
 {
-    bool operator()(const void *keyPtr0, UNUSED uint16_t keySize0,
+    int operator()(const void *keyPtr0, UNUSED uint16_t keySize0,
                     const void *keyPtr1, UNUSED uint16_t keySize1) const {
         const IntT &i0 = *reinterpret_cast<const IntT *>(keyPtr0);
         const IntT &i1 = *reinterpret_cast<const IntT *>(keyPtr1);
@@ -96,6 +106,85 @@ void testPage1()
         ++it0;
         ++it1;
     }
+    delete p.first;
+    delete p.second;
+}
+
+/**
+ * Erased records are reused by insertions without gc().
+ */
+void testPage2()
+{
+    cybozu::util::Random<uint32_t> rand(0, 100000);
+    Page<uint32_t> page;
+    page.header().level = 0;
+
+    /* Fixed size records. */
+    std::map<uint32_t, uint32_t> m;
+    while (page.canInsert(sizeof(uint32_t) * 2)) {
+        const uint32_t k = rand();
+        if (page.insert(k, k)) m[k] = k;
+    }
+    UNUSED const uint64_t nGc0 = cybozu::pageStats().nGc.value();
+    for (size_t i = 0; i < 10000; i++) {
+        auto it = m.lower_bound(rand());
+        if (it == m.end()) it = m.begin();
+        UNUSED bool ret = page.erase(it->first);
+        assert(ret);
+        m.erase(it);
+        uint32_t k;
+        do { k = rand(); } while (m.count(k) == 1);
+        ret = page.insert(k, k + 1);
+        assert(ret);
+        m[k] = k + 1;
+    }
+    assert(cybozu::pageStats().nGc.value() == nGc0);
+    assert(page.isValid());
+    assert(page.numRecords() == m.size());
+    auto it = m.begin();
+    for (auto it0 = page.cBegin(); it0 != page.cEnd(); ++it0, ++it) {
+        assert(it0.key<uint32_t>() == it->first && it0.value<uint32_t>() == it->second);
+    }
+
+    /* Variable size records. gc() is called only when no free block fits. */
+    page.clear();
+    page.header().level = 0;
+    std::map<uint32_t, std::string> m1;
+    size_t nGc = 0;
+    for (size_t i = 0; i < 10000; i++) {
+        const uint32_t k = rand();
+        if (m1.count(k) == 1) {
+            UNUSED bool ret = page.erase(k);
+            assert(ret);
+            m1.erase(k);
+            continue;
+        }
+        const std::string v(4 + rand() % 29, char('a' + k % 26));
+        const uint16_t size = sizeof(k) + v.size();
+        if (!page.canInsert(size) && page.shouldGc()) {
+            page.gc();
+            nGc++;
+        }
+        if (!page.canInsert(size)) {
+            /* Make room. */
+            auto it1 = m1.begin();
+            UNUSED bool ret = page.erase(it1->first);
+            assert(ret);
+            m1.erase(it1);
+            continue;
+        }
+        UNUSED bool ret = page.insert(&k, sizeof(k), v.data(), v.size());
+        assert(ret);
+        m1[k] = v;
+        assert(page.isValid());
+    }
+    assert(page.numRecords() == m1.size());
+    auto it1 = m1.begin();
+    for (auto it0 = page.begin(); it0 != page.end(); ++it0, ++it1) {
+        assert(it0.key<uint32_t>() == it1->first);
+        assert(std::string((const char *)it0.valuePtr(), it0.valueSize()) == it1->second);
+    }
+    ::printf("testPage2 done (gc %zu)\n", nGc);
 }
 
 template <typename Key, typename T>
@@ -242,6 +331,1071 @@ void testBtreeMap0()
     /* now editing */
 }
 
+/**
+ * Value of a sample in the stats registry.
+ */
+double getStat(const std::string &name, const std::string &mapName = "")
+{
+    for (const cybozu::stats::Sample &x : cybozu::stats::collect()) {
+        if (x.name != name) continue;
+        if (mapName.empty() && x.labels.empty()) return x.value;
+        for (const auto &label : x.labels) {
+            if (label.first == "map" && label.second == mapName) return x.value;
+        }
+    }
+    assert(false);
+    return -1;
+}
+
+void testBtreeMapStats()
+{
+    cybozu::util::Random<uint32_t> rand(0, 100000);
+    cybozu::BtreeMap<uint32_t, uint32_t> m0;
+    for (size_t i = 0; i < 1000; i++) m0.insert(rand(), 0);
+    m0.registerStats("m0");
+    assert(getStat("cybozu_btree_records", "m0") == m0.size());
+    assert(getStat("cybozu_btree_height", "m0") == m0.height());
+
+    for (size_t i = 0; i < 10000; i++) {
+        auto it = m0.lowerBound(rand());
+        if (!it.isEnd()) it.erase();
+        m0.insert(rand(), 0);
+    }
+    assert(getStat("cybozu_btree_records", "m0") == m0.size());
+    assert(getStat("cybozu_btree_height", "m0") == m0.height());
+    /* m0 has all the live pages. */
+    assert(getStat("cybozu_btree_pages", "m0") * cybozu::PAGE_SIZE
+           == getStat("cybozu_btree_page_bytes"));
+    assert(0 < getStat("cybozu_btree_split_total", "m0"));
+
+    std::string text = cybozu::stats::toPrometheus(cybozu::stats::collect());
+    assert(text.find("# TYPE cybozu_btree_records gauge\n") != std::string::npos);
+    assert(text.find("cybozu_btree_height{map=\"m0\"} ") != std::string::npos);
+    std::string json = cybozu::stats::toJson(cybozu::stats::collect());
+    assert(json.find("\"labels\":{\"map\":\"m0\"}") != std::string::npos);
+
+    m0.clear();
+    assert(getStat("cybozu_btree_records", "m0") == 0);
+    assert(getStat("cybozu_btree_height", "m0") == 1);
+    assert(getStat("cybozu_btree_pages", "m0") == 1);
+    m0.unregisterStats();
+    UNUSED size_t n = cybozu::stats::collect().size();
+    assert(n == 4); /* page stats only. */
+    ::printf("testBtreeMapStats done\n");
+}
+
+void testBtreeMapSetOps()
+{
+    using Map = cybozu::BtreeMap<uint32_t, uint32_t>;
+    using RefMap = std::map<uint32_t, uint32_t>;
+    cybozu::util::Random<uint32_t> rand(0, 50000);
+
+    /* Builder */
+    {
+        Map m0;
+        RefMap m1;
+        {
+            Map::Builder builder(m0);
+            for (uint32_t i = 0; i < 100000; i += 2) {
+                builder.append(i, i + 1);
+                m1.insert(std::make_pair(i, i + 1));
+            }
+            builder.finish();
+        }
+        assert(m0.isValid());
+        assert(3 <= m0.height());
+        checkEquality(m0, m1);
+        for (uint32_t i = 1; i < 1000; i += 2) {
+            m0.insert(i, i);
+            m1.insert(std::make_pair(i, i));
+        }
+        assert(m0.isValid());
+        checkEquality(m0, m1);
+
+        Map m2;
+        Map::Builder builder(m2);
+        builder.append(1, 0);
+        UNUSED bool isThrown = false;
+        try {
+            builder.append(1, 0);
+        } catch (std::exception &) {
+            isThrown = true;
+        }
+        assert(isThrown);
+    }
+
+    /* Set operations against std::map. Sizes cover the in-place paths. */
+    const std::vector<std::pair<size_t, size_t> > sizes = {
+        {20000, 20000}, {20000, 500}, {500, 20000}, {0, 1000}, {1000, 0},
+    };
+    for (const auto &sz : sizes) {
+        for (int op = 0; op < 3; op++) {
+            Map a, b;
+            RefMap ra, rb;
+            for (size_t i = 0; i < sz.first; i++) {
+                uint32_t k = rand();
+                a.insert(k, k);
+                ra.insert(std::make_pair(k, k));
+            }
+            for (size_t i = 0; i < sz.second; i++) {
+                uint32_t k = rand();
+                b.insert(k, k + 1);
+                rb.insert(std::make_pair(k, k + 1));
+            }
+            if (op == 0) {
+                a.merge(b);
+                for (const auto &pair : rb) ra[pair.first] = pair.second;
+            } else if (op == 1) {
+                a.intersect(b);
+                for (auto it = ra.begin(); it != ra.end();) {
+                    it = rb.count(it->first) ? std::next(it) : ra.erase(it);
+                }
+            } else {
+                a.subtract(b);
+                for (const auto &pair : rb) ra.erase(pair.first);
+            }
+            assert(a.isValid());
+            checkEquality(a, ra);
+            checkEquality(b, rb);
+        }
+    }
+
+    /* swap */
+    {
+        Map a, b;
+        RefMap ra, rb;
+        for (uint32_t i = 0; i < 5000; i++) {
+            a.insert(i, i);
+            ra.insert(std::make_pair(i, i));
+        }
+        b.insert(7, 7);
+        rb.insert(std::make_pair(7, 7));
+        a.registerStats("swapA");
+        a.swap(b);
+        assert(a.isValid());
+        assert(b.isValid());
+        checkEquality(a, rb);
+        checkEquality(b, ra);
+        assert(getStat("cybozu_btree_records", "swapA") == b.size());
+        b.merge(a);
+        b.subtract(a);
+        assert(getStat("cybozu_btree_records", "swapA") == b.size());
+        assert(getStat("cybozu_btree_height", "swapA") == b.height());
+    }
+    ::printf("testBtreeMapSetOps done\n");
+}
+
+void testBtreeMapSplitConcat()
+{
+    using Map = cybozu::BtreeMap<uint32_t, uint32_t>;
+    using RefMap = std::map<uint32_t, uint32_t>;
+    cybozu::util::Random<uint32_t> rand(0, 1000000);
+
+    /* splitAt against std::map, and concat back. */
+    const std::vector<size_t> sizes = {0, 1, 100, 3000, 100000};
+    for (size_t n : sizes) {
+        Map m0;
+        RefMap r0;
+        for (size_t i = 0; i < n; i++) {
+            uint32_t k = rand();
+            m0.insert(k, k + 1);
+            r0.insert(std::make_pair(k, k + 1));
+        }
+        const std::vector<uint32_t> keys = {0, 1000001, rand(), rand(), rand()};
+        for (uint32_t key : keys) {
+            Map m1 = m0.splitAt(key);
+            RefMap r1(r0.lower_bound(key), r0.end());
+            RefMap rl(r0.begin(), r0.lower_bound(key));
+            assert(m0.isValid());
+            assert(m1.isValid());
+            checkEquality(m0, rl);
+            checkEquality(m1, r1);
+            m0.concat(std::move(m1));
+            assert(m1.empty());
+            assert(m0.isValid());
+            checkEquality(m0, r0);
+        }
+    }
+
+    /* concat trees of different heights in both orders. */
+    const std::vector<std::pair<size_t, size_t> > heights = {
+        {100000, 10}, {10, 100000}, {100000, 3000}, {3000, 100000}, {50000, 50000},
+    };
+    for (const auto &sz : heights) {
+        Map a, b;
+        RefMap r;
+        for (uint32_t i = 0; i < sz.first; i++) {
+            a.insert(i, i);
+            r.insert(std::make_pair(i, i));
+        }
+        for (uint32_t i = 0; i < sz.second; i++) {
+            b.insert(sz.first + i, i);
+            r.insert(std::make_pair(sz.first + i, i));
+        }
+        a.concat(std::move(b));
+        assert(b.empty());
+        assert(a.isValid());
+        checkEquality(a, r);
+        a.insert(uint32_t(sz.first + sz.second), 0);
+        a.erase(0);
+        assert(a.isValid());
+    }
+
+    /* keys must be in order. */
+    {
+        Map a, b;
+        a.insert(10, 0);
+        b.insert(10, 0);
+        UNUSED bool isThrown = false;
+        try {
+            a.concat(std::move(b));
+        } catch (std::exception &) {
+            isThrown = true;
+        }
+        assert(isThrown);
+        assert(a.size() == 1 && b.size() == 1);
+    }
+
+    /* stats follow the records, pages and height. */
+    {
+        Map a;
+        for (uint32_t i = 0; i < 100000; i++) a.insert(i, i);
+        a.registerStats("splitA");
+        Map b = a.splitAt(30000);
+        assert(getStat("cybozu_btree_records", "splitA") == a.size());
+        assert(getStat("cybozu_btree_height", "splitA") == a.height());
+        b.registerStats("splitB");
+        a.concat(std::move(b));
+        assert(getStat("cybozu_btree_records", "splitA") == a.size());
+        assert(getStat("cybozu_btree_height", "splitA") == a.height());
+        assert(getStat("cybozu_btree_records", "splitB") == 0);
+        assert(getStat("cybozu_btree_pages", "splitB") == 1);
+    }
+    /* repeated repartition keeps the height and the pages bounded. */
+    {
+        Map a;
+        for (size_t i = 0; i < 95000; i++) a.insert(rand(), 0);
+        a.registerStats("repartition");
+        UNUSED const size_t height0 = a.height();
+        UNUSED const size_t nPages0 = getStat("cybozu_btree_pages", "repartition");
+        for (size_t i = 0; i < 2000; i++) {
+            Map b = a.splitAt(rand());
+            a.concat(std::move(b));
+            assert(a.height() <= height0 + 1);
+        }
+        assert(a.isValid());
+        assert(a.height() <= height0 + 1);
+        assert(getStat("cybozu_btree_pages", "repartition") <= nPages0 + nPages0 / 10);
+    }
+    ::printf("testBtreeMapSplitConcat done\n");
+}
+
+/**
+ * The first record in the key order. Not commutative.
+ */
+struct FirstAggregate
+{
+    using Value = std::pair<bool, uint32_t>;
+    static Value identity() { return Value(false, 0); }
+    static Value of(const uint32_t &key, const uint32_t &) { return Value(true, key); }
+    static Value combine(const Value &a, const Value &b) { return a.first ? a : b; }
+};
+
+template <typename Map>
+void checkAggregate(const Map &m0, const std::map<uint32_t, uint32_t> &m1, uint32_t lo, uint32_t hi)
+{
+    using Agg = typename Map::AggValue;
+    Agg v = Agg();
+    for (auto it = m1.lower_bound(lo); it != m1.end() && it->first < hi; ++it) {
+        v = v + it->second;
+    }
+    if (hi <= lo) v = Agg();
+    if (m0.aggregate(lo, hi) != v) {
+        std::cout << "aggregate different: [" << lo << ", " << hi << ") "
+                  << m0.aggregate(lo, hi) << " " << v << std::endl;
+        ::exit(1);
+    }
+}
+
+void testBtreeMapAggregate()
+{
+    using Map = cybozu::BtreeMap<uint32_t, uint32_t, std::less<uint32_t>, cybozu::SumAggregate<uint64_t> >;
+    using RefMap = std::map<uint32_t, uint32_t>;
+    cybozu::util::Random<uint32_t> rand(0, 100000);
+    Map m0;
+    RefMap m1;
+    auto checkRandomRanges = [&]() {
+        checkAggregate(m0, m1, 0, 100001);
+        for (size_t i = 0; i < 100; i++) checkAggregate(m0, m1, rand(), rand());
+        uint64_t total = 0;
+        for (const auto &pair : m1) total += pair.second;
+        assert(m0.aggregate() == total);
+    };
+
+    /* Insertion with splits, and erasure with merges. */
+    for (size_t i = 0; i < 50000; i++) {
+        uint32_t k = rand();
+        m0.insert(k, k % 100);
+        m1.insert(std::make_pair(k, k % 100));
+    }
+    checkRandomRanges();
+    for (size_t i = 0; i < 20000; i++) {
+        auto it = m0.lowerBound(rand());
+        if (it.isEnd()) continue;
+        m1.erase(it.key());
+        it.erase();
+    }
+    assert(m0.isValid());
+    checkRandomRanges();
+
+    /* Set operations, split and concat. */
+    Map m2;
+    RefMap m3;
+    for (size_t i = 0; i < 300; i++) {
+        uint32_t k = rand();
+        m2.insert(k, 1000);
+        m3.insert(std::make_pair(k, 1000));
+    }
+    m0.merge(m2);
+    for (const auto &pair : m3) m1[pair.first] = pair.second;
+    checkRandomRanges();
+    m0.subtract(m2);
+    for (const auto &pair : m3) m1.erase(pair.first);
+    checkRandomRanges();
+    Map m4 = m0.splitAt(50000);
+    checkAggregate(m4, RefMap(m1.lower_bound(50000), m1.end()), 0, 100001);
+    checkAggregate(m0, RefMap(m1.begin(), m1.lower_bound(50000)), 0, 100001);
+    m0.concat(std::move(m4));
+    checkRandomRanges();
+    m0.clear();
+    m1.clear();
+    checkRandomRanges();
+
+    /* Bulk load, and set operations rebuilt by Builder with many branch pages. */
+    for (size_t i = 0; i < 30000; i++) {
+        uint32_t k = rand();
+        m1.insert(std::make_pair(k, k % 100));
+    }
+    {
+        Map::Builder builder(m0);
+        for (const auto &pair : m1) builder.append(pair.first, pair.second);
+        builder.finish();
+    }
+    checkRandomRanges();
+    Map m6;
+    RefMap m7;
+    for (size_t i = 0; i < 30000; i++) {
+        uint32_t k = rand();
+        m6.insert(k, k % 10);
+        m7.insert(std::make_pair(k, k % 10));
+    }
+    m0.merge(m6);
+    for (const auto &pair : m7) m1[pair.first] = pair.second;
+    checkRandomRanges();
+    m0.subtract(m6);
+    for (const auto &pair : m7) m1.erase(pair.first);
+    checkRandomRanges();
+    m0.merge(m6);
+    for (const auto &pair : m7) m1[pair.first] = pair.second;
+    m0.intersect(m6);
+    m1 = m7;
+    checkRandomRanges();
+    m0.clear();
+    m1.clear();
+
+    /* Not commutative policy. */
+    cybozu::BtreeMap<uint32_t, uint32_t, std::less<uint32_t>, FirstAggregate> m5;
+    for (uint32_t i = 0; i < 100000; i++) m5.insert(i * 7 % 100000, 0);
+    for (size_t i = 0; i < 1000; i++) {
+        uint32_t lo = rand(), hi = rand();
+        auto v = m5.aggregate(lo, hi);
+        assert(v.first == (lo < hi));
+        if (v.first) assert(v.second == lo);
+    }
+    assert(m5.aggregate().second == 0);
+    ::printf("testBtreeMapAggregate done\n");
+}
+
+/**
+ * Child and parent references between pages.
+ * make PAGE_ID=1 to check the page ID mode.
+ */
+void testPageRef()
+{
+    using Map = cybozu::BtreeMap<uint32_t, uint32_t>;
+#ifdef CYBOZU_BTREE_PAGE_ID
+    const size_t n0 = cybozu::pageTable().size();
+#endif
+    {
+        Map m;
+        for (uint32_t i = 0; i < 100000; i++) m.insert(i * 7 % 100000, i);
+        assert(3 <= m.height());
+        std::set<const void *> pages;
+        for (auto pit = m.beginPage(); !pit.isEnd(); ++pit) {
+            auto *p = pit.page();
+            while (!p->isRoot()) {
+                if (!pages.insert(p).second) break;
+                auto *parent = p->parent();
+                UNUSED bool found = false;
+                for (auto it = parent->begin(); it != parent->end(); ++it) {
+                    if (it.childPage() == p) found = true;
+                }
+                assert(found);
+                p = parent;
+            }
+        }
+#ifdef CYBOZU_BTREE_PAGE_ID
+        /* the root is referred by the parent fields of its children. */
+        assert(cybozu::pageTable().size() == n0 + pages.size() + 1);
+#endif
+        ::printf("pages %zu height %zu\n", pages.size() + 1, m.height());
+    }
+#ifdef CYBOZU_BTREE_PAGE_ID
+    assert(cybozu::pageTable().size() == n0);
+#endif
+    ::printf("testPageRef done\n");
+}
+
+void testBtreeMapTopDown()
+{
+    using Map = cybozu::BtreeMap<uint32_t, uint32_t, std::less<uint32_t>, cybozu::SumAggregate<uint64_t> >;
+    cybozu::util::Random<uint32_t> rand(0, 100000);
+    Map m0;
+    std::map<uint32_t, uint32_t> m1;
+    m0.setTopDown(true);
+    assert(m0.isTopDown());
+
+    /* Insertion and erasure against std::map. */
+    for (size_t i = 0; i < 200000; i++) {
+        const uint32_t k = rand();
+        UNUSED bool ret0, ret1;
+        if (i % 3 != 2) {
+            ret0 = m0.insert(k, k % 100);
+            ret1 = m1.insert(std::make_pair(k, k % 100)).second;
+        } else {
+            ret0 = m0.erase(k);
+            ret1 = m1.erase(k) == 1;
+        }
+        assert(ret0 == ret1);
+    }
+    assert(m0.isValid());
+    assert(m0.size() == m1.size());
+    checkAggregate(m0, m1, 0, 100001);
+    for (size_t i = 0; i < 100; i++) checkAggregate(m0, m1, rand(), rand());
+
+    /* Erasure through iterators. */
+    for (size_t i = 0; i < 20000; i++) {
+        auto it = m0.lowerBound(rand());
+        if (it.isEnd()) continue;
+        const uint32_t k = it.key();
+        m1.erase(k);
+        it.erase();
+        UNUSED auto it1 = m1.lower_bound(k);
+        assert(it.isEnd() == (it1 == m1.end()));
+        if (!it.isEnd()) assert(it.key() == it1->first);
+    }
+    assert(m0.isValid());
+    checkAggregate(m0, m1, 0, 100001);
+
+    /* Switching the mode in the middle. */
+    m0.setTopDown(false);
+    for (size_t i = 0; i < 50000; i++) {
+        const uint32_t k = rand();
+        m0.insert(k, 1);
+        m1.insert(std::make_pair(k, 1));
+    }
+    m0.setTopDown(true);
+    while (!m1.empty()) {
+        const uint32_t k = m1.begin()->first;
+        UNUSED bool ret = m0.erase(k);
+        assert(ret);
+        m1.erase(k);
+        if (m1.size() % 10000 == 0) assert(m0.isValid());
+    }
+    assert(m0.empty());
+    assert(m0.height() == 1);
+    assert(m0.isValid());
+    ::printf("testBtreeMapTopDown done\n");
+}
+
+void testBtreeMapApplyBatch()
+{
+    using Map = cybozu::BtreeMap<uint32_t, uint32_t, std::less<uint32_t>, cybozu::SumAggregate<uint64_t> >;
+    using Op = Map::BatchOp;
+    cybozu::util::Random<uint32_t> rand(0, 100000);
+    Map m0;
+    std::map<uint32_t, uint32_t> m1;
+    m0.registerStats("batch");
+    for (size_t batchSize : {1, 10, 1000, 30000}) {
+        for (size_t i = 0; i < 300000 / batchSize; i++) {
+            std::vector<Op> ops;
+            for (size_t j = 0; j < batchSize; j++) {
+                const uint32_t k = rand();
+                const Op::Type type = Op::Type(k % 3);
+                ops.push_back(Op{type, k, uint32_t(i)});
+            }
+            /* Erase a range sometimes to make empty leaves. */
+            if (i % 7 == 0) {
+                const uint32_t k0 = rand();
+                for (uint32_t k = k0; k < k0 + 300; k++) ops.push_back(Op{Op::ERASE, k, 0});
+            }
+            size_t nChanged = 0;
+            for (const Op &op : ops) {
+                if (op.type == Op::INSERT) {
+                    nChanged += m1.insert(std::make_pair(op.key, op.value)).second;
+                } else if (op.type == Op::UPSERT) {
+                    m1[op.key] = op.value;
+                    nChanged++;
+                } else {
+                    nChanged += m1.erase(op.key);
+                }
+            }
+            UNUSED size_t ret = m0.applyBatch(ops);
+            assert(ret == nChanged);
+        }
+        assert(m0.isValid());
+        assert(m0.size() == m1.size());
+        assert(getStat("cybozu_btree_records", "batch") == m1.size());
+        checkAggregate(m0, m1, 0, 100001);
+        for (size_t i = 0; i < 100; i++) checkAggregate(m0, m1, rand(), rand());
+        auto it0 = m0.beginItem();
+        for (UNUSED const auto &pair : m1) {
+            assert(it0.key() == pair.first && it0.value() == pair.second);
+            ++it0;
+        }
+        assert(it0.isEnd());
+    }
+
+    /* Erase all. */
+    std::vector<Op> ops;
+    for (const auto &pair : m1) ops.push_back(Op{Op::ERASE, pair.first, 0});
+    UNUSED size_t ret = m0.applyBatch(ops);
+    assert(ret == m1.size());
+    assert(m0.empty());
+    assert(m0.height() == 1);
+    assert(m0.isValid());
+    ::printf("testBtreeMapApplyBatch done\n");
+}
+
+void testBlinkTreeMap()
+{
+    using Map = cybozu::BlinkTreeMap<uint32_t, uint32_t>;
+    cybozu::util::Random<uint32_t> rand(0, 100000);
+
+    /* Single thread against std::map. */
+    {
+        Map m0;
+        std::map<uint32_t, uint32_t> m1;
+        for (size_t i = 0; i < 200000; i++) {
+            const uint32_t k = rand();
+            const int op = i % 4;
+            UNUSED bool ret0, ret1;
+            if (op <= 1) {
+                ret0 = m0.insert(k, k + 1);
+                ret1 = m1.insert(std::make_pair(k, k + 1)).second;
+            } else if (op == 2) {
+                ret0 = m0.erase(k);
+                ret1 = m1.erase(k) == 1;
+            } else {
+                ret0 = m0.update(k, k + 2);
+                auto it = m1.find(k);
+                ret1 = it != m1.end();
+                if (ret1) it->second = k + 2;
+            }
+            assert(ret0 == ret1);
+        }
+        assert(m0.isValid());
+        assert(2 <= m0.height());
+        assert(m0.size() == m1.size());
+        for (size_t i = 0; i < 10000; i++) {
+            const uint32_t k = rand();
+            uint32_t v0, k1;
+            UNUSED auto it = m1.lower_bound(k);
+            UNUSED bool ret = m0.lowerBound(k, k1, v0);
+            assert(ret == (it != m1.end()));
+            if (ret) assert(k1 == it->first && v0 == it->second);
+            ret = m0.find(k, v0);
+            assert(ret == (m1.count(k) == 1));
+        }
+        for (size_t i = 0; i < 100; i++) {
+            auto it = m1.lower_bound(rand());
+            m0.scan(it == m1.end() ? 100001 : it->first, [&](UNUSED uint32_t k, UNUSED uint32_t v) {
+                    assert(it != m1.end() && k == it->first && v == it->second);
+                    ++it;
+                    return it != m1.end() && it->first % 16 != 0;
+                });
+        }
+        size_t n = 0;
+        m0.scan([&](uint32_t, uint32_t) { n++; return true; });
+        assert(n == m1.size());
+        for (const auto &pair : m1) m0.erase(pair.first);
+        assert(m0.empty());
+        uint32_t k1, v0;
+        UNUSED bool found = m0.lowerBound(0, k1, v0);
+        assert(!found);
+    }
+
+    /* Concurrent writers with disjoint keys and readers. */
+    {
+        Map m0;
+        const size_t nWriters = 4, nKeys = 50000;
+        std::atomic<bool> isEnd(false);
+        std::vector<std::thread> writers, readers;
+        for (size_t t = 0; t < nWriters; t++) {
+            writers.emplace_back([&, t]() {
+                    for (uint32_t i = 0; i < nKeys; i++) m0.insert(i * nWriters + t, t);
+                    for (uint32_t i = 0; i < nKeys; i += 2) m0.erase(i * nWriters + t);
+                });
+        }
+        for (size_t t = 0; t < 2; t++) {
+            readers.emplace_back([&]() {
+                    cybozu::util::Random<uint32_t> rand0(0, nKeys * nWriters);
+                    while (!isEnd.load()) {
+                        uint32_t k = rand0(), k1, v;
+                        if (m0.find(k, v)) assert(v == k % nWriters);
+                        if (m0.lowerBound(k, k1, v)) assert(k <= k1 && v == k1 % nWriters);
+                    }
+                });
+        }
+        for (std::thread &th : writers) th.join();
+        isEnd = true;
+        for (std::thread &th : readers) th.join();
+        assert(m0.isValid());
+        assert(m0.size() == nWriters * nKeys / 2);
+        for (uint32_t k = 0; k < nKeys * nWriters; k++) {
+            uint32_t v;
+            UNUSED bool ret = m0.find(k, v);
+            assert(ret == ((k / nWriters) % 2 == 1));
+        }
+    }
+    ::printf("testBlinkTreeMap done\n");
+}
+
+void testBlinkTreeMapTransaction()
+{
+    using Map = cybozu::BlinkTreeMap<uint32_t, uint32_t>;
+    cybozu::util::Random<uint32_t> rand(0, 100000);
+
+    /* Single thread against std::map. */
+    {
+        Map m0;
+        std::map<uint32_t, uint32_t> m1;
+        Map::Transaction tx(m0);
+        /* Splits of the root leaf and of the new leaves in one commit. */
+        for (uint32_t k = 0; k < 1000; k++) {
+            tx.put(k * 2, k);
+            m1[k * 2] = k;
+        }
+        UNUSED bool ret = tx.commit();
+        assert(ret);
+        assert(m0.isValid() && 2 <= m0.height());
+        for (size_t i = 0; i < 10000; i++) {
+            const uint32_t k0 = rand(), k1 = rand();
+            uint32_t v;
+            UNUSED bool found = tx.find(k0, v);
+            assert(found == (m1.count(k0) == 1));
+            tx.put(k1, k0);
+            tx.erase(k0);
+            found = tx.find(k0, v);
+            assert(!found);
+            if (k0 != k1) {
+                found = tx.find(k1, v);
+                assert(found && v == k0);
+            }
+            tx.put(k0 + 1, k1);
+            ret = tx.commit();
+            assert(ret);
+            m1[k1] = k0;
+            m1.erase(k0);
+            m1[k0 + 1] = k1;
+        }
+        assert(m0.isValid());
+        assert(m0.size() == m1.size());
+        for (const auto &pair : m1) {
+            uint32_t v;
+            ret = m0.find(pair.first, v);
+            assert(ret && v == pair.second);
+        }
+
+        /* Conflicts on an existing key and on an absent key. */
+        const uint32_t k0 = m1.begin()->first;
+        UNUSED uint32_t v;
+        ret = tx.find(k0, v);
+        assert(ret);
+        tx.put(k0 + 200000, 0);
+        m0.update(k0, 0);
+        ret = tx.commit();
+        assert(!ret);
+        ret = m0.find(k0 + 200000, v);
+        assert(!ret);
+        ret = tx.find(200001, v);
+        assert(!ret);
+        tx.put(200003, 0);
+        m0.insert(200001, 0);
+        ret = tx.commit();
+        assert(!ret);
+        ret = m0.find(200003, v);
+        assert(!ret);
+        ret = tx.find(200001, v);
+        assert(ret && v == 0);
+        tx.put(200001, 1);
+        ret = tx.commit();
+        assert(ret);
+        ret = m0.find(200001, v);
+        assert(ret && v == 1);
+    }
+
+    /*
+     * Writers move a record within a slot of 16 keys or transfer an amount between slots.
+     * Readers sum all the keys in a transaction.
+     */
+    {
+        Map m0;
+        const uint32_t nSlots = 200, initial = 100;
+        for (uint32_t i = 0; i < nSlots; i++) m0.insert(i * 16, initial);
+        /* The record of the slot. */
+        auto findSlot = [&](Map::Transaction &tx, uint32_t i, uint32_t &k, uint32_t &v) {
+            uint32_t v0;
+            if (!m0.lowerBound(i * 16, k, v0) || (i + 1) * 16 <= k) return false;
+            return tx.find(k, v);
+        };
+        std::atomic<bool> isEnd(false);
+        std::atomic<size_t> nCommits(0), nAborts(0);
+        std::vector<std::thread> writers, readers;
+        for (size_t t = 0; t < 3; t++) {
+            writers.emplace_back([&, t]() {
+                    cybozu::util::Random<uint32_t> rand0(0, nSlots - 1);
+                    Map::Transaction tx(m0);
+                    for (size_t n = 0; n < 10000;) {
+                        const uint32_t i = rand0();
+                        uint32_t k0, v0, k1, v1;
+                        if (!findSlot(tx, i, k0, v0)) {
+                            tx.clear();
+                            continue;
+                        }
+                        if (t == 0) {
+                            tx.erase(k0);
+                            tx.put(i * 16 + (k0 + 1) % 16, v0);
+                        } else {
+                            const uint32_t j = (i + t) % nSlots;
+                            if (v0 == 0 || !findSlot(tx, j, k1, v1)) {
+                                tx.clear();
+                                continue;
+                            }
+                            tx.put(k0, v0 - 1);
+                            tx.put(k1, v1 + 1);
+                        }
+                        if (tx.commit()) {
+                            n++;
+                        } else {
+                            nAborts++;
+                        }
+                    }
+                });
+        }
+        for (size_t t = 0; t < 1; t++) {
+            readers.emplace_back([&]() {
+                    Map::Transaction tx(m0);
+                    while (!isEnd.load()) {
+                        UNUSED uint64_t sum = 0;
+                        UNUSED size_t n = 0;
+                        for (uint32_t k = 0; k < nSlots * 16; k++) {
+                            uint32_t v;
+                            if (tx.find(k, v)) {
+                                sum += v;
+                                n++;
+                            }
+                        }
+                        if (tx.commit()) {
+                            assert(n == nSlots);
+                            assert(sum == uint64_t(nSlots) * initial);
+                            nCommits++;
+                        }
+                    }
+                });
+        }
+        for (std::thread &th : writers) th.join();
+        isEnd = true;
+        for (std::thread &th : readers) th.join();
+        assert(m0.isValid());
+        assert(m0.size() == nSlots);
+        UNUSED uint64_t sum = 0;
+        m0.scan([&](uint32_t, uint32_t v) { sum += v; return true; });
+        assert(sum == uint64_t(nSlots) * initial);
+        ::printf("read commits %zu write aborts %zu\n", nCommits.load(), nAborts.load());
+    }
+
+    /*
+     * Two writers lock overlapping leaves.
+     * A commit adds one to 32 keys spread over the map and inserts a key to split leaves.
+     */
+    {
+        Map m0;
+        const uint32_t nKeys = 4096, nWrites = 32, nCommits = 2000;
+        for (uint32_t i = 0; i < nKeys; i++) m0.insert(i * 2, 0);
+        std::vector<std::thread> writers;
+        for (size_t t = 0; t < 2; t++) {
+            writers.emplace_back([&]() {
+                    cybozu::util::Random<uint32_t> rand0(0, nKeys - 1);
+                    Map::Transaction tx(m0);
+                    for (size_t n = 0; n < nCommits;) {
+                        const uint32_t i0 = rand0();
+                        for (uint32_t j = 0; j < nWrites; j++) {
+                            const uint32_t k = (i0 + j * (nKeys / nWrites)) % nKeys * 2;
+                            uint32_t v = 0;
+                            UNUSED bool found = tx.find(k, v);
+                            assert(found);
+                            tx.put(k, v + 1);
+                        }
+                        tx.put(rand0() * 2 + 1, 0);
+                        if (tx.commit()) n++;
+                    }
+                });
+        }
+        for (std::thread &th : writers) th.join();
+        assert(m0.isValid());
+        UNUSED uint64_t sum = 0;
+        m0.scan([&](uint32_t, uint32_t v) { sum += v; return true; });
+        assert(sum == uint64_t(2) * nCommits * nWrites);
+    }
+    ::printf("testBlinkTreeMapTransaction done\n");
+}
+
+void testMvccMap()
+{
+    using Map = cybozu::MvccMap<uint32_t, uint32_t>;
+
+    /* Snapshot isolation and atomic commits. */
+    {
+        Map m;
+        for (uint32_t k = 0; k < 1000; k++) m.put(k, k);
+        Map::Snapshot s0 = m.snapshot();
+        m.put(1, 100);
+        UNUSED bool ret = m.erase(2);
+        assert(ret);
+        ret = m.erase(2);
+        assert(!ret);
+        ret = m.erase(5000);
+        assert(!ret);
+        m.commit({{3, false, 300}, {4, true, 0}, {5000, false, 5000}});
+        Map::Snapshot s1 = m.snapshot();
+        assert(s0.ts() < s1.ts());
+        UNUSED uint32_t v;
+        ret = s0.find(1, v);
+        assert(ret && v == 1);
+        ret = s0.find(2, v);
+        assert(ret && v == 2);
+        ret = s0.find(4, v);
+        assert(ret && v == 4);
+        ret = s0.find(5000, v);
+        assert(!ret);
+        ret = s1.find(1, v);
+        assert(ret && v == 100);
+        ret = s1.find(2, v);
+        assert(!ret);
+        ret = s1.find(3, v);
+        assert(ret && v == 300);
+        ret = s1.find(4, v);
+        assert(!ret);
+        ret = s1.find(5000, v);
+        assert(ret && v == 5000);
+        UNUSED size_t n0 = 0, n1 = 0;
+        s0.scan([&](UNUSED uint32_t k, UNUSED uint32_t v0) { assert(k == v0); n0++; return true; });
+        s1.scan(2, [&](UNUSED uint32_t k, uint32_t) { assert(k != 2 && k != 4); n1++; return true; });
+        assert(n0 == 1000);
+        assert(n1 == 997);
+
+        /* s0 keeps the old versions. */
+        UNUSED size_t n = m.countVersions();
+        assert(n == 1005);
+        n = m.gc();
+        assert(n == 0);
+        n = m.countVersions();
+        assert(n == 1005);
+        s0 = m.snapshot();
+        /* The old versions are freed and the tombstones are erased from the tree. */
+        n = m.gc();
+        assert(n == 4);
+        n = m.numKeys();
+        assert(n == 999);
+        /* The tombstones are freed after s0 and s1 have gone. */
+        n = m.gc();
+        assert(n == 0);
+        s0 = Map::Snapshot(m.snapshot());
+        s1 = m.snapshot();
+        n = m.gc();
+        assert(n == 2);
+        n = m.countVersions();
+        assert(n == 999);
+        ret = s1.find(2, v);
+        assert(!ret);
+        ret = s1.find(3, v);
+        assert(ret && v == 300);
+    }
+
+    /* Readers see a constant sum while a writer moves amounts between keys. */
+    {
+        Map m;
+        const uint32_t nKeys = 1000, initial = 100;
+        for (uint32_t k = 0; k < nKeys; k++) m.put(k, initial);
+        m.startGc(1);
+        std::atomic<bool> isEnd(false);
+        std::vector<std::thread> readers;
+        for (size_t t = 0; t < 2; t++) {
+            readers.emplace_back([&]() {
+                    while (!isEnd.load()) {
+                        Map::Snapshot s = m.snapshot();
+                        UNUSED uint64_t sum = 0;
+                        UNUSED size_t n = 0;
+                        s.scan([&](uint32_t, uint32_t v) { sum += v; n++; return true; });
+                        assert(n == nKeys);
+                        assert(sum == uint64_t(nKeys) * initial);
+                    }
+                });
+        }
+        cybozu::util::Random<uint32_t> rand(0, nKeys - 1);
+        for (size_t i = 0; i < 20000; i++) {
+            const uint32_t k0 = rand(), k1 = rand();
+            Map::Snapshot s = m.snapshot();
+            uint32_t v0 = 0, v1 = 0;
+            UNUSED bool ret = s.find(k0, v0) && s.find(k1, v1);
+            assert(ret);
+            if (k0 == k1 || v0 == 0) continue;
+            m.commit({{k0, false, v0 - 1}, {k1, false, v1 + 1}});
+        }
+        isEnd = true;
+        for (std::thread &th : readers) th.join();
+        m.stopGc();
+        m.gc();
+        UNUSED size_t n = m.countVersions();
+        assert(n == nKeys);
+    }
+    ::printf("testMvccMap done\n");
+}
+
+void testUsl()
+{
+    auto makeCurve = [](double sigma, double kappa) {
+        bench::UslParam p{10, sigma, kappa, 0};
+        std::map<size_t, double> xs;
+        for (size_t n = 1; n <= 12; n++) xs[n] = p.predict(n);
+        return bench::fitUsl(xs);
+    };
+    /* Scales and then degrades. */
+    UNUSED bench::UslParam p = makeCurve(0.05, 0.001);
+    assert(std::fabs(p.sigma - 0.05) < 1e-6 && std::fabs(p.kappa - 0.001) < 1e-6);
+    assert(std::fabs(p.peakThreads() - std::sqrt(0.95 / 0.001)) < 1e-3);
+    assert(p.x1 < p.peakThroughput());
+
+    /* Decreasing from one thread as a single lock. */
+    p = makeCurve(2.5, 0.2);
+    assert(1 <= p.sigma);
+    assert(p.peakThreads() == 1);
+    assert(p.peakThroughput() == p.x1);
+    /* Amdahl's law and linear scaling have no peak. */
+    p = makeCurve(0.1, 0);
+    assert(std::isinf(p.peakThreads()) && std::isinf(p.peakThroughput()));
+    p = makeCurve(0, 0);
+    assert(p.sigma == 0 && p.kappa == 0);
+    assert(std::isinf(p.peakThreads()) && std::isinf(p.peakThroughput()));
+    ::printf("testUsl done\n");
+}
+
+void testCounter()
+{
+    const size_t nThreads = 4;
+    const uint64_t n = 100000;
+    cybozu::StripedCounter striped(nThreads);
+    cybozu::ApproxCounter approx(100);
+    cybozu::Snzi snzi(2);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nThreads; i++) {
+        threads.emplace_back([&, i]() {
+                cybozu::ApproxCounter::Local local(approx);
+                for (uint64_t j = 0; j < n; j++) {
+                    striped.add(i);
+                    local.add();
+                    snzi.arrive(i % snzi.numLeaves());
+                    assert(snzi.query());
+                    snzi.depart(i % snzi.numLeaves());
+                }
+            });
+    }
+    for (std::thread &th : threads) th.join();
+    assert(striped.sum() == nThreads * n);
+    assert(approx.approx() == int64_t(nThreads * n));
+    assert(!snzi.query());
+    snzi.arrive(0);
+    snzi.arrive(1);
+    snzi.depart(0);
+    assert(snzi.query());
+    snzi.depart(1);
+    assert(!snzi.query());
+    ::printf("testCounter done\n");
+}
+
+void testRandom()
+{
+    cybozu::util::SplitMix64 sm(1234567);
+    assert(sm() == 6457827717110365317ULL);
+    assert(sm() == 3203168211198807973ULL);
+
+    cybozu::util::RandomStreams streams0(7), streams1(7);
+    cybozu::util::Xoshiro128ss a0 = streams0.next(), b0 = streams0.next();
+    UNUSED cybozu::util::Xoshiro128ss a1 = streams1.next(), b1 = streams1.next();
+    UNUSED bool isSame = true;
+    for (size_t i = 0; i < 1000; i++) {
+        const uint32_t a = a0(), b = b0();
+        assert(a == a1());
+        assert(b == b1());
+        if (a != b) isSame = false;
+    }
+    assert(!isSame);
+
+    /* Both implementations of BatchRandom follow the lanes. */
+    const size_t L = cybozu::util::BatchRandom::LANES;
+    cybozu::util::RandomStreams streams2(7), streams3(7);
+    cybozu::util::BatchRandom scalar(streams2), simd(scalar);
+    scalar.setAvx2(false);
+    simd.setAvx2(true);
+    std::vector<uint32_t> v0(L * 100), v1(L * 100);
+    scalar.fill(&v0[0], v0.size());
+    simd.fill(&v1[0], v1.size());
+    assert(v0 == v1);
+    for (size_t j = 0; j < L; j++) {
+        UNUSED cybozu::util::Xoshiro128ss lane = streams3.next();
+        for (size_t i = 0; i < 100; i++) assert(v0[i * L + j] == lane());
+    }
+    assert(cybozu::util::RandomBuffer::threshold(0, 10000) == 0);
+    assert(cybozu::util::RandomBuffer::threshold(10000, 10000) == uint64_t(1) << 32);
+    ::printf("testRandom done\n");
+}
+
+/**
+ * Allocations of a phase if counting is enabled.
+ */
+void printAllocStat(const char *name, const char *phase, size_t nOps, const bench::AllocStat &s)
+{
+    if (!bench::isAllocCountEnabled) return;
+    ::printf("%s %s / %.3f allocs/op %.1f bytes/op\n"
+             , name, phase, s.allocsPerOp(nOps), s.bytesPerOp(nOps));
+}
+
+/**
+ * Memory consumption of the population.
+ */
+void printMemoryUsage(const char *name, size_t nEntries,
+                      const cybozu::util::MemoryUsage &m0,
+                      const cybozu::util::MemoryUsage &m1)
+{
+    size_t rss = m1.rss - std::min(m0.rss, m1.rss);
+    size_t heap = m1.heap - std::min(m0.heap, m1.heap);
+    ::printf("%s %zu entries memory / rss %zu KiB heap %zu KiB peak rss %zu KiB"
+             " / %.1f bytes/entry (heap) %.1f bytes/entry (rss)\n"
+             , name, nEntries, rss >> 10, heap >> 10, m1.peakRss >> 10
+             , heap / (double)nEntries, rss / (double)nEntries);
+}
+
 void benchStdMap(size_t n0, uint32_t seed)
 {
 #if 0
@@ -254,7 +1408,11 @@ void benchStdMap(size_t n0, uint32_t seed)
     uint32_t total = 0;
     cybozu::time::TimeStack<> ts;
 
+    cybozu::util::releaseFreeMemory();
+    cybozu::util::resetPeakRss();
+    auto mem0 = cybozu::util::MemoryUsage::now();
     ts.clear();
+    bench::AllocStat alloc0 = bench::getAllocStat();
     ts.pushNow();
     for (size_t i = 0; i < n0; i++) {
         uint32_t r = rand();
@@ -263,6 +1421,8 @@ void benchStdMap(size_t n0, uint32_t seed)
     }
     ts.pushNow();
     ::printf("std::map %zu records insertion / %lu ms\n", n0, ts.elapsedInMs());
+    printAllocStat("std::map", "insertion", n0, bench::getAllocStat() - alloc0);
+    printMemoryUsage("std::map", m1.size(), mem0, cybozu::util::MemoryUsage::now());
 
     ts.clear();
     ts.pushNow();
@@ -284,6 +1444,7 @@ void benchStdMap(size_t n0, uint32_t seed)
     ::printf("std::map %zu records search / %lu ms\n", n0, ts.elapsedInMs());
     
     ts.clear();
+    alloc0 = bench::getAllocStat();
     ts.pushNow();
     for (size_t i = 0; i < n0; i++) {
         auto it = m1.lower_bound(rand());
@@ -295,6 +1456,18 @@ void benchStdMap(size_t n0, uint32_t seed)
     }
     ts.pushNow();
     ::printf("std::map %zu deletion,insertion / %lu ms\n", n0, ts.elapsedInMs());
+    printAllocStat("std::map", "deletion,insertion", n0, bench::getAllocStat() - alloc0);
+}
+
+/**
+ * Print and reset the cost breakdown if profiling is enabled.
+ */
+void printOpProfile(const char *name, const char *phase)
+{
+    if (!cybozu::btree_prof::isEnabled) return;
+    ::printf("%s %s cost breakdown:\n", name, phase);
+    cybozu::btree_prof::print(::stdout);
+    cybozu::btree_prof::reset();
 }
 
 void benchBtreeMap(size_t n0, uint32_t seed)
@@ -309,6 +1482,10 @@ void benchBtreeMap(size_t n0, uint32_t seed)
     uint32_t total = 0;
     cybozu::time::TimeStack<> ts;
 
+    cybozu::util::releaseFreeMemory();
+    cybozu::util::resetPeakRss();
+    auto mem0 = cybozu::util::MemoryUsage::now();
+    bench::AllocStat alloc0 = bench::getAllocStat();
     ts.pushNow();
     for (size_t i = 0; i < n0; i++) {
         uint32_t r = rand();
@@ -316,6 +1493,9 @@ void benchBtreeMap(size_t n0, uint32_t seed)
     }
     ts.pushNow();
     ::printf("btreemap %zu records insertion / %lu ms\n", n0, ts.elapsedInMs());
+    printAllocStat("btreemap", "insertion", n0, bench::getAllocStat() - alloc0);
+    printOpProfile("btreemap", "insertion");
+    printMemoryUsage("btreemap", m0.size(), mem0, cybozu::util::MemoryUsage::now());
 
     ts.clear();
     ts.pushNow();
@@ -335,8 +1515,10 @@ void benchBtreeMap(size_t n0, uint32_t seed)
     }
     ts.pushNow();
     ::printf("btreemap %zu records search / %lu ms\n", n0, ts.elapsedInMs());
+    printOpProfile("btreemap", "search");
 
     ts.clear();
+    alloc0 = bench::getAllocStat();
     ts.pushNow();
     for (size_t i = 0; i < n0; i++) {
         auto it = m0.lowerBound(rand());
@@ -350,6 +1532,8 @@ void benchBtreeMap(size_t n0, uint32_t seed)
     }
     ts.pushNow();
     ::printf("btreemap %zu deletion,insertion / %lu ms\n", n0, ts.elapsedInMs());
+    printAllocStat("btreemap", "deletion,insertion", n0, bench::getAllocStat() - alloc0);
+    printOpProfile("btreemap", "deletion,insertion");
 }
 
 int main()
@@ -357,7 +1541,21 @@ int main()
 #if 0
     testPage0();
     testPage1();
+    testPage2();
     testBtreeMap0();
+    testBtreeMapStats();
+    testBtreeMapSetOps();
+    testBtreeMapSplitConcat();
+    testBtreeMapAggregate();
+    testBtreeMapTopDown();
+    testPageRef();
+    testBtreeMapApplyBatch();
+    testBlinkTreeMap();
+    testBlinkTreeMapTransaction();
+    testMvccMap();
+    testUsl();
+    testCounter();
+    testRandom();
 #endif
 #if 1
     const size_t n = 1000000;
@@ -0,0 +1,261 @@
+#pragma once
+/**
+ * @file
+ * @description lightweight event tracing.
+ *
+ * Define CYBOZU_TRACE (make TRACE=1) to enable CYBOZU_TRACE_EVENT().
+ * Without the macro, the trace points are compiled out.
+ *
+ * Each thread writes 16-byte binary records with TSC timestamps
+ * into its own ring buffer. The oldest records will be overwritten.
+ * Call dumpChromeTrace() after the threads finished
+ * to get Chrome trace (Perfetto) JSON.
+ */
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cpuid.h>
+#include "tsc.hpp"
+
+namespace cybozu {
+namespace trace {
+
+enum class Event : uint8_t
+{
+    LOCK_TRY, LOCK_ACQUIRE, LOCK_RELEASE, ELISION_ABORT,
+    SPLIT, MERGE, GC, LIFT_UP,
+};
+
+#ifdef CYBOZU_TRACE
+constexpr bool isEnabled = true;
+#else
+constexpr bool isEnabled = false;
+#endif
+
+#ifndef CYBOZU_TRACE_RING_SIZE
+#define CYBOZU_TRACE_RING_SIZE (1 << 16) /* records per thread. power of two. */
+#endif
+
+struct Record
+{
+    uint64_t tsc;
+    uint32_t arg; /* lock address or page level. */
+    Event event;
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(Record) == 16, "Record size must be 16.");
+
+/**
+ * Per-thread ring buffer.
+ */
+class Ring
+{
+private:
+    std::vector<Record> buf_;
+    uint64_t pos_; /* total number of records written. */
+    const uint32_t id_;
+public:
+    explicit Ring(uint32_t id)
+        : buf_(CYBOZU_TRACE_RING_SIZE), pos_(0), id_(id) {
+    }
+    void put(Event event, uint32_t arg) {
+        Record &r = buf_[pos_ & (buf_.size() - 1)];
+        r.tsc = tsc::now();
+        r.arg = arg;
+        r.event = event;
+        pos_++;
+    }
+    uint32_t id() const { return id_; }
+    void clear() { pos_ = 0; }
+    /**
+     * Call func for each stored record in the written order.
+     */
+    template <typename Func>
+    void forEach(Func func) const {
+        uint64_t n = std::min<uint64_t>(pos_, buf_.size());
+        for (uint64_t i = pos_ - n; i < pos_; i++) {
+            func(buf_[i & (buf_.size() - 1)]);
+        }
+    }
+    uint64_t minTsc() const {
+        if (pos_ == 0) return uint64_t(-1);
+        uint64_t n = std::min<uint64_t>(pos_, buf_.size());
+        return buf_[(pos_ - n) & (buf_.size() - 1)].tsc;
+    }
+};
+
+/**
+ * All the ring buffers.
+ * A ring buffer of an exited thread will be reused by a new thread.
+ */
+class Registry
+{
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Ring> > rings_;
+    std::vector<Ring *> freeRings_;
+
+public:
+    Ring *get() {
+        std::lock_guard<std::mutex> lk(mutex_);
+        if (!freeRings_.empty()) {
+            Ring *r = freeRings_.back();
+            freeRings_.pop_back();
+            return r;
+        }
+        rings_.emplace_back(new Ring(rings_.size()));
+        return rings_.back().get();
+    }
+    void put(Ring *r) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        freeRings_.push_back(r);
+    }
+    /**
+     * Remove all the records.
+     * Writer threads must not be running.
+     */
+    void clear() {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (auto &r : rings_) r->clear();
+    }
+    /**
+     * Writer threads must not be running.
+     */
+    void dumpChromeTrace(::FILE *fp) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        const double ticksPerUs = tsc::ticksPerNs() * 1000;
+        uint64_t base = uint64_t(-1);
+        for (auto &r : rings_) base = std::min(base, r->minTsc());
+
+        ::fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        bool isFirst = true;
+        for (auto &r : rings_) {
+            const uint32_t tid = r->id();
+            r->forEach([&](const Record &rec) {
+                    double ts = (rec.tsc - base) / ticksPerUs;
+                    putEvent(fp, isFirst, rec, tid, ts);
+                });
+        }
+        ::fprintf(fp, "\n]}\n");
+    }
+private:
+    static void putEvent(::FILE *fp, bool &isFirst, const Record &rec, uint32_t tid, double ts) {
+        auto put = [&](const char *name, const char *ph) {
+            ::fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":0,\"tid\":%u,\"ts\":%.3f"
+                      ",\"args\":{\"arg\":%u}%s}"
+                      , isFirst ? "" : ",\n", name, ph, tid, ts, rec.arg
+                      , ph[0] == 'i' ? ",\"s\":\"t\"" : "");
+            isFirst = false;
+        };
+        switch (rec.event) {
+        case Event::LOCK_TRY:
+            put("lock wait", "B");
+            break;
+        case Event::LOCK_ACQUIRE:
+            put("lock wait", "E");
+            put("lock hold", "B");
+            break;
+        case Event::LOCK_RELEASE:
+            put("lock hold", "E");
+            break;
+        case Event::ELISION_ABORT:
+            put("elision abort", "i");
+            break;
+        case Event::SPLIT:
+            put("split", "i");
+            break;
+        case Event::MERGE:
+            put("merge", "i");
+            break;
+        case Event::GC:
+            put("gc", "i");
+            break;
+        case Event::LIFT_UP:
+            put("liftUp", "i");
+            break;
+        }
+    }
+};
+
+static inline Registry &registry()
+{
+    static Registry r;
+    return r;
+}
+
+/**
+ * Ring buffer of the calling thread.
+ */
+static inline Ring &localRing()
+{
+    struct Holder
+    {
+        Ring *ring;
+        Holder() : ring(registry().get()) {}
+        ~Holder() noexcept { registry().put(ring); }
+    };
+    static thread_local Holder holder;
+    return *holder.ring;
+}
+
+static inline void put(Event event, uint32_t arg)
+{
+    localRing().put(event, arg);
+}
+
+static inline void put(Event event, const void *p)
+{
+    localRing().put(event, uint32_t(uintptr_t(p)));
+}
+
+/**
+ * Whether the cpu can tell elided critical sections by XTEST.
+ */
+static inline bool canXtest()
+{
+    static const bool ret = []() {
+        unsigned int a, b, c, d;
+        if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+        return (b & (1 << 4)) != 0 || (b & (1 << 11)) != 0; /* HLE or RTM. */
+    }();
+    return ret;
+}
+
+__attribute__((target("rtm")))
+static inline bool xtest()
+{
+    return _xtest() != 0;
+}
+
+/**
+ * Call this just after acquiring an HLE lock.
+ * The lock was not elided if the thread is not in transactional execution.
+ */
+static inline void putIfNotElided(const void *lock)
+{
+    if (canXtest() && !xtest()) put(Event::ELISION_ABORT, lock);
+}
+
+static inline void dumpChromeTrace(::FILE *fp)
+{
+    registry().dumpChromeTrace(fp);
+}
+
+static inline void clear()
+{
+    registry().clear();
+}
+
+}} //namespace cybozu::trace
+
+#ifdef CYBOZU_TRACE
+#define CYBOZU_TRACE_EVENT(event, arg) ::cybozu::trace::put(::cybozu::trace::Event::event, arg)
+#define CYBOZU_TRACE_ELISION(lock) ::cybozu::trace::putIfNotElided(lock)
+#else
+#define CYBOZU_TRACE_EVENT(event, arg) ((void)0)
+#define CYBOZU_TRACE_ELISION(lock) ((void)0)
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+/**
+ * @file
+ * @description time stamp counter utilities.
+ */
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <x86intrin.h> /* for __rdtsc() */
+
+namespace cybozu {
+namespace tsc {
+
+static inline uint64_t now()
+{
+    return __rdtsc();
+}
+
+/**
+ * TSC ticks per nanosecond.
+ * This is measured at the first call (it takes about 10ms).
+ */
+static inline double ticksPerNs()
+{
+    static const double ret = []() {
+        auto t0 = std::chrono::steady_clock::now();
+        uint64_t c0 = now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto t1 = std::chrono::steady_clock::now();
+        uint64_t c1 = now();
+        double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+        return ns <= 0 ? 1.0 : (c1 - c0) / ns;
+    }();
+    return ret;
+}
+
+static inline double toNs(uint64_t ticks)
+{
+    return ticks / ticksPerNs();
+}
+
+}} //namespace cybozu::tsc
@@ -0,0 +1,112 @@
+#pragma once
+/**
+ * @file
+ * @description Universal Scalability Law fitting.
+ *
+ *   X(N) = X(1) * N / (1 + sigma * (N - 1) + kappa * N * (N - 1))
+ * sigma is the contention coefficient and kappa is the coherency coefficient.
+ * kappa = 0 corresponds to Amdahl's law.
+ */
+#include <cmath>
+#include <algorithm>
+#include <map>
+#include <limits>
+#include <stdexcept>
+
+namespace bench {
+
+struct UslParam
+{
+    double x1; /* throughput with one thread. */
+    double sigma;
+    double kappa;
+    double r2; /* coefficient of determination of the throughput. */
+
+    double predict(double n) const {
+        return x1 * n / (1 + sigma * (n - 1) + kappa * n * (n - 1));
+    }
+    /**
+     * Thread count that maximizes the throughput.
+     * 1 if the throughput never increases, infinity if it never decreases.
+     */
+    double peakThreads() const {
+        if (1 <= sigma) return 1;
+        if (kappa <= 0) return std::numeric_limits<double>::infinity();
+        return std::max(1.0, std::sqrt((1 - sigma) / kappa));
+    }
+    /**
+     * The maximum throughput. Infinity if it is unbounded.
+     */
+    double peakThroughput() const {
+        const double n = peakThreads();
+        if (std::isinf(n)) return n;
+        return predict(n);
+    }
+};
+
+/**
+ * Least squares fitting of the linearized form:
+ *   N / C(N) - 1 = sigma * (N - 1) + kappa * N * (N - 1)
+ * where C(N) = X(N) / X(1).
+ * The coefficients are constrained to be non-negative.
+ */
+inline UslParam fitUsl(const std::map<size_t, double> &xs)
+{
+    auto it = xs.find(1);
+    if (it == xs.end() || it->second <= 0) {
+        throw std::runtime_error("no result with 1 thread.");
+    }
+    UslParam p;
+    p.x1 = it->second;
+
+    double s11 = 0, s12 = 0, s22 = 0, s1y = 0, s2y = 0;
+    for (const auto &pair : xs) {
+        double n = pair.first;
+        if (pair.second <= 0) continue;
+        double y = n * p.x1 / pair.second - 1;
+        double a = n - 1;
+        double b = n * (n - 1);
+        s11 += a * a; s12 += a * b; s22 += b * b;
+        s1y += a * y; s2y += b * y;
+    }
+    double det = s11 * s22 - s12 * s12;
+    p.sigma = 0;
+    p.kappa = 0;
+    if (det != 0) {
+        p.sigma = (s1y * s22 - s2y * s12) / det;
+        p.kappa = (s2y * s11 - s1y * s12) / det;
+    }
+    if (det == 0 || p.sigma < 0 || p.kappa < 0) {
+        /* Try one-parameter fittings. */
+        double sigma = (s11 == 0) ? 0 : std::max(0.0, s1y / s11);
+        double kappa = (s22 == 0) ? 0 : std::max(0.0, s2y / s22);
+        double e0 = 0, e1 = 0;
+        for (const auto &pair : xs) {
+            double n = pair.first;
+            if (pair.second <= 0) continue;
+            double y = n * p.x1 / pair.second - 1;
+            e0 += std::pow(y - sigma * (n - 1), 2);
+            e1 += std::pow(y - kappa * n * (n - 1), 2);
+        }
+        if (e0 <= e1) {
+            p.sigma = sigma;
+            p.kappa = 0;
+        } else {
+            p.sigma = 0;
+            p.kappa = kappa;
+        }
+    }
+
+    double avg = 0;
+    for (const auto &pair : xs) avg += pair.second;
+    avg /= xs.size();
+    double ssRes = 0, ssTot = 0;
+    for (const auto &pair : xs) {
+        ssRes += std::pow(pair.second - p.predict(pair.first), 2);
+        ssTot += std::pow(pair.second - avg, 2);
+    }
+    p.r2 = (ssTot == 0) ? 1 : 1 - ssRes / ssTot;
+    return p;
+}
+
+} //namespace bench
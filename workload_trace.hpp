@@ -0,0 +1,210 @@
+#pragma once
+/**
+ * @file
+ * @description binary workload trace.
+ *
+ * File layout:
+ *   Header (64 bytes) followed by nRecords Records (16 bytes each).
+ *   All the integers are little endian.
+ *
+ * TraceRecorder appends records from any thread.
+ * TraceFile mmaps a trace file so that replayers read records in place.
+ */
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace cybozu {
+namespace workload {
+
+enum class Op : uint8_t
+{
+    GET, INSERT, UPDATE, ERASE,
+};
+
+static inline const char *opName(Op op)
+{
+    static const char *const tbl[] = {
+        "get", "insert", "update", "erase",
+    };
+    return tbl[size_t(op)];
+}
+
+constexpr char MAGIC[8] = {'C', 'Y', 'B', 'W', 'T', 'R', 'C', '1'};
+constexpr uint32_t VERSION = 1;
+
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t nRecords;
+    uint32_t nThreads; /* number of distinct thread ids (max tid + 1). */
+    uint8_t reserved[36];
+};
+
+static_assert(sizeof(Header) == 64, "Header size must be 64.");
+
+struct Record
+{
+    uint64_t key;
+    uint32_t tsDelta; /* [ns] from the previous record in the file. saturated. */
+    uint16_t valueSize;
+    Op op;
+    uint8_t tid; /* recording thread id. */
+};
+
+static_assert(sizeof(Record) == 16, "Record size must be 16.");
+
+/**
+ * Append records to a trace file.
+ * Thread-safe. Records are written in the order of record() calls.
+ */
+class TraceRecorder
+{
+private:
+    std::mutex mutex_;
+    ::FILE *fp_;
+    Header header_;
+    std::chrono::steady_clock::time_point last_;
+
+public:
+    explicit TraceRecorder(const std::string &path)
+        : fp_(::fopen(path.c_str(), "wb")), last_(std::chrono::steady_clock::now()) {
+        if (!fp_) throw std::system_error(errno, std::system_category(), "fopen " + path);
+        ::memset(&header_, 0, sizeof(header_));
+        ::memcpy(header_.magic, MAGIC, sizeof(MAGIC));
+        header_.version = VERSION;
+        header_.recordSize = sizeof(Record);
+        write(&header_, sizeof(header_));
+    }
+    ~TraceRecorder() noexcept {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+    TraceRecorder(const TraceRecorder &) = delete;
+    TraceRecorder &operator=(const TraceRecorder &) = delete;
+    /**
+     * Record an operation with the current time.
+     */
+    void record(Op op, uint64_t key, uint16_t valueSize, uint8_t tid) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_).count();
+        last_ = now;
+        putRecord(op, key, valueSize, tid, ns);
+    }
+    /**
+     * Record an operation with a given time delta.
+     * This is for synthetic traces.
+     */
+    void recordWithDelta(Op op, uint64_t key, uint16_t valueSize, uint8_t tid, uint64_t deltaNs) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        putRecord(op, key, valueSize, tid, deltaNs);
+    }
+    /**
+     * Write the header and close the file.
+     */
+    void close() {
+        std::lock_guard<std::mutex> lk(mutex_);
+        if (!fp_) return;
+        ::FILE *fp = fp_;
+        fp_ = nullptr;
+        bool ok = ::fseek(fp, 0, SEEK_SET) == 0;
+        ok = ok && ::fwrite(&header_, sizeof(header_), 1, fp) == 1;
+        ok = (::fclose(fp) == 0) && ok;
+        if (!ok) throw std::runtime_error("could not write the trace header.");
+    }
+private:
+    void putRecord(Op op, uint64_t key, uint16_t valueSize, uint8_t tid, uint64_t deltaNs) {
+        Record r;
+        r.key = key;
+        r.tsDelta = deltaNs > UINT32_MAX ? UINT32_MAX : uint32_t(deltaNs);
+        r.valueSize = valueSize;
+        r.op = op;
+        r.tid = tid;
+        write(&r, sizeof(r));
+        header_.nRecords++;
+        if (header_.nThreads <= tid) header_.nThreads = tid + 1;
+    }
+    void write(const void *data, size_t size) {
+        if (!fp_) throw std::runtime_error("the trace is already closed.");
+        if (::fwrite(data, size, 1, fp_) != 1) {
+            throw std::runtime_error("could not write the trace.");
+        }
+    }
+};
+
+/**
+ * Read-only mmapped trace file.
+ */
+class TraceFile
+{
+private:
+    void *addr_;
+    size_t size_;
+
+public:
+    explicit TraceFile(const std::string &path) : addr_(nullptr), size_(0) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::system_error(errno, std::system_category(), "open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::system_category(), "fstat " + path);
+        }
+        size_ = st.st_size;
+        if (size_ < sizeof(Header)) {
+            ::close(fd);
+            throw std::runtime_error("too small trace file: " + path);
+        }
+        addr_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        int err = errno;
+        ::close(fd);
+        if (addr_ == MAP_FAILED) {
+            addr_ = nullptr;
+            throw std::system_error(err, std::system_category(), "mmap " + path);
+        }
+        const Header &h = header();
+        if (::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION ||
+            h.recordSize != sizeof(Record) ||
+            size_ < sizeof(Header) + h.nRecords * sizeof(Record)) {
+            ::munmap(addr_, size_);
+            addr_ = nullptr;
+            throw std::runtime_error("invalid trace file: " + path);
+        }
+        ::madvise(addr_, size_, MADV_SEQUENTIAL);
+    }
+    ~TraceFile() noexcept {
+        if (addr_) ::munmap(addr_, size_);
+    }
+    TraceFile(const TraceFile &) = delete;
+    TraceFile &operator=(const TraceFile &) = delete;
+
+    const Header &header() const {
+        return *reinterpret_cast<const Header *>(addr_);
+    }
+    size_t size() const { return header().nRecords; }
+    size_t numThreads() const { return header().nThreads; }
+    const Record *begin() const {
+        return reinterpret_cast<const Record *>(reinterpret_cast<const char *>(addr_) + sizeof(Header));
+    }
+    const Record *end() const { return begin() + size(); }
+    const Record &operator[](size_t i) const { return begin()[i]; }
+};
+
+}} //namespace cybozu::workload